@@ -0,0 +1,1370 @@
+// Command line benchmark of the GIF & APNG readers, without LÖVE. Decodes
+// every frame of a synthetic corpus (or the files given) over and over,
+// from a buffer and streamed from Lua, and reports throughput, per-frame
+// latency and peak memory. With --verify, it instead checks that the native
+// GIF decoder decodes exactly what giflib does, and with --preload it times
+// decoding whole animations up front on one thread and on the pool. Run
+// with --help for the options.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "zlib.h"
+
+#include "devi/compositor.hpp"
+#include "devi/devi.hpp"
+#include "devi/lua_file.hpp"
+#include "devi/read_apng.hpp"
+#include "devi/read_gif.hpp"
+#include "devi/thread_pool.hpp"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+static const double DEVI_BENCH_DEFAULT_TIME = 0.5;
+static const int DEVI_BENCH_LZW_TABLE_BITS = 13;
+static const int DEVI_BENCH_LZW_MAX_CODES = 4096;
+
+enum
+{
+    BENCH_FORMAT_GIF,
+    BENCH_FORMAT_APNG
+};
+
+enum
+{
+    BENCH_MODE_BUFFERED = 1,
+    BENCH_MODE_STREAMED = 2
+};
+
+// An image of the synthetic corpus. GIFs use 'bits' bits per index; APNGs
+// use 'color_type' and 'bit_depth' as in the PNG header.
+struct BenchSpec
+{
+    int format;
+    int width;
+    int height;
+    int num_frames;
+
+    int bits = 8;
+    bool is_interlaced = false;
+
+    int color_type = PNG_COLOR_TYPE_RGBA;
+    int bit_depth = 8;
+
+    // GIFs only, for --verify: clear the LZW table every 'clear_interval'
+    // codes as well as when it fills up, or (if deferred) never clear a full
+    // table; encode extra indices past the end of each frame; cut the file
+    // off halfway through the last frame's image data.
+    int clear_interval = 0;
+    bool is_clear_deferred = false;
+    int num_extra_indices = 0;
+    bool is_truncated = false;
+};
+
+struct BenchImage
+{
+    std::string name;
+    int format;
+    std::vector<std::uint8_t> data;
+};
+
+struct BenchOptions
+{
+    double time = DEVI_BENCH_DEFAULT_TIME;
+    int modes = BENCH_MODE_BUFFERED | BENCH_MODE_STREAMED;
+    int gif_decoder = devi::GIF_DECODER_NATIVE;
+    std::string filter;
+    bool is_csv = false;
+    bool is_verify = false;
+
+    // Threads for --preload (0 for the whole pool); -1 if not preloading.
+    int preload_threads = -1;
+    std::vector<std::string> filenames;
+};
+
+struct BenchResult
+{
+    int width = 0;
+    int height = 0;
+    int num_frames = 0;
+
+    double open_time = 0.0;
+    double decode_time = 0.0;
+    std::size_t num_loops = 0;
+
+    // Seconds, one per frame decoded.
+    std::vector<double> latencies;
+
+    std::size_t peak_rss = 0;
+};
+
+// Keeps the whole file in Lua and hands it out like a LÖVE File would, so
+// streamed reads go through Lua exactly as they do in a game.
+static const char* DEVI_BENCH_STREAMED_FILE = R"(
+    local data = ...
+    local file = { position = 0 }
+
+    function file:open()
+        self.position = 0
+    end
+
+    function file:close()
+    end
+
+    function file:read(size)
+        local result = data:sub(self.position + 1, self.position + size)
+        self.position = self.position + #result
+
+        return result
+    end
+
+    function file:seek(position)
+        self.position = position
+    end
+
+    return file
+)";
+
+static double devi_bench_now()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Only Linux can reset the peak, so elsewhere it carries over from earlier
+// (possibly larger) images.
+static void devi_bench_reset_peak_rss()
+{
+#if defined(__linux__)
+    if (auto file = std::fopen("/proc/self/clear_refs", "w"))
+    {
+        std::fputs("5", file);
+        std::fclose(file);
+    }
+#endif
+}
+
+static std::size_t devi_bench_get_peak_rss()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return counters.PeakWorkingSetSize;
+    }
+
+    return 0;
+#elif defined(__linux__)
+    std::size_t result = 0;
+    if (auto file = std::fopen("/proc/self/status", "r"))
+    {
+        char line[256];
+        while (std::fgets(line, sizeof(line), file))
+        {
+            unsigned long size;
+            if (std::sscanf(line, "VmHWM: %lu kB", &size) == 1)
+            {
+                result = (std::size_t)size * 1024;
+                break;
+            }
+        }
+
+        std::fclose(file);
+    }
+
+    return result;
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // Bytes on macOS.
+    return (std::size_t)usage.ru_maxrss;
+#endif
+}
+
+// Procedural 16-bit samples: flat 8x8 blocks scrolling with the frame,
+// noisy patches, and (for alpha) a moving disc with a soft edge. Roughly
+// what real animations compress like.
+static std::uint32_t devi_bench_sample(int x, int y, int frame, int channel)
+{
+    if (channel == 3)
+    {
+        auto dx = x - (frame * 5) % 97 - 24;
+        auto dy = y - (frame * 3) % 61 - 24;
+        auto distance = dx * dx + dy * dy;
+
+        if (distance < 24 * 24)
+        {
+            return 65535;
+        }
+
+        return distance < 32 * 32 ? 32768 : 0;
+    }
+
+    std::uint32_t value = ((((x + frame * 3) >> 3) + (y >> 3)) * 2741 + channel * 11213) & 0xffff;
+    if (((x >> 5) + (y >> 5)) % 3 == 0)
+    {
+        value ^= ((x * 131 + y * 71 + frame * 17 + channel * 29) * 2654435761u) >> 24;
+    }
+
+    return value;
+}
+
+// Frame 0 covers the canvas; later ones a quarter of it, moving around.
+static void devi_bench_get_frame_rectangle(const BenchSpec& spec, int frame, devi::Rectangle& rectangle)
+{
+    if (frame == 0)
+    {
+        rectangle.x = 0;
+        rectangle.y = 0;
+        rectangle.width = spec.width;
+        rectangle.height = spec.height;
+        return;
+    }
+
+    rectangle.width = std::max(spec.width / 2, 1);
+    rectangle.height = std::max(spec.height / 2, 1);
+    rectangle.x = (frame * 7) % (spec.width - rectangle.width + 1);
+    rectangle.y = (frame * 5) % (spec.height - rectangle.height + 1);
+}
+
+static void devi_bench_put16(std::vector<std::uint8_t>& output, std::uint32_t value)
+{
+    output.push_back((std::uint8_t)(value & 0xff));
+    output.push_back((std::uint8_t)(value >> 8));
+}
+
+struct BenchBits
+{
+    std::vector<std::uint8_t> bytes;
+    std::uint32_t bits = 0;
+    int num_bits = 0;
+};
+
+static void devi_bench_put_code(BenchBits& writer, int code, int code_size)
+{
+    writer.bits |= (std::uint32_t)code << writer.num_bits;
+    writer.num_bits += code_size;
+
+    while (writer.num_bits >= 8)
+    {
+        writer.bytes.push_back((std::uint8_t)writer.bits);
+        writer.bits >>= 8;
+        writer.num_bits -= 8;
+    }
+}
+
+// Grows the code size exactly when a decoder does: once the next code no
+// longer fits.
+static void devi_bench_next_code(int& next_code, int& code_size)
+{
+    if (next_code < DEVI_BENCH_LZW_MAX_CODES)
+    {
+        ++next_code;
+        if (next_code > (1 << code_size) && code_size < 12)
+        {
+            ++code_size;
+        }
+    }
+}
+
+// A plain LZW encoder, clearing the table whenever it fills up (unless the
+// clear is deferred, in which case the full table is used as is) and every
+// 'clear_interval' codes if that's not 0. Writes the minimum code size and
+// the data sub-blocks.
+static void devi_bench_encode_lzw(const std::uint8_t* indices, std::size_t count, int min_code_size, int clear_interval, bool is_clear_deferred, std::vector<std::uint8_t>& output)
+{
+    const int clear_code = 1 << min_code_size;
+    const int end_code = clear_code + 1;
+    const std::size_t table_size = (std::size_t)1 << DEVI_BENCH_LZW_TABLE_BITS;
+
+    // Open addressing table from a string (its prefix's code and its last
+    // index) to its code.
+    std::vector<std::int32_t> keys(table_size, -1);
+    std::vector<std::int16_t> codes(table_size);
+
+    BenchBits writer;
+    int code_size = min_code_size + 1;
+    int next_code = end_code + 1;
+    int num_codes = 0;
+
+    devi_bench_put_code(writer, clear_code, code_size);
+
+    int prefix = indices[0];
+    for (std::size_t i = 1; i < count; ++i)
+    {
+        std::int32_t key = (prefix << 8) | indices[i];
+
+        auto slot = ((std::uint32_t)key * 2654435761u) >> (32 - DEVI_BENCH_LZW_TABLE_BITS);
+        while (keys[slot] != -1 && keys[slot] != key)
+        {
+            slot = (slot + 1) & (table_size - 1);
+        }
+
+        if (keys[slot] == key)
+        {
+            prefix = codes[slot];
+            continue;
+        }
+
+        devi_bench_put_code(writer, prefix, code_size);
+        ++num_codes;
+
+        auto is_full = next_code == DEVI_BENCH_LZW_MAX_CODES;
+        if (!is_full)
+        {
+            keys[slot] = key;
+            codes[slot] = (std::int16_t)next_code;
+            devi_bench_next_code(next_code, code_size);
+
+            is_full = next_code == DEVI_BENCH_LZW_MAX_CODES;
+        }
+
+        if ((is_full && !is_clear_deferred) || (clear_interval > 0 && num_codes >= clear_interval))
+        {
+            devi_bench_put_code(writer, clear_code, code_size);
+
+            std::fill(keys.begin(), keys.end(), -1);
+            code_size = min_code_size + 1;
+            next_code = end_code + 1;
+            num_codes = 0;
+        }
+
+        prefix = indices[i];
+    }
+
+    devi_bench_put_code(writer, prefix, code_size);
+    devi_bench_next_code(next_code, code_size);
+    devi_bench_put_code(writer, end_code, code_size);
+
+    if (writer.num_bits > 0)
+    {
+        writer.bytes.push_back((std::uint8_t)writer.bits);
+    }
+
+    output.push_back((std::uint8_t)min_code_size);
+    for (std::size_t i = 0; i < writer.bytes.size(); i += 255)
+    {
+        auto size = std::min<std::size_t>(writer.bytes.size() - i, 255);
+        output.push_back((std::uint8_t)size);
+        output.insert(output.end(), writer.bytes.begin() + i, writer.bytes.begin() + i + size);
+    }
+
+    output.push_back(0);
+}
+
+static void devi_bench_make_gif(const BenchSpec& spec, std::vector<std::uint8_t>& output)
+{
+    static const char HEADER[] = "GIF89a";
+    output.insert(output.end(), HEADER, HEADER + 6);
+
+    // Logical screen descriptor with a global color table.
+    devi_bench_put16(output, spec.width);
+    devi_bench_put16(output, spec.height);
+    output.push_back((std::uint8_t)(0x80 | 0x70 | (spec.bits - 1)));
+    output.push_back(0);
+    output.push_back(0);
+
+    auto num_colors = 1 << spec.bits;
+    for (auto i = 0; i < num_colors; ++i)
+    {
+        output.push_back((std::uint8_t)(i * 255 / std::max(num_colors - 1, 1)));
+        output.push_back((std::uint8_t)(i * 97));
+        output.push_back((std::uint8_t)(255 - i * 53));
+    }
+
+    // Loops forever.
+    static const std::uint8_t NETSCAPE[] = { 0x21, 0xff, 0x0b, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00 };
+    output.insert(output.end(), std::begin(NETSCAPE), std::end(NETSCAPE));
+
+    std::vector<std::uint8_t> indices;
+    std::size_t data_offset = 0;
+    for (auto frame = 0; frame < spec.num_frames; ++frame)
+    {
+        devi::Rectangle rectangle;
+        devi_bench_get_frame_rectangle(spec, frame, rectangle);
+
+        // Graphics control extension: cycles through the disposal methods,
+        // with index 0 transparent.
+        output.push_back(0x21);
+        output.push_back(0xf9);
+        output.push_back(4);
+        output.push_back((std::uint8_t)(((frame % 3 + 1) << 2) | 1));
+        devi_bench_put16(output, 3);
+        output.push_back(0);
+        output.push_back(0);
+
+        output.push_back(0x2c);
+        devi_bench_put16(output, rectangle.x);
+        devi_bench_put16(output, rectangle.y);
+        devi_bench_put16(output, rectangle.width);
+        devi_bench_put16(output, rectangle.height);
+        output.push_back(spec.is_interlaced ? 0x40 : 0);
+
+        // Interlaced rows are stored in four passes.
+        std::vector<int> rows;
+        if (spec.is_interlaced)
+        {
+            static const int STARTS[] = { 0, 4, 2, 1 };
+            static const int STEPS[] = { 8, 8, 4, 2 };
+
+            for (auto pass = 0; pass < 4; ++pass)
+            {
+                for (auto y = STARTS[pass]; y < (int)rectangle.height; y += STEPS[pass])
+                {
+                    rows.push_back(y);
+                }
+            }
+        }
+        else
+        {
+            for (auto y = 0; y < (int)rectangle.height; ++y)
+            {
+                rows.push_back(y);
+            }
+        }
+
+        indices.clear();
+        for (auto y : rows)
+        {
+            for (auto x = 0; x < (int)rectangle.width; ++x)
+            {
+                auto sample = devi_bench_sample(rectangle.x + x, rectangle.y + y, frame, 0);
+                indices.push_back((std::uint8_t)(sample >> (16 - spec.bits)));
+            }
+        }
+
+        for (auto i = 0; i < spec.num_extra_indices; ++i)
+        {
+            indices.push_back((std::uint8_t)(i % (1 << spec.bits)));
+        }
+
+        data_offset = output.size();
+        devi_bench_encode_lzw(&indices[0], indices.size(), std::max(spec.bits, 2), spec.clear_interval, spec.is_clear_deferred, output);
+    }
+
+    if (spec.is_truncated)
+    {
+        output.resize(data_offset + (output.size() - data_offset) / 2);
+        return;
+    }
+
+    output.push_back(0x3b);
+}
+
+static void devi_bench_put32(std::vector<std::uint8_t>& output, std::uint32_t value)
+{
+    output.push_back((std::uint8_t)(value >> 24));
+    output.push_back((std::uint8_t)(value >> 16));
+    output.push_back((std::uint8_t)(value >> 8));
+    output.push_back((std::uint8_t)value);
+}
+
+static void devi_bench_put_chunk(std::vector<std::uint8_t>& output, const char* type, const std::vector<std::uint8_t>& data)
+{
+    devi_bench_put32(output, (std::uint32_t)data.size());
+
+    auto start = output.size();
+    output.insert(output.end(), type, type + 4);
+    output.insert(output.end(), data.begin(), data.end());
+
+    auto crc = crc32(crc32(0, Z_NULL, 0), &output[start], (uInt)(output.size() - start));
+    devi_bench_put32(output, (std::uint32_t)crc);
+}
+
+static int devi_bench_get_num_channels(int color_type)
+{
+    switch (color_type)
+    {
+        case PNG_COLOR_TYPE_RGB:
+            return 3;
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+            return 2;
+        case PNG_COLOR_TYPE_RGBA:
+            return 4;
+        case PNG_COLOR_TYPE_GRAY:
+        case PNG_COLOR_TYPE_PALETTE:
+        default:
+            return 1;
+    }
+}
+
+// Packs a row of samples (most significant bits first, 16-bit samples big
+// endian) with its filter byte in front, cycling through the None, Sub and
+// Up filters. 'previous' is the row above, unfiltered, and becomes this one.
+static void devi_bench_pack_row(const BenchSpec& spec, const devi::Rectangle& rectangle, int frame, int y, std::vector<std::uint8_t>& previous, std::vector<std::uint8_t>& row)
+{
+    static const int GRAY_ALPHA_CHANNELS[] = { 0, 3 };
+    static const int CHANNELS[] = { 0, 1, 2, 3 };
+
+    auto num_channels = devi_bench_get_num_channels(spec.color_type);
+    auto channels = spec.color_type == PNG_COLOR_TYPE_GRAY_ALPHA ? GRAY_ALPHA_CHANNELS : CHANNELS;
+
+    std::vector<std::uint8_t> raw((rectangle.width * num_channels * spec.bit_depth + 7) / 8, 0);
+
+    std::size_t bit = 0;
+    for (auto x = 0; x < (int)rectangle.width; ++x)
+    {
+        for (auto i = 0; i < num_channels; ++i)
+        {
+            auto sample = devi_bench_sample(rectangle.x + x, rectangle.y + y, frame, channels[i]);
+
+            if (spec.bit_depth == 16)
+            {
+                raw[bit / 8] = (std::uint8_t)(sample >> 8);
+                raw[bit / 8 + 1] = (std::uint8_t)sample;
+            }
+            else
+            {
+                auto value = sample >> (16 - spec.bit_depth);
+                raw[bit / 8] |= (std::uint8_t)(value << (8 - spec.bit_depth - bit % 8));
+            }
+
+            bit += spec.bit_depth;
+        }
+    }
+
+    std::size_t bytes_per_pixel = std::max(num_channels * spec.bit_depth / 8, 1);
+    auto filter = y == 0 ? 0 : y % 3;
+
+    row.clear();
+    row.push_back((std::uint8_t)filter);
+    for (std::size_t i = 0; i < raw.size(); ++i)
+    {
+        std::uint8_t predictor = 0;
+        if (filter == 1 && i >= bytes_per_pixel)
+        {
+            predictor = raw[i - bytes_per_pixel];
+        }
+        else if (filter == 2)
+        {
+            predictor = previous[i];
+        }
+
+        row.push_back((std::uint8_t)(raw[i] - predictor));
+    }
+
+    previous.swap(raw);
+}
+
+static void devi_bench_make_apng(const BenchSpec& spec, std::vector<std::uint8_t>& output)
+{
+    static const std::uint8_t SIGNATURE[] = { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a };
+    output.insert(output.end(), std::begin(SIGNATURE), std::end(SIGNATURE));
+
+    std::vector<std::uint8_t> chunk;
+    devi_bench_put32(chunk, spec.width);
+    devi_bench_put32(chunk, spec.height);
+    chunk.push_back((std::uint8_t)spec.bit_depth);
+    chunk.push_back((std::uint8_t)spec.color_type);
+    chunk.push_back(0);
+    chunk.push_back(0);
+    chunk.push_back(0);
+    devi_bench_put_chunk(output, "IHDR", chunk);
+
+    if (spec.color_type == PNG_COLOR_TYPE_PALETTE)
+    {
+        auto num_colors = 1 << spec.bit_depth;
+
+        chunk.clear();
+        for (auto i = 0; i < num_colors; ++i)
+        {
+            chunk.push_back((std::uint8_t)(i * 255 / (num_colors - 1)));
+            chunk.push_back((std::uint8_t)(i * 97));
+            chunk.push_back((std::uint8_t)(255 - i * 53));
+        }
+        devi_bench_put_chunk(output, "PLTE", chunk);
+
+        // Index 0 is transparent, and a few others translucent.
+        chunk.clear();
+        for (auto i = 0; i < num_colors; ++i)
+        {
+            chunk.push_back(i == 0 ? 0 : (i % 5 == 1 ? 128 : 255));
+        }
+        devi_bench_put_chunk(output, "tRNS", chunk);
+    }
+
+    chunk.clear();
+    devi_bench_put32(chunk, spec.num_frames);
+    devi_bench_put32(chunk, 0);
+    devi_bench_put_chunk(output, "acTL", chunk);
+
+    std::uint32_t sequence = 0;
+    std::vector<std::uint8_t> raw, row, previous, compressed;
+    for (auto frame = 0; frame < spec.num_frames; ++frame)
+    {
+        devi::Rectangle rectangle;
+        devi_bench_get_frame_rectangle(spec, frame, rectangle);
+
+        chunk.clear();
+        devi_bench_put32(chunk, sequence++);
+        devi_bench_put32(chunk, rectangle.width);
+        devi_bench_put32(chunk, rectangle.height);
+        devi_bench_put32(chunk, rectangle.x);
+        devi_bench_put32(chunk, rectangle.y);
+        chunk.push_back(0);
+        chunk.push_back(33);
+        chunk.push_back(1000 >> 8);
+        chunk.push_back(1000 & 0xff);
+        chunk.push_back((std::uint8_t)(frame % 3));
+        chunk.push_back((std::uint8_t)(frame % 2));
+        devi_bench_put_chunk(output, "fcTL", chunk);
+
+        raw.clear();
+        previous.assign((rectangle.width * devi_bench_get_num_channels(spec.color_type) * spec.bit_depth + 7) / 8, 0);
+        for (auto y = 0; y < (int)rectangle.height; ++y)
+        {
+            devi_bench_pack_row(spec, rectangle, frame, y, previous, row);
+            raw.insert(raw.end(), row.begin(), row.end());
+        }
+
+        auto compressed_size = compressBound((uLong)raw.size());
+        compressed.resize(compressed_size);
+        if (compress2(&compressed[0], &compressed_size, &raw[0], (uLong)raw.size(), 6) != Z_OK)
+        {
+            throw std::runtime_error("could not compress frame");
+        }
+
+        chunk.clear();
+        if (frame > 0)
+        {
+            devi_bench_put32(chunk, sequence++);
+        }
+        chunk.insert(chunk.end(), compressed.begin(), compressed.begin() + compressed_size);
+        devi_bench_put_chunk(output, frame == 0 ? "IDAT" : "fdAT", chunk);
+    }
+
+    chunk.clear();
+    devi_bench_put_chunk(output, "IEND", chunk);
+}
+
+static std::vector<BenchSpec> devi_bench_get_corpus()
+{
+    std::vector<BenchSpec> corpus;
+
+    // Larger canvases get fewer frames so each image takes a similar time.
+    static const int SIZES[][3] = {
+        { 32, 32, 96 },
+        { 256, 256, 48 },
+        { 640, 360, 24 },
+        { 1024, 1024, 8 }
+    };
+
+    for (auto& size : SIZES)
+    {
+        for (auto is_interlaced = 0; is_interlaced < 2; ++is_interlaced)
+        {
+            BenchSpec spec = { BENCH_FORMAT_GIF, size[0], size[1], size[2] };
+            spec.is_interlaced = is_interlaced;
+            corpus.push_back(spec);
+        }
+    }
+
+    for (auto bits : { 1, 2, 4 })
+    {
+        BenchSpec spec = { BENCH_FORMAT_GIF, 256, 256, 48 };
+        spec.bits = bits;
+        corpus.push_back(spec);
+    }
+
+    for (auto& size : SIZES)
+    {
+        corpus.push_back({ BENCH_FORMAT_APNG, size[0], size[1], size[2] });
+    }
+
+    // Every color type at every bit depth it allows.
+    static const int COLOR_TYPES[][2] = {
+        { PNG_COLOR_TYPE_GRAY, 1 },
+        { PNG_COLOR_TYPE_GRAY, 2 },
+        { PNG_COLOR_TYPE_GRAY, 4 },
+        { PNG_COLOR_TYPE_GRAY, 8 },
+        { PNG_COLOR_TYPE_GRAY, 16 },
+        { PNG_COLOR_TYPE_RGB, 8 },
+        { PNG_COLOR_TYPE_RGB, 16 },
+        { PNG_COLOR_TYPE_PALETTE, 1 },
+        { PNG_COLOR_TYPE_PALETTE, 2 },
+        { PNG_COLOR_TYPE_PALETTE, 4 },
+        { PNG_COLOR_TYPE_PALETTE, 8 },
+        { PNG_COLOR_TYPE_GRAY_ALPHA, 8 },
+        { PNG_COLOR_TYPE_GRAY_ALPHA, 16 },
+        { PNG_COLOR_TYPE_RGBA, 16 }
+    };
+
+    for (auto& color_type : COLOR_TYPES)
+    {
+        BenchSpec spec = { BENCH_FORMAT_APNG, 256, 256, 48 };
+        spec.color_type = color_type[0];
+        spec.bit_depth = color_type[1];
+        corpus.push_back(spec);
+    }
+
+    return corpus;
+}
+
+// The GIFs of the benchmark corpus, plus GIFs that hit the edge cases of
+// the LZW decoder.
+static std::vector<BenchSpec> devi_bench_get_verify_corpus()
+{
+    std::vector<BenchSpec> corpus;
+    for (auto& spec : devi_bench_get_corpus())
+    {
+        if (spec.format == BENCH_FORMAT_GIF)
+        {
+            corpus.push_back(spec);
+        }
+    }
+
+    // Interlaced, with some passes having no rows at all.
+    for (auto height : { 1, 2, 3, 5, 9 })
+    {
+        BenchSpec spec = { BENCH_FORMAT_GIF, 37, height, 4 };
+        spec.is_interlaced = true;
+        corpus.push_back(spec);
+    }
+
+    // Code size resets long before the table fills up.
+    for (auto bits : { 1, 2, 4, 8 })
+    {
+        BenchSpec spec = { BENCH_FORMAT_GIF, 256, 256, 8 };
+        spec.bits = bits;
+        spec.clear_interval = 37;
+        corpus.push_back(spec);
+    }
+
+    // Full tables that are never cleared.
+    for (auto bits : { 2, 8 })
+    {
+        BenchSpec spec = { BENCH_FORMAT_GIF, 1024, 1024, 4 };
+        spec.bits = bits;
+        spec.is_clear_deferred = true;
+        corpus.push_back(spec);
+    }
+
+    // Code streams with more (or fewer) indices than the frame has pixels.
+    for (auto num_extra_indices : { 1, 1000 })
+    {
+        BenchSpec spec = { BENCH_FORMAT_GIF, 64, 64, 6 };
+        spec.num_extra_indices = num_extra_indices;
+        corpus.push_back(spec);
+    }
+
+    for (auto is_interlaced = 0; is_interlaced < 2; ++is_interlaced)
+    {
+        BenchSpec spec = { BENCH_FORMAT_GIF, 256, 256, 4 };
+        spec.is_interlaced = is_interlaced;
+        spec.is_truncated = true;
+        corpus.push_back(spec);
+    }
+
+    return corpus;
+}
+
+static std::string devi_bench_get_name(const BenchSpec& spec)
+{
+    char name[128];
+    if (spec.format == BENCH_FORMAT_GIF)
+    {
+        std::snprintf(
+            name, sizeof(name), "gif-%dbit%s-%dx%d-%df",
+            spec.bits, spec.is_interlaced ? "-interlaced" : "", spec.width, spec.height, spec.num_frames);
+
+        std::string result = name;
+        if (spec.clear_interval > 0)
+        {
+            result += "-clear" + std::to_string(spec.clear_interval);
+        }
+
+        if (spec.is_clear_deferred)
+        {
+            result += "-deferred";
+        }
+
+        if (spec.num_extra_indices > 0)
+        {
+            result += "-extra" + std::to_string(spec.num_extra_indices);
+        }
+
+        if (spec.is_truncated)
+        {
+            result += "-truncated";
+        }
+
+        return result;
+    }
+    else
+    {
+        const char* color_type;
+        switch (spec.color_type)
+        {
+            case PNG_COLOR_TYPE_GRAY:
+                color_type = "gray";
+                break;
+            case PNG_COLOR_TYPE_RGB:
+                color_type = "rgb";
+                break;
+            case PNG_COLOR_TYPE_PALETTE:
+                color_type = "palette";
+                break;
+            case PNG_COLOR_TYPE_GRAY_ALPHA:
+                color_type = "grayalpha";
+                break;
+            case PNG_COLOR_TYPE_RGBA:
+            default:
+                color_type = "rgba";
+                break;
+        }
+
+        std::snprintf(
+            name, sizeof(name), "apng-%s%d-%dx%d-%df",
+            color_type, spec.bit_depth, spec.width, spec.height, spec.num_frames);
+    }
+
+    return name;
+}
+
+static void devi_bench_make_image(const BenchSpec& spec, BenchImage& image)
+{
+    image.name = devi_bench_get_name(spec);
+    image.format = spec.format;
+    image.data.clear();
+
+    if (spec.format == BENCH_FORMAT_GIF)
+    {
+        devi_bench_make_gif(spec, image.data);
+    }
+    else
+    {
+        devi_bench_make_apng(spec, image.data);
+    }
+}
+
+static void devi_bench_load_image(const std::string& filename, BenchImage& image)
+{
+    std::ifstream stream(filename, std::ios::binary);
+    if (!stream)
+    {
+        throw std::runtime_error("could not open " + filename);
+    }
+
+    image.name = filename;
+    image.data.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+
+    if (image.data.size() >= 4 && std::memcmp(&image.data[0], "GIF8", 4) == 0)
+    {
+        image.format = BENCH_FORMAT_GIF;
+    }
+    else if (image.data.size() >= 8 && !png_sig_cmp(&image.data[0], 0, 8))
+    {
+        image.format = BENCH_FORMAT_APNG;
+    }
+    else
+    {
+        throw std::runtime_error(filename + " is neither a GIF nor a PNG");
+    }
+}
+
+// Makes a reader for 'image', streamed from a Lua table (using the chunk
+// referenced by 'streamed_file') or read in place from a Lua string.
+static std::unique_ptr<devi::ImageReader> devi_bench_new_reader(lua_State* L, int streamed_file, const BenchImage& image, int mode, int gif_decoder)
+{
+    if (mode == BENCH_MODE_STREAMED)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, streamed_file);
+        lua_pushlstring(L, (const char*)&image.data[0], image.data.size());
+        lua_call(L, 1, 1);
+    }
+    else
+    {
+        lua_pushlstring(L, (const char*)&image.data[0], image.data.size());
+    }
+
+    devi::LuaFile file(L, -1);
+    lua_pop(L, 1);
+
+    if (image.format == BENCH_FORMAT_GIF)
+    {
+        return std::make_unique<devi::GIFImageReader>(std::move(file), gif_decoder);
+    }
+
+    return std::make_unique<devi::APNGImageReader>(std::move(file));
+}
+
+// Opens the image, then reads every frame over and over for at least
+// 'time' seconds (and at least one loop).
+static void devi_bench_run(lua_State* L, int streamed_file, const BenchImage& image, int mode, const BenchOptions& options, BenchResult& result)
+{
+    devi_bench_reset_peak_rss();
+
+    auto start = devi_bench_now();
+    auto reader = devi_bench_new_reader(L, streamed_file, image, mode, options.gif_decoder);
+    result.open_time = devi_bench_now() - start;
+
+    result.width = reader->get_width();
+    result.height = reader->get_height();
+    result.num_frames = reader->get_num_frames();
+
+    devi::Frame frame;
+    std::vector<devi::Pixel> pixels((std::size_t)result.width * result.height);
+
+    start = devi_bench_now();
+    do
+    {
+        reader->restart();
+
+        while (true)
+        {
+            auto frame_start = devi_bench_now();
+            if (!reader->read_into(frame, &pixels[0], pixels.size()))
+            {
+                break;
+            }
+
+            result.latencies.push_back(devi_bench_now() - frame_start);
+        }
+
+        ++result.num_loops;
+        result.decode_time = devi_bench_now() - start;
+    } while (result.decode_time < options.time);
+
+    reader.reset();
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    result.peak_rss = devi_bench_get_peak_rss();
+}
+
+// Fastest time Compositor::decode_all (i.e., 'preload') takes to decode and
+// cache every frame of the image on 'num_threads' threads, out of as many
+// tries as fit in 'time' seconds. Each try gets a fresh reader and cache.
+static double devi_bench_time_preload(lua_State* L, int streamed_file, const BenchImage& image, int mode, const BenchOptions& options, std::size_t num_threads)
+{
+    auto best = std::numeric_limits<double>::infinity();
+    auto total = 0.0;
+
+    do
+    {
+        auto reader = devi_bench_new_reader(L, streamed_file, image, mode, options.gif_decoder);
+        devi::Compositor compositor(reader.get());
+        compositor.set_cache_limit(std::numeric_limits<std::size_t>::max());
+
+        auto start = devi_bench_now();
+        if (!compositor.decode_all(num_threads))
+        {
+            throw std::runtime_error("animation didn't fit in the cache");
+        }
+
+        auto time = devi_bench_now() - start;
+        best = std::min(best, time);
+        total += time;
+    } while (total < options.time);
+
+    return best;
+}
+
+static void devi_bench_run_preload(lua_State* L, int streamed_file, const BenchImage& image, int mode, const BenchOptions& options)
+{
+    std::size_t num_threads = options.preload_threads;
+    if (num_threads == 0)
+    {
+        num_threads = devi::get_thread_pool().get_num_threads();
+    }
+
+    auto sequential_time = devi_bench_time_preload(L, streamed_file, image, mode, options, 1);
+    auto parallel_time = devi_bench_time_preload(L, streamed_file, image, mode, options, num_threads);
+    auto speedup = parallel_time > 0.0 ? sequential_time / parallel_time : 0.0;
+
+    auto mode_name = mode == BENCH_MODE_STREAMED ? "streamed" : "buffered";
+    if (options.is_csv)
+    {
+        std::printf(
+            "%s,%s,%zu,%.3f,%.3f,%.2f\n",
+            image.name.c_str(), mode_name, num_threads, sequential_time * 1000.0, parallel_time * 1000.0, speedup);
+    }
+    else
+    {
+        std::printf(
+            "%-40s %-8s %8zu %12.3f %12.3f %8.2f\n",
+            image.name.c_str(), mode_name, num_threads, sequential_time * 1000.0, parallel_time * 1000.0, speedup);
+    }
+
+    std::fflush(stdout);
+}
+
+// One of the two decoders compared by --verify, and where it got to.
+struct BenchDecoder
+{
+    std::unique_ptr<devi::ImageReader> reader;
+    devi::Frame frame;
+    std::vector<devi::Pixel> pixels;
+
+    bool is_done = false;
+    std::string error;
+};
+
+// Reads the next frame. Running out of frames and failing both count as
+// done; the error (if any) is kept.
+static bool devi_bench_step(BenchDecoder& decoder)
+{
+    try
+    {
+        if (decoder.reader && decoder.reader->read_into(decoder.frame, &decoder.pixels[0], decoder.pixels.size()))
+        {
+            return true;
+        }
+    }
+    catch (const std::exception& error)
+    {
+        decoder.error = error.what();
+    }
+
+    decoder.is_done = true;
+    return false;
+}
+
+static void devi_bench_open_decoder(lua_State* L, int streamed_file, const BenchImage& image, int mode, int gif_decoder, BenchDecoder& decoder)
+{
+    try
+    {
+        decoder.reader = devi_bench_new_reader(L, streamed_file, image, mode, gif_decoder);
+        decoder.pixels.resize(std::max<std::size_t>((std::size_t)decoder.reader->get_width() * decoder.reader->get_height(), 1));
+    }
+    catch (const std::exception& error)
+    {
+        decoder.reader.reset();
+        decoder.error = error.what();
+    }
+}
+
+// Decodes every frame of a GIF with both decoders, in lockstep, and checks
+// they give exactly the same frames and stop after the same one (for
+// broken files, one may report the end of the file where the other fails).
+// Returns an empty string if they match, otherwise what differed.
+static std::string devi_bench_verify(lua_State* L, int streamed_file, const BenchImage& image, int mode, int& num_frames)
+{
+    BenchDecoder native, giflib;
+    devi_bench_open_decoder(L, streamed_file, image, mode, devi::GIF_DECODER_NATIVE, native);
+    devi_bench_open_decoder(L, streamed_file, image, mode, devi::GIF_DECODER_GIFLIB, giflib);
+
+    if (!native.reader != !giflib.reader)
+    {
+        return "only one decoder could open it: " + (native.error.empty() ? giflib.error : native.error);
+    }
+
+    num_frames = 0;
+    while (true)
+    {
+        auto is_native_read = devi_bench_step(native);
+        auto is_giflib_read = devi_bench_step(giflib);
+
+        auto at = " at frame " + std::to_string(num_frames);
+        if (is_native_read != is_giflib_read)
+        {
+            auto error = is_native_read ? giflib.error : native.error;
+            return (is_native_read ? "giflib" : "native") + std::string(" decoder stopped") + at + (error.empty() ? "" : ": " + error);
+        }
+
+        if (!is_native_read)
+        {
+            return "";
+        }
+
+        auto& a = native.frame;
+        auto& b = giflib.frame;
+        if (a.x != b.x || a.y != b.y || a.width != b.width || a.height != b.height ||
+            a.blend_op != b.blend_op || a.dispose_op != b.dispose_op || a.delay != b.delay)
+        {
+            return "frame info differs" + at;
+        }
+
+        auto num_pixels = (std::size_t)a.width * a.height;
+        if (std::memcmp(&native.pixels[0], &giflib.pixels[0], num_pixels * sizeof(devi::Pixel)) != 0)
+        {
+            return "pixels differ" + at;
+        }
+
+        ++num_frames;
+    }
+}
+
+// Nearest rank, in milliseconds. 'latencies' must be sorted.
+static double devi_bench_percentile(const std::vector<double>& latencies, double percentile)
+{
+    if (latencies.empty())
+    {
+        return 0.0;
+    }
+
+    auto rank = (std::size_t)(percentile / 100.0 * (latencies.size() - 1) + 0.5);
+    return latencies[std::min(rank, latencies.size() - 1)] * 1000.0;
+}
+
+static void devi_bench_print_header(const BenchOptions& options)
+{
+    if (options.preload_threads >= 0)
+    {
+        if (options.is_csv)
+        {
+            std::printf("name,mode,threads,one_thread_ms,threads_ms,speedup\n");
+        }
+        else
+        {
+            std::printf("%-40s %-8s %8s %12s %12s %8s\n", "image", "mode", "threads", "1 thread ms", "threads ms", "speedup");
+        }
+    }
+    else if (options.is_csv)
+    {
+        std::printf("name,mode,width,height,frames,bytes,open_ms,mb_per_s,frames_per_s,p50_ms,p90_ms,p99_ms,max_ms,peak_rss_mib\n");
+    }
+    else
+    {
+        std::printf(
+            "%-40s %-8s %9s %9s %10s %8s %8s %8s %8s %9s\n",
+            "image", "mode", "open ms", "MB/s", "frames/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "peak MiB");
+    }
+}
+
+static void devi_bench_print_result(const BenchImage& image, int mode, BenchResult& result, const BenchOptions& options)
+{
+    std::sort(result.latencies.begin(), result.latencies.end());
+
+    auto mode_name = mode == BENCH_MODE_STREAMED ? "streamed" : "buffered";
+    auto megabytes = (double)image.data.size() * result.num_loops / 1e6;
+    auto megabytes_per_second = result.decode_time > 0.0 ? megabytes / result.decode_time : 0.0;
+    auto frames_per_second = result.decode_time > 0.0 ? result.latencies.size() / result.decode_time : 0.0;
+    auto peak_rss = result.peak_rss / (1024.0 * 1024.0);
+
+    auto p50 = devi_bench_percentile(result.latencies, 50.0);
+    auto p90 = devi_bench_percentile(result.latencies, 90.0);
+    auto p99 = devi_bench_percentile(result.latencies, 99.0);
+    auto max = devi_bench_percentile(result.latencies, 100.0);
+
+    if (options.is_csv)
+    {
+        std::printf(
+            "%s,%s,%d,%d,%d,%zu,%.3f,%.2f,%.1f,%.3f,%.3f,%.3f,%.3f,%.1f\n",
+            image.name.c_str(), mode_name, result.width, result.height, result.num_frames, image.data.size(),
+            result.open_time * 1000.0, megabytes_per_second, frames_per_second, p50, p90, p99, max, peak_rss);
+    }
+    else
+    {
+        std::printf(
+            "%-40s %-8s %9.3f %9.2f %10.1f %8.3f %8.3f %8.3f %8.3f %9.1f\n",
+            image.name.c_str(), mode_name, result.open_time * 1000.0, megabytes_per_second, frames_per_second,
+            p50, p90, p99, max, peak_rss);
+    }
+
+    std::fflush(stdout);
+}
+
+static void devi_bench_print_usage(const char* program)
+{
+    std::printf(
+        "usage: %s [options] [file...]\n"
+        "\n"
+        "Benchmarks the GIF & APNG readers on the given files, or on a synthetic\n"
+        "corpus if there are none.\n"
+        "\n"
+        "  --verify              compare the native GIF decoder with giflib instead,\n"
+        "                        on a corpus that includes LZW edge cases\n"
+        "  --preload THREADS     time decoding every frame up front (like 'preload')\n"
+        "                        on one thread and on THREADS (0 for every core)\n"
+        "  --time SECONDS        decode each image for at least this long (default %.1f)\n"
+        "  --mode MODE           buffered, streamed or both (default both)\n"
+        "  --gif-decoder NAME    native or giflib (default native)\n"
+        "  --filter TEXT         only images whose name contains TEXT\n"
+        "  --csv                 print comma separated values\n",
+        program, DEVI_BENCH_DEFAULT_TIME);
+}
+
+static bool devi_bench_parse_options(int argc, char** argv, BenchOptions& options)
+{
+    for (auto i = 1; i < argc; ++i)
+    {
+        std::string argument = argv[i];
+        auto has_value = i + 1 < argc;
+
+        if (argument == "--time" && has_value)
+        {
+            options.time = std::atof(argv[++i]);
+        }
+        else if (argument == "--mode" && has_value)
+        {
+            std::string mode = argv[++i];
+            if (mode == "buffered")
+            {
+                options.modes = BENCH_MODE_BUFFERED;
+            }
+            else if (mode == "streamed")
+            {
+                options.modes = BENCH_MODE_STREAMED;
+            }
+            else if (mode == "both")
+            {
+                options.modes = BENCH_MODE_BUFFERED | BENCH_MODE_STREAMED;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else if (argument == "--gif-decoder" && has_value)
+        {
+            std::string decoder = argv[++i];
+            if (decoder == "native")
+            {
+                options.gif_decoder = devi::GIF_DECODER_NATIVE;
+            }
+            else if (decoder == "giflib")
+            {
+                options.gif_decoder = devi::GIF_DECODER_GIFLIB;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else if (argument == "--filter" && has_value)
+        {
+            options.filter = argv[++i];
+        }
+        else if (argument == "--csv")
+        {
+            options.is_csv = true;
+        }
+        else if (argument == "--verify")
+        {
+            options.is_verify = true;
+        }
+        else if (argument == "--preload" && has_value)
+        {
+            options.preload_threads = std::max(std::atoi(argv[++i]), 0);
+        }
+        else if (argument.empty() || argument[0] == '-')
+        {
+            return false;
+        }
+        else
+        {
+            options.filenames.push_back(argument);
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    if (!devi_bench_parse_options(argc, argv, options))
+    {
+        devi_bench_print_usage(argv[0]);
+        return 1;
+    }
+
+    auto L = luaL_newstate();
+    luaL_openlibs(L);
+
+    if (luaL_loadstring(L, DEVI_BENCH_STREAMED_FILE))
+    {
+        std::fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    auto streamed_file = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    auto corpus = options.is_verify ? devi_bench_get_verify_corpus() : devi_bench_get_corpus();
+    auto num_images = options.filenames.empty() ? corpus.size() : options.filenames.size();
+
+    if (!options.is_verify)
+    {
+        devi_bench_print_header(options);
+    }
+
+    // Images are made (or loaded) one at a time so the peak memory of each
+    // run only includes its own image.
+    auto is_ok = true;
+    BenchImage image;
+    for (std::size_t i = 0; i < num_images; ++i)
+    {
+        try
+        {
+            if (options.filenames.empty())
+            {
+                if (devi_bench_get_name(corpus[i]).find(options.filter) == std::string::npos)
+                {
+                    continue;
+                }
+
+                devi_bench_make_image(corpus[i], image);
+            }
+            else
+            {
+                devi_bench_load_image(options.filenames[i], image);
+                if (image.name.find(options.filter) == std::string::npos)
+                {
+                    continue;
+                }
+            }
+
+            if (options.is_verify && image.format != BENCH_FORMAT_GIF)
+            {
+                continue;
+            }
+
+            for (auto mode : { BENCH_MODE_BUFFERED, BENCH_MODE_STREAMED })
+            {
+                if ((options.modes & mode) && options.is_verify)
+                {
+                    int num_frames;
+                    auto mismatch = devi_bench_verify(L, streamed_file, image, mode, num_frames);
+
+                    auto mode_name = mode == BENCH_MODE_STREAMED ? "streamed" : "buffered";
+                    if (mismatch.empty())
+                    {
+                        std::printf("%-56s %-8s ok, %d frames\n", image.name.c_str(), mode_name, num_frames);
+                    }
+                    else
+                    {
+                        std::printf("%-56s %-8s MISMATCH: %s\n", image.name.c_str(), mode_name, mismatch.c_str());
+                        is_ok = false;
+                    }
+
+                    std::fflush(stdout);
+                }
+                else if ((options.modes & mode) && options.preload_threads >= 0)
+                {
+                    devi_bench_run_preload(L, streamed_file, image, mode, options);
+                }
+                else if (options.modes & mode)
+                {
+                    BenchResult result;
+                    devi_bench_run(L, streamed_file, image, mode, options, result);
+                    devi_bench_print_result(image, mode, result, options);
+                }
+            }
+        }
+        catch (const std::exception& error)
+        {
+            std::fprintf(stderr, "%s: %s\n", image.name.c_str(), error.what());
+            is_ok = false;
+        }
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, streamed_file);
+    lua_close(L);
+
+    return is_ok ? 0 : 1;
+}
@@ -25,6 +25,16 @@ function FileReader:read(numBytes)
     return result:sub(1, size)
 end
 
+function FileReader:seek(position)
+    if not self._file then
+        error("file not open")
+    end
+
+    if not self._file:seek(position) then
+        error("could not seek file")
+    end
+end
+
 function FileReader:write(value)
     if not self._file then
         error("file not open")
@@ -68,6 +78,14 @@ function DataReader:read(numBytes)
     return buffer
 end
 
+function DataReader:seek(position)
+    if not self._offset then
+        error("file not open")
+    end
+
+    self._offset = position
+end
+
 function DataReader:write()
     error("cannot write to data")
 end
@@ -101,7 +119,8 @@ local function newBuffer(file)
     if type(file) == "string" then
         return love.filesystem.read(file)
     elseif file:typeOf("Data") then
-        return file:getString()
+        -- Read in place rather than copied into a string.
+        return file
     else
         error("expected filename or Data")
     end
@@ -109,59 +128,98 @@ end
 
 local Image = {}
 
+local savePrecompiled
+
+-- Uploads are rounded out to a few sizes (this many pixels, doubling up to
+-- the canvas size) so the scratch ImageData of each size is reused; dirty
+-- rectangles that change size every frame would otherwise need a new one
+-- almost every time. Each image ends up with at most a few dozen.
+local REGION_GRANULARITY = 32
+
+local function getRegionSize(size, canvasSize)
+    local result = REGION_GRANULARITY
+    while result < size do
+        result = result * 2
+    end
+
+    return math.min(result, canvasSize)
+end
+
 function Image:_init()
-    self._canvas = love.graphics.newCanvas(self:getWidth(), self:getHeight())
+    local imageData = love.image.newImageData(self:getWidth(), self:getHeight(), self._pixelFormat)
+    self._image = love.graphics.newImage(imageData)
+
+    -- Scratch ImageData for uploads, keyed by width then height. These are
+    -- reused every time a region of the same size is uploaded.
+    self._regions = {}
+
+    -- Filled in by the compositor on every read & render.
+    self._frame = {}
+    self._dirty = {}
 end
 
 function Image:getWidth()
-    return self._reader:getWidth()
+    return self._compositor:getWidth()
 end
 
 function Image:getHeight()
-    return self._reader:getHeight()
+    return self._compositor:getHeight()
 end
 
 function Image:getNumFrames()
-    return self._reader:getNumFrames()
+    return self._compositor:getNumFrames()
 end
 
 function Image:getCurrentFrameIndex()
-    return self._reader:getCurrentFrame()
+    return self._compositor:getCurrentFrame()
 end
 
-function Image:_render(frame)
-    local imageData = love.image.newImageData(frame.width, frame.height, 'rgba8', frame.pixels)
-    local image = love.graphics.newImage(imageData)
+function Image:_getRegion(width, height)
+    local regions = self._regions[width]
+    local region = regions and regions[height]
+    if region then
+        return region
+    end
 
-    love.graphics.push('all')
+    if not regions then
+        regions = {}
+        self._regions[width] = regions
+    end
 
-    love.graphics.origin()
-    love.graphics.setColor(1, 1, 1, 1)
-    love.graphics.setScissor()
-    love.graphics.setShader()
-    love.graphics.setCanvas(self._canvas)
+    region = love.image.newImageData(width, height, self._pixelFormat)
+    regions[height] = region
 
-    love.graphics.setBlendMode("replace")
-    if frame.dispose == "none" and self._currentImage then
-        love.graphics.draw(self._currentImage, 0, 0)
-    elseif frame.dispose == "background" then
-        love.graphics.clear(0, 0, 0, 0)
-    elseif frame.dispose == "previous" and self._previousImage then
-        love.graphics.draw(self._previousImage, 0, 0)
-    else
-        -- Error state.
-        love.graphics.clear(1, 0, 0, 1)
-    end
+    return region
+end
 
-    love.graphics.setBlendMode(frame.blendMode)
-    love.graphics.draw(image, frame.x, frame.y)
+function Image:_render()
+    local dirty = self._dirty
+    local count = self._compositor:getDirtyRectangles(dirty)
+    self._compositor:clearDirtyRectangle()
 
-    love.graphics.setCanvas()
+    -- Separate changes are uploaded separately rather than as one rectangle
+    -- covering all of them. Rounded out rectangles are moved back inside
+    -- the canvas where they'd cross its edge.
+    local canvasWidth, canvasHeight = self:getWidth(), self:getHeight()
+    for i = 0, count - 1 do
+        local width = getRegionSize(dirty[i * 4 + 3], canvasWidth)
+        local height = getRegionSize(dirty[i * 4 + 4], canvasHeight)
+        local x = math.min(dirty[i * 4 + 1], canvasWidth - width)
+        local y = math.min(dirty[i * 4 + 2], canvasHeight - height)
 
-    self._previousImage = self._currentImage
-    self._currentImage = love.graphics.newImage(self._canvas:newImageData())
+        local region = self:_getRegion(width, height)
+        self._compositor:copyPixels(region:getPointer(), x, y, width, height)
+        self._image:replacePixels(region, nil, nil, x, y)
+    end
+end
 
-    love.graphics.pop('all')
+function Image:_restart()
+    self._compositor:restart()
+
+    -- The first loop just finished, so its recording may be complete.
+    if self._precompiled then
+        savePrecompiled(self)
+    end
 end
 
 function Image:_update()
@@ -170,86 +228,643 @@ function Image:_update()
 
     self._currentDelay = self._currentDelay - difference
 
+    -- Once the delays are known (usually as soon as the file is opened), a
+    -- stall jumps straight to the frame that's due instead of compositing
+    -- every frame it missed.
+    local isDirty = false
+    if self._currentDelay < 0 and self._compositor.skip then
+        local remaining = self._compositor:skip(-self._currentDelay, self._minDelay)
+        if remaining then
+            self._currentDelay = remaining
+            isDirty = true
+
+            if self:getCurrentFrameIndex() == self:getNumFrames() then
+                self:_restart()
+            end
+        end
+    end
+
     while self._currentDelay < 0 do
-        local frame = self._reader:read()
+        local frame = self._compositor:read(self._frame)
         if not frame then
-            self._reader:restart()
+            self:_restart()
             self._currentDelay = self._currentDelay + self._minDelay
         else
             self._currentDelay = self._currentDelay + math.max(frame.delay, self._minDelay)
-            self:_render(frame)
+            isDirty = true
         end
 
         if self:getCurrentFrameIndex() == self:getNumFrames() then
-            self._reader:restart()
+            self:_restart()
         end
     end
 
+    if isDirty then
+        self:_render()
+    end
+
     self._currentTime = currentTime
 end
 
 function Image:getTexture()
-    return self._currentImage
+    return self._image
 end
 
 function Image:update()
     self:_update()
 end
 
+-- Premultiplied images are drawn with the matching alpha blend mode; the
+-- previous mode is returned so it can be put back afterwards.
+local function setPremultipliedBlendMode(image)
+    if image._premultiplied then
+        local mode, alphaMode = love.graphics.getBlendMode()
+        love.graphics.setBlendMode(mode, "premultiplied")
+
+        return mode, alphaMode
+    end
+end
+
+local function restoreBlendMode(mode, alphaMode)
+    if mode then
+        love.graphics.setBlendMode(mode, alphaMode)
+    end
+end
+
 function Image:draw(...)
     self:_update()
 
-    if self._currentImage then
-        love.graphics.draw(self._currentImage, ...)
-    end
+    local mode, alphaMode = setPremultipliedBlendMode(self)
+    love.graphics.draw(self._image, ...)
+    restoreBlendMode(mode, alphaMode)
 end
 
 local ImageType = { __index = Image }
 
+-- Resolves the color indices of a palette image at draw time.
+local PALETTE_SHADER = [[
+    uniform Image palette;
+
+    vec4 effect(vec4 color, Image texture, vec2 textureCoordinates, vec2 screenCoordinates)
+    {
+        float index = Texel(texture, textureCoordinates).r;
+        return Texel(palette, vec2((index * 255.0 + 0.5) / 256.0, 0.5)) * color;
+    }
+]]
+
+local paletteShader
+
+-- Played back like any other image, but the texture holds a color index per
+-- pixel (uploaded at a byte per pixel) and colors are looked up from a
+-- palette texture by a shader.
+local PaletteImage = setmetatable({}, { __index = Image })
+
+function PaletteImage:_init()
+    Image._init(self)
+
+    -- Blending between indices would pick unrelated colors.
+    self._image:setFilter("nearest", "nearest")
+
+    local paletteData = love.image.newImageData(256, 1)
+    self._compositor:copyPalette(paletteData:getPointer())
+    self._palette = love.graphics.newImage(paletteData)
+    self._palette:setFilter("nearest", "nearest")
+    paletteData:release()
+
+    if not paletteShader then
+        paletteShader = love.graphics.newShader(PALETTE_SHADER)
+    end
+end
+
+function PaletteImage:getPalette()
+    return self._palette
+end
+
+function PaletteImage:getShader()
+    paletteShader:send("palette", self._palette)
+    return paletteShader
+end
+
+function PaletteImage:draw(...)
+    self:_update()
+
+    local shader = love.graphics.getShader()
+    local mode, alphaMode = setPremultipliedBlendMode(self)
+    love.graphics.setShader(self:getShader())
+    love.graphics.draw(self._image, ...)
+    love.graphics.setShader(shader)
+    restoreBlendMode(mode, alphaMode)
+end
+
+local PaletteImageType = { __index = PaletteImage }
+
+-- Every frame is composited up front and packed into one or a few
+-- textures; playback only switches between quads.
+local AtlasImage = {}
+
+function AtlasImage:_init(atlas)
+    local width, height = atlas:getFrameSize()
+    self._width = width
+    self._height = height
+
+    self._pages = {}
+    for i = 1, atlas:getNumPages() do
+        local imageData = love.image.newImageData(atlas:getPageSize(i))
+        atlas:copyPage(i, imageData:getPointer())
+
+        self._pages[i] = love.graphics.newImage(imageData)
+        imageData:release()
+    end
+
+    -- Identical frames share a cell and therefore a quad.
+    local cells = {}
+    for i = 1, atlas:getNumCells() do
+        local page, x, y = atlas:getCell(i)
+        local texture = self._pages[page]
+
+        cells[i] = {
+            texture = texture,
+            quad = love.graphics.newQuad(x, y, width, height, texture:getDimensions())
+        }
+    end
+
+    self._frames = {}
+    for i = 1, atlas:getNumFrames() do
+        local cell, delay = atlas:getFrame(i)
+
+        self._frames[i] = {
+            texture = cells[cell].texture,
+            quad = cells[cell].quad,
+            delay = math.max(delay, self._minDelay)
+        }
+    end
+
+    self._currentFrameIndex = 1
+    self._currentDelay = self._frames[1].delay
+end
+
+function AtlasImage:getWidth()
+    return self._width
+end
+
+function AtlasImage:getHeight()
+    return self._height
+end
+
+function AtlasImage:getNumFrames()
+    return #self._frames
+end
+
+function AtlasImage:getCurrentFrameIndex()
+    return self._currentFrameIndex
+end
+
+function AtlasImage:_update()
+    local currentTime = love.timer.getTime()
+    local difference = currentTime - self._currentTime
+
+    self._currentDelay = self._currentDelay - difference
+
+    while self._currentDelay < 0 do
+        self._currentFrameIndex = self._currentFrameIndex % #self._frames + 1
+        self._currentDelay = self._currentDelay + self._frames[self._currentFrameIndex].delay
+    end
+
+    self._currentTime = currentTime
+end
+
+-- The page alone would draw every frame at once, so the quad comes along:
+-- love.graphics.draw(image:getTexture()) draws just the current frame.
+function AtlasImage:getTexture()
+    local frame = self._frames[self._currentFrameIndex]
+    return frame.texture, frame.quad
+end
+
+function AtlasImage:getQuad()
+    return self._frames[self._currentFrameIndex].quad
+end
+
+function AtlasImage:update()
+    self:_update()
+end
+
+function AtlasImage:draw(...)
+    self:_update()
+
+    local frame = self._frames[self._currentFrameIndex]
+    local mode, alphaMode = setPremultipliedBlendMode(self)
+    love.graphics.draw(frame.texture, frame.quad, ...)
+    restoreBlendMode(mode, alphaMode)
+end
+
+local AtlasImageType = { __index = AtlasImage }
+
 local DEFAULT_CONFIG = {
-    minDelay = 1 / 60
+    minDelay = 1 / 60,
+    cache = false,
+    cacheLimit = 64 * 1024 * 1024,
+    compress = false,
+    threaded = false,
+    readAhead = 3,
+    keyframeInterval = 0,
+    shared = false,
+    map = false,
+    preload = false,
+    preloadThreads = 0,
+    diff = false,
+    premultiplied = false,
+    atlas = false,
+    atlasSize = 4096,
+    palette = false,
+    gifDecoder = "native",
+    precompiled = false,
+    precompiledPath = "devi",
+    precompiledCompress = false
 }
 
 local READERS = {}
+local Compositor, SharedCache, Memory, MappedFile, Atlas, IndexedFrames, Batch, Precompiled
 
-local function tryLoad(format, filename, config)
-    local NativeImageReader = READERS[format]
+-- Where a file would be on the real filesystem. Files inside a .love are
+-- "in" the .love itself, so opening them there fails.
+local function getNativePath(file)
+    local directory = love.filesystem.getRealDirectory(file)
+    return directory and string.format("%s/%s", directory, file)
+end
 
-    if not NativeImageReader then
-        return false
+-- Maps files that live on the real filesystem (e.g., not inside a .love).
+-- Returns nil if the file can't be mapped.
+local function newMapping(file)
+    if type(file) ~= "string" then
+        return nil
     end
 
-    local success, file, reader
-    
+    local path = getNativePath(file)
+    if not path then
+        return nil
+    end
+
+    local success, mapping = pcall(MappedFile, path)
+    if not success then
+        return nil
+    end
+
+    return mapping
+end
+
+-- Reads the file into memory (or maps it), unless it's streamed.
+local function openFile(filename, config)
     if config.file then
-        success, file = pcall(newFile, filename, "r")
-        if not success then
-            return false
-        end
-    else
-        success, file = pcall(newBuffer, filename)
-        if not success then
-            return false
-        end
+        return pcall(newFile, filename, "r")
+    end
+
+    local file = config.map and newMapping(filename)
+    if file then
+        return true, file
+    end
+
+    return pcall(newBuffer, filename)
+end
+
+-- Where the precompiled file of a file is kept in the save directory. The
+-- file's directories are kept, so different files never share one.
+local function getPrecompiledPath(filename, config)
+    local name = filename:gsub("^/+", "")
+    return string.format("%s/%s.devi", config.precompiledPath or DEFAULT_CONFIG.precompiledPath, name)
+end
+
+-- Returns the precompiled file at path, current or not.
+local function mapPrecompiled(path)
+    if not love.filesystem.getInfo(path, "file") then
+        return nil
+    end
+
+    -- The save directory is on the real filesystem, so this maps it.
+    local success, file = openFile(path, { map = true })
+    return success and file or nil
+end
+
+-- Returns the precompiled file at path and a reader of it, if it was made
+-- from exactly 'source' (last modified at 'modtime'). 'source' can be just
+-- the size of the file, to check its size and modtime without reading it.
+local function openPrecompiled(path, source, modtime)
+    local file = mapPrecompiled(path)
+    if not file or not Precompiled.isCurrent(file, source, modtime) then
+        return nil
     end
 
-    success, reader = pcall(NativeImageReader, file)
+    local success, reader = pcall(READERS.devi, file)
     if not success then
-        return false
+        return nil
+    end
+
+    return file, reader
+end
+
+local function precompile(format, source, config)
+    local reader = READERS[format](source, config.gifDecoder)
+    return Precompiled.save(reader, source, config.precompiledCompress)
+end
+
+-- The precompiled file is made from the frames the compositor recorded
+-- while decoding its first loop, and saved as soon as that loop is
+-- complete. Failing to save is fine; it's just recorded again next time.
+function savePrecompiled(image)
+    local pending = image._precompiled
+
+    local data = Precompiled.saveRecording(pending.compositor, pending.source, pending.modtime)
+    if not data then
+        return
+    end
+
+    image._precompiled = nil
+
+    love.filesystem.createDirectory(pending.path:match("^(.*)/") or "")
+    love.filesystem.write(pending.path, data)
+end
+
+local function recordPrecompiled(image, compositor, source, path, modtime)
+    image._precompiled = {
+        compositor = compositor,
+        source = source,
+        path = path,
+        modtime = modtime
+    }
+
+    savePrecompiled(image)
+end
+
+local function getOptions(config, isShared)
+    local options = {
+        diff = config.diff,
+        premultiplied = config.premultiplied,
+        compress = config.compress,
+        keyframes = config.keyframeInterval
+    }
+    if config.cache or config.preload or isShared then
+        options.cacheLimit = config.cacheLimit or DEFAULT_CONFIG.cacheLimit
+    end
+
+    if config.preload then
+        options.decodeAll = config.preloadThreads or DEFAULT_CONFIG.preloadThreads
+    end
+
+    -- Streamed files call back into Lua, so they can't be decoded on a
+    -- thread. Atlases and palette images are made by reading everything
+    -- once anyway.
+    if config.threaded and not config.file and not config.atlas and not config.palette then
+        options.readAhead = config.readAhead or DEFAULT_CONFIG.readAhead
+    end
+
+    return options
+end
+
+local function newImage(format, file, reader, compositor, config)
+    local minDelay = config.minDelay or DEFAULT_CONFIG.minDelay
+    local premultiplied = config.premultiplied or false
+
+    -- Animations that don't fit in the atlas limit are played back as usual.
+    if config.atlas then
+        local maxSize = math.min(
+            config.atlasSize or DEFAULT_CONFIG.atlasSize,
+            love.graphics.getSystemLimits().texturesize)
+        local atlasLimit = config.cacheLimit or DEFAULT_CONFIG.cacheLimit
+
+        local success, atlas = pcall(Atlas, compositor, maxSize, atlasLimit)
+        if success and atlas then
+            local result = setmetatable({
+                _format = format,
+                _premultiplied = premultiplied,
+                _currentTime = love.timer.getTime(),
+                _minDelay = minDelay
+            }, AtlasImageType)
+            result:_init(atlas)
+
+            return result
+        end
+    end
+
+    -- Likewise for animations with too many colors to index, or GPUs
+    -- without single channel textures.
+    if config.palette and love.graphics.getImageFormats().r8 then
+        local paletteLimit = config.cacheLimit or DEFAULT_CONFIG.cacheLimit
+
+        local success, frames = pcall(IndexedFrames, compositor, paletteLimit)
+        if success and frames then
+            local result = setmetatable({
+                _format = format,
+                _compositor = frames,
+                _pixelFormat = "r8",
+                _premultiplied = premultiplied,
+                _currentTime = love.timer.getTime(),
+                _currentDelay = 0,
+                _minDelay = minDelay
+            }, PaletteImageType)
+            result:_init()
+
+            return result
+        end
     end
 
     local result = setmetatable({
         _format = format,
+        _file = file,
         _reader = reader,
+        _compositor = compositor,
+        _pixelFormat = "rgba8",
+        _premultiplied = premultiplied,
         _currentTime = love.timer.getTime(),
         _currentDelay = 0,
-        _minDelay = config.minDelay or DEFAULT_CONFIG.minDelay,
+        _minDelay = minDelay,
     }, ImageType)
     result:_init()
 
     return result
 end
 
+-- Content keys of shared files loaded by name, with the size and
+-- modification time they were read at, so loading one again doesn't read
+-- and hash the whole file until it changes.
+local sharedKeys = {}
+
+-- Premultiplied frames can't be shared with straight ones.
+local function getSharedKey(contentKey, config)
+    return config.premultiplied and contentKey .. ":premultiplied" or contentKey
+end
+
+local function tryLoad(format, filename, config)
+    local NativeImageReader = READERS[format]
+
+    if not NativeImageReader then
+        return false
+    end
+
+    -- Precompiled files only stand in for files loaded by name. They are
+    -- checked against the file's size and modification time, or (if those
+    -- changed) its contents, so edits are noticed.
+    local precompiledPath, info
+    if config.precompiled and format ~= "devi" and type(filename) == "string" and not config.file then
+        precompiledPath = getPrecompiledPath(filename, config)
+        info = love.filesystem.getInfo(filename, "file")
+    end
+
+    -- Streamed files would have to be read in full to be hashed, so they are
+    -- never shared.
+    local isShared = config.shared and not config.file
+    local sharedInfo, key
+    if isShared and type(filename) == "string" then
+        sharedInfo = info or love.filesystem.getInfo(filename, "file")
+
+        local known = sharedKeys[filename]
+        if known and sharedInfo and sharedInfo.modtime and
+            known.size == sharedInfo.size and known.modtime == sharedInfo.modtime then
+            key = known.key
+        end
+    end
+
+    -- Another image already decoded this one; no need for a reader, or even
+    -- to read the file.
+    if key and SharedCache.isComplete(getSharedKey(key, config)) then
+        return newImage(format, nil, nil, Compositor(nil, { key = getSharedKey(key, config) }), config)
+    end
+
+    local success, file, reader
+
+    -- Shared images are keyed by the file's contents, so it's read anyway.
+    if precompiledPath and info and not config.shared then
+        file, reader = openPrecompiled(precompiledPath, info.size, info.modtime)
+        if file then
+            precompiledPath = nil
+        end
+    end
+
+    if not file then
+        success, file = openFile(filename, config)
+        if not success then
+            return false
+        end
+    end
+
+    local compositor
+
+    if isShared then
+        if not key then
+            key = SharedCache.hash(file)
+
+            if sharedInfo and sharedInfo.modtime then
+                sharedKeys[filename] = { key = key, size = sharedInfo.size, modtime = sharedInfo.modtime }
+            end
+        end
+
+        key = getSharedKey(key, config)
+        if SharedCache.isComplete(key) then
+            compositor = Compositor(nil, { key = key })
+        end
+    end
+
+    if not compositor then
+        local modtime = info and info.modtime
+        if precompiledPath then
+            local precompiledFile, precompiledReader = openPrecompiled(precompiledPath, file, modtime)
+            if precompiledFile then
+                file, reader = precompiledFile, precompiledReader
+                precompiledPath = nil
+            end
+        end
+
+        if not reader then
+            success, reader = pcall(NativeImageReader, file, config.gifDecoder)
+            if not success then
+                return false
+            end
+        end
+
+        local options = getOptions(config, key ~= nil)
+        options.key = key
+
+        if precompiledPath then
+            options.record = true
+            options.recordCompress = config.precompiledCompress
+        end
+
+        compositor = Compositor(reader, options)
+
+        local result = newImage(format, file, reader, compositor, config)
+        if precompiledPath then
+            recordPrecompiled(result, compositor, file, precompiledPath, modtime)
+        end
+
+        return result
+    end
+
+    -- Nothing reads the file of an image played back from a shared cache.
+    return newImage(format, nil, nil, compositor, config)
+end
+
+local BatchHandle = {}
+
+function BatchHandle:isDone()
+    return self._batch:isDone()
+end
+
+function BatchHandle:getProgress()
+    local loaded, total = self._batch:getProgress()
+    total = total + self._numStreamed
+
+    -- Streamed files (and files the threads couldn't open) are only loaded
+    -- by getImages.
+    if self._images then
+        return total, total
+    end
+
+    return loaded, total
+end
+
+function BatchHandle:wait()
+    self._batch:wait()
+end
+
+function BatchHandle:getImages()
+    if self._images then
+        return self._images, self._errors
+    end
+
+    local images, errors = {}, {}
+    for i, entry in ipairs(self._entries) do
+        local result, message, isDeferred
+        if entry.index then
+            local format, reader, compositor, file = self._batch:take(entry.index)
+            if format then
+                result = newImage(format, file, reader, compositor, self._config)
+
+                if entry.precompiledPath and format ~= "devi" then
+                    recordPrecompiled(result, compositor, file, entry.precompiledPath, entry.modtime)
+                end
+            else
+                message, isDeferred = reader, compositor
+            end
+        end
+
+        if not entry.index or isDeferred then
+            local success
+            success, result = pcall(devi.newImage, entry.filename, self._config)
+            if not success then
+                message = result
+                result = nil
+            end
+        end
+
+        images[i] = result or false
+        errors[i] = message
+    end
+
+    self._images, self._errors = images, errors
+
+    return images, errors
+end
+
+local BatchHandleType = { __index = BatchHandle }
+
 function devi.init(sourcePath)
     if sourcePath then
         local newCPath = string.format(
@@ -264,8 +879,45 @@ function devi.init(sourcePath)
     local APNGImageReader = require "devi.APNGImageReader"
     local GIFImageReader = require "devi.GIFImageReader"
 
+    local PrecompiledImageReader = require "devi.PrecompiledImageReader"
+
     READERS.png = APNGImageReader
     READERS.gif = GIFImageReader
+    READERS.devi = PrecompiledImageReader
+
+    Compositor = require "devi.Compositor"
+    SharedCache = require "devi.SharedCache"
+    Memory = require "devi.Memory"
+    MappedFile = require "devi.MappedFile"
+    Atlas = require "devi.Atlas"
+    IndexedFrames = require "devi.IndexedFrames"
+    Batch = require "devi.Batch"
+    Precompiled = require "devi.Precompiled"
+end
+
+function devi.getAllocations()
+    if not Memory then
+        devi.init()
+    end
+
+    return Memory.getAllocations()
+end
+
+-- Caps the memory used by every cache together; nil removes the cap.
+function devi.setCacheBudget(bytes)
+    if not Memory then
+        devi.init()
+    end
+
+    Memory.setCacheBudget(bytes)
+end
+
+function devi.getCacheUsage()
+    if not Memory then
+        devi.init()
+    end
+
+    return Memory.getCacheUsage()
 end
 
 function devi.newImage(file, config)
@@ -305,4 +957,114 @@ function devi.newImage(file, config)
     return result
 end
 
+-- Starts loading many images at once, each on its own thread. Returns a
+-- handle; its getImages() waits for the rest and makes the images.
+function devi.loadMany(files, config)
+    if not next(READERS, nil) then
+        devi.init()
+    end
+
+    config = config or DEFAULT_CONFIG
+
+    local batch = Batch()
+    local options = getOptions(config, config.shared)
+    options.shared = config.shared
+    options.gifDecoder = config.gifDecoder
+    options.map = config.map
+
+    -- Files without a current precompiled file are recorded as they load.
+    local recordOptions = {}
+    for key, value in pairs(options) do
+        recordOptions[key] = value
+    end
+    recordOptions.record = true
+    recordOptions.recordCompress = config.precompiledCompress
+
+    -- Files are opened by the threads, not here. Streamed files (and files
+    -- the threads can't open, e.g. inside a .love) are loaded as usual by
+    -- getImages, so they get the same errors as devi.newImage.
+    local entries = {}
+    local numStreamed = 0
+    for i, filename in ipairs(files) do
+        local path = not config.file and type(filename) == "string" and getNativePath(filename)
+
+        if path then
+            local precompiledPath, precompiledFile, info
+            if config.precompiled then
+                precompiledPath = getPrecompiledPath(filename, config)
+                precompiledFile = mapPrecompiled(precompiledPath)
+                info = love.filesystem.getInfo(filename, "file")
+            end
+
+            -- Shared images are keyed by the file's contents, so it's read
+            -- (and the precompiled file checked against it) anyway.
+            local modtime = info and info.modtime
+            if precompiledFile and info and not config.shared and Precompiled.isCurrent(precompiledFile, info.size, modtime) then
+                entries[i] = {
+                    filename = filename,
+                    index = batch:add(precompiledFile, options)
+                }
+            else
+                entries[i] = {
+                    filename = filename,
+                    index = batch:addFile(path, precompiledPath and recordOptions or options, precompiledFile, modtime),
+                    precompiledPath = precompiledPath,
+                    modtime = modtime
+                }
+            end
+        elseif not config.file and type(filename) ~= "string" and filename:typeOf("Data") then
+            entries[i] = {
+                filename = filename,
+                index = batch:add(filename, options)
+            }
+        else
+            entries[i] = { filename = filename }
+            numStreamed = numStreamed + 1
+        end
+    end
+
+    batch:start()
+
+    return setmetatable({
+        _batch = batch,
+        _entries = entries,
+        _config = config,
+        _numStreamed = numStreamed
+    }, BatchHandleType)
+end
+
+-- Decodes every frame of an image into a precompiled (.devi) file, which
+-- devi.newImage loads without decoding anything. Returns the file's
+-- contents, and writes them to outputFilename in the save directory if set.
+function devi.precompile(file, outputFilename, config)
+    if not next(READERS, nil) then
+        devi.init()
+    end
+
+    config = config or DEFAULT_CONFIG
+
+    local success, source = openFile(file, { map = config.map })
+    if success then
+        for format in pairs(READERS) do
+            if format ~= "devi" then
+                local data
+                success, data = pcall(precompile, format, source, config)
+                if success then
+                    if outputFilename then
+                        assert(love.filesystem.write(outputFilename, data))
+                    end
+
+                    return data
+                end
+            end
+        end
+    end
+
+    if type(file) == "string" then
+        error(string.format("couldn't precompile %s: not a valid animated image", file))
+    else
+        error(string.format("couldn't precompile %s: not a valid animated image", file:type()))
+    end
+end
+
 return devi
@@ -0,0 +1,95 @@
+#pragma once
+
+#ifndef DEVI_ATLAS_HPP
+#define DEVI_ATLAS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "devi.hpp"
+#include "image.hpp"
+
+namespace devi
+{
+    // A grid of composited frames; pages are uploaded as textures once and
+    // frames are then drawn with a quad each.
+    struct AtlasPage
+    {
+        int width = 0;
+        int height = 0;
+
+        std::vector<Pixel> pixels;
+    };
+
+    // Position of a frame in the atlas. Identical frames share one cell.
+    struct AtlasCell
+    {
+        int page;
+        int x;
+        int y;
+    };
+
+    struct AtlasFrame
+    {
+        int cell;
+        float delay;
+    };
+
+    // Packs every frame of an animation into as few pages as possible, each
+    // at most max_size pixels wide and tall.
+    class Atlas
+    {
+    private:
+        int frame_width;
+        int frame_height;
+
+        // Cells per row & column of a page.
+        int columns;
+        int rows;
+
+        std::size_t limit;
+        std::size_t size = 0;
+
+        std::vector<AtlasPage> pages;
+        std::vector<AtlasCell> cells;
+        std::vector<AtlasFrame> frames;
+
+        // Cells by hash of their pixels, to find duplicate frames.
+        std::unordered_multimap<std::uint64_t, int> cell_hashes;
+
+        bool is_same(const AtlasCell& cell, const Pixel* pixels) const;
+        void write(const AtlasCell& cell, const Pixel* pixels);
+
+    public:
+        Atlas(int frame_width, int frame_height, int max_size, std::size_t limit);
+
+        int get_frame_width() const;
+        int get_frame_height() const;
+
+        std::size_t get_size() const;
+
+        // Bytes taken by num_frames frames if none of them repeat: the most
+        // the atlas can grow to, known before anything is decoded.
+        std::size_t get_max_size(int num_frames) const;
+
+        int get_num_pages() const;
+        const AtlasPage& get_page(int index) const;
+
+        int get_num_cells() const;
+        const AtlasCell& get_cell(int index) const;
+
+        int get_num_frames() const;
+        const AtlasFrame& get_frame(int index) const;
+
+        // Adds the next frame of the animation (a full canvas). Returns false
+        // if the atlas would grow past its limit.
+        bool add(float delay, const Pixel* pixels);
+
+        // Shrinks the last page to the cells actually used.
+        void finish();
+    };
+}
+
+#endif
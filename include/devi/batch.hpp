@@ -0,0 +1,112 @@
+#pragma once
+
+#ifndef DEVI_BATCH_HPP
+#define DEVI_BATCH_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "devi.hpp"
+#include "compositor.hpp"
+#include "image.hpp"
+#include "mapped_file.hpp"
+#include "read_gif.hpp"
+
+namespace devi
+{
+    struct BatchEntry
+    {
+        // The file, read in place. Whoever adds the entry keeps it alive.
+        const std::uint8_t* data = nullptr;
+        std::size_t size = 0;
+
+        // Otherwise, the path of the file on the real filesystem; it's opened
+        // (mapped, or read if not) on the loading thread.
+        std::string path;
+        bool is_mapped = true;
+
+        // A precompiled file made from the file at path, if any. It's used
+        // instead if it's still current (see is_precompiled_current).
+        const std::uint8_t* precompiled_data = nullptr;
+        std::size_t precompiled_size = 0;
+        std::int64_t modtime = -1;
+
+        CompositorOptions options;
+
+        // If true, the shared cache key is made from the file's contents.
+        bool is_shared = false;
+
+        // A GIF_DECODER_*, if the file is a GIF.
+        int gif_decoder = GIF_DECODER_NATIVE;
+
+        // Filled in once loaded: either a reader & compositor, or an error.
+        const char* format = nullptr;
+        ImageReader* reader = nullptr;
+        Compositor* compositor = nullptr;
+        std::string error;
+
+        // The file opened from path, if the reader reads it. It must outlive
+        // the reader.
+        MappedFile* file = nullptr;
+
+        // True if the file at path couldn't be opened, e.g. because it's in an
+        // archive; it's left for the caller to load.
+        bool is_deferred = false;
+
+        // True if the precompiled file was used rather than the one at path.
+        bool is_precompiled = false;
+    };
+
+    // Loads many images at once on the thread pool: each file is parsed,
+    // indexed and (optionally) decoded up front on its own thread, so load
+    // times scale with the number of cores rather than files.
+    class Batch
+    {
+    private:
+        std::vector<BatchEntry> entries;
+
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::vector<bool> done;
+        int num_done = 0;
+        int num_deferred = 0;
+        bool is_started = false;
+
+        void load(BatchEntry& entry);
+
+    public:
+        Batch() = default;
+        Batch(const Batch& other) = delete;
+
+        // Waits for every entry, then frees the readers, compositors & files
+        // that weren't taken.
+        ~Batch();
+
+        Batch& operator =(const Batch& other) = delete;
+
+        // Only before starting. Returns the index of the entry.
+        int add(const BatchEntry& entry);
+        void start();
+
+        int get_num_entries() const;
+        int get_num_done();
+        bool is_done();
+
+        // Like get_num_done, but without deferred entries, which are left to
+        // load.
+        int get_num_loaded();
+
+        void wait();
+        void wait(int index);
+
+        // Waits for the entry and hands over its reader, compositor & file (if
+        // it loaded); the caller owns them from then on.
+        BatchEntry take(int index);
+    };
+}
+
+#endif
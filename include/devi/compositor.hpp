@@ -0,0 +1,292 @@
+#pragma once
+
+#ifndef DEVI_COMPOSITOR_HPP
+#define DEVI_COMPOSITOR_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "devi.hpp"
+#include "frame_cache.hpp"
+#include "frame_ring.hpp"
+#include "image.hpp"
+#include "precompiled.hpp"
+#include "region.hpp"
+
+namespace devi
+{
+    // Everything a compositor can be set up with before the first frame is
+    // read; see Compositor::configure.
+    struct CompositorOptions
+    {
+        bool is_diffing = false;
+        bool is_premultiplied = false;
+
+        // With a key, the cache is shared (and unlimited unless a limit is
+        // given as well).
+        bool has_key = false;
+        std::string key;
+
+        bool has_cache_limit = false;
+        std::size_t cache_limit = 0;
+
+        // Keeps cached frames compressed; see FrameCache.
+        bool is_compressed = false;
+
+        bool has_decode_threads = false;
+        std::size_t decode_threads = 0;
+
+        bool has_read_ahead = false;
+        std::size_t read_ahead = 0;
+
+        bool has_keyframe_interval = false;
+        std::size_t keyframe_interval = 0;
+
+        // Records the frames as they're decoded into a precompiled file.
+        bool is_recording = false;
+        bool is_recording_compressed = false;
+    };
+
+    // Everything needed to carry on compositing after a frame: the canvas
+    // and the dispose op (with what it restores) still to be applied.
+    struct Keyframe
+    {
+        bool is_set = false;
+
+        std::vector<Pixel> pixels;
+        std::vector<Pixel> previous_pixels;
+
+        int dispose_op = DISPOSE_OP_NONE;
+        Rectangle dispose_rectangle;
+    };
+
+    // Applies the dispose & blend ops of the frames coming out of an
+    // ImageReader to a persistent, full size RGBA canvas.
+    //
+    // With a cache, the first loop is kept in memory and later loops are
+    // played back from it. Caches can be shared between compositors playing
+    // the same image; see shared_cache.hpp. If a cache is evicted to stay
+    // within the cache budget, playback carries on from the reader.
+    //
+    // If threaded, a worker thread owns the reader & canvas and composites
+    // frames ahead of time into a ring; read() then only pops the next one.
+    //
+    // Otherwise, the canvas can be snapshotted every few frames during the
+    // first loop, so seeking only composites the frames after the nearest
+    // keyframe. Once the delay of every frame is known, skip() uses them to
+    // jump straight to the frame due at a given time.
+    class Compositor
+    {
+    private:
+        ImageReader* reader;
+
+        // The frame being decoded by decode() (on the worker thread, if
+        // threaded) and the metadata of the last frame returned by read().
+        Frame decoded_frame;
+        Frame frame;
+
+        // Snapshotted on construction so they can be queried while the
+        // worker thread is using the reader.
+        int width;
+        int height;
+        int num_frames;
+
+        std::vector<Pixel> pixels;
+        std::vector<Pixel> previous_pixels;
+
+        // Either the canvas above or a slot of the ring. Frames played back
+        // from the cache are copied onto the canvas, since the cache can be
+        // evicted while one is shown.
+        const Pixel* current_pixels = nullptr;
+
+        int current_frame = 0;
+        bool is_finished = false;
+
+        // Possibly shared with other compositors. Only the owner fills it.
+        std::shared_ptr<FrameCache> cache;
+        bool is_cache_owner = false;
+
+        // Compressed frames are decoded onto the canvas in order, so they
+        // are only played back from the start of a loop.
+        bool is_reading_cache = false;
+
+        std::unique_ptr<FrameRing> ring;
+        std::size_t read_ahead = 0;
+        std::thread thread;
+        std::atomic<bool> is_running = false;
+        FrameSlot* current_slot = nullptr;
+        std::exception_ptr thread_error;
+
+        // Set when restarted mid-loop while threaded; the rest of the loop
+        // already in flight is dropped.
+        bool is_skipping = false;
+
+        // Dispose op & region of the last composited frame. These are applied
+        // right before the next frame is composited.
+        int dispose_op = DISPOSE_OP_NONE;
+        Rectangle dispose_rectangle;
+
+        // Region of the canvas changed since the dirty region was last
+        // cleared and the region changed by the last decode, respectively.
+        Region dirty_region;
+        Region changed_region;
+
+        // If diffing, the changed region is shrunk to the pixels that
+        // actually differ from the previous frame, using a copy of the
+        // region from before compositing.
+        bool is_diffing = false;
+        std::vector<Pixel> diff_pixels;
+
+        // If premultiplied, frames are premultiplied as they're composited,
+        // so the canvas (and anything cached from it) is too.
+        bool is_premultiplied = false;
+
+        // Keyframe i is the canvas right before frame (i + 1) *
+        // keyframe_interval is composited.
+        std::size_t keyframe_interval = 0;
+        std::vector<Keyframe> keyframes;
+
+        // Delays of the first loop as it's played, and the time each frame
+        // starts at (plus the length of the loop) for schedule_min_delay.
+        std::vector<float> delays;
+        int num_delays = 0;
+        std::vector<double> schedule;
+        float schedule_min_delay = -1.0f;
+
+        // Index of the frame decode() reads next, for the recording.
+        int decoded_index = 0;
+        std::unique_ptr<PrecompiledWriter> recording;
+
+        void dispose();
+        void save_previous();
+        void blend();
+        void save_diff();
+        void tighten();
+
+        // Reads & composites the next frame from the reader into 'pixels'.
+        bool decode();
+        void composite();
+        void rewind();
+
+        void run();
+        void start_thread();
+        void stop();
+
+        bool read_cached();
+        void copy_cached(int index, const Rectangle& rectangle);
+        bool read_threaded();
+        void evict();
+        void finish_decode();
+        void finish_read(const Region& region);
+
+        void save_keyframe();
+        void restore_keyframe(int index);
+        bool seek_cached(int target);
+        bool build_schedule(float min_delay);
+
+        // Reads frames (restarting at most once) until the next one read is
+        // 'target'; never more than a loop's worth.
+        bool read_to(int target);
+
+    public:
+        Compositor(ImageReader* reader);
+
+        // Plays back a complete cache without a reader.
+        Compositor(const std::shared_ptr<FrameCache>& cache);
+
+        ~Compositor();
+
+        int get_width() const;
+        int get_height() const;
+
+        int get_num_frames() const;
+        int get_current_frame() const;
+
+        // Costs a compare of every changed pixel per frame, but uploads only
+        // what actually changed (e.g., a frame that redraws a whole sprite
+        // to move an eye).
+        void set_diff(bool value);
+
+        // Premultiplies alpha while compositing, which also makes blending
+        // frames over the canvas cheaper. The reader still decodes straight
+        // alpha.
+        void set_premultiplied(bool value);
+
+        void set_cache_limit(std::size_t limit, bool is_compressed = false);
+        void share_cache(const std::string& key, std::size_t limit, bool is_compressed = false);
+        const FrameCache* get_cache() const;
+
+        // Decodes & caches the whole animation before playback, decoding
+        // frames on up to num_threads threads of the pool (0 for all of them)
+        // if the reader supports it. Needs a cache; returns false (and plays
+        // back as usual) if the animation doesn't fit.
+        bool decode_all(std::size_t num_threads);
+
+        // Keeps a keyframe every 'interval' frames (0 for none) while
+        // decoding. Each costs a canvas' worth of memory.
+        void set_keyframe_interval(std::size_t interval);
+
+        // Records every frame of the first loop decoded from here on into a
+        // precompiled file; see get_recording.
+        void record(bool is_compressed);
+
+        // The recording, once every frame of a loop is in it (otherwise
+        // null). Frames played back from a cache aren't decoded, so a
+        // recording started after the cache is filled never completes.
+        PrecompiledWriter* get_recording() const;
+
+        // The reader must only read from memory; see ImageReader::is_buffered.
+        // 'read_ahead' must be at least 1.
+        void start(std::size_t read_ahead);
+
+        // Applies the options in order: diffing, premultiplying, keyframes,
+        // recording, cache, decoding everything, then (unless everything was decoded)
+        // starting the worker thread.
+        void configure(const CompositorOptions& options);
+        bool is_threaded() const;
+
+        const Frame& get_frame() const;
+        const Pixel* get_pixels() const;
+        void copy_pixels(Pixel* destination, const Rectangle& rectangle) const;
+
+        const Region& get_dirty_region() const;
+        void clear_dirty_region();
+
+        bool read();
+        void restart();
+
+        // Makes the next read() return frame 'index', restoring the nearest
+        // keyframe (if any) rather than compositing every frame before it.
+        // Seeking back while filling a cache finishes the loop first. Not
+        // supported while threaded.
+        bool seek(int index);
+
+        // Catches up on a stall: reads the frame due 'overdue' seconds after
+        // the next frame was, and sets 'remaining' to how long it has left.
+        // Every delay is at least 'min_delay'. Returns false (doing nothing)
+        // until the delay of every frame is known, which is right away if
+        // the reader has an index of its frames. Threaded, the frames in
+        // between are read rather than skipped, up to a loop's worth.
+        bool skip(double overdue, float min_delay, double& remaining);
+    };
+
+    // Raises a Lua error if the value at index isn't a devi.Compositor.
+    Compositor* to_compositor(lua_State* L, int index);
+
+    // Reads the options table at index (key, diff, premultiplied,
+    // cacheLimit, compress, decodeAll, readAhead, keyframes, record,
+    // recordCompress) into options.
+    void get_compositor_options(lua_State* L, int index, CompositorOptions& options);
+
+    // Hands the compositor over to Lua. If reader_index isn't 0, the reader
+    // at that index is kept alive as long as the compositor.
+    void push_compositor(lua_State* L, Compositor* compositor, int reader_index);
+}
+
+#endif
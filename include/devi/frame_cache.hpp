@@ -0,0 +1,129 @@
+#pragma once
+
+#ifndef DEVI_FRAME_CACHE_HPP
+#define DEVI_FRAME_CACHE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "image.hpp"
+#include "region.hpp"
+
+namespace devi
+{
+    struct CachedFrame
+    {
+        float delay = 0.0f;
+
+        // Region of the canvas that changed from the previous frame.
+        Region region;
+
+        // The whole canvas, or (if compressed) the changed region encoded
+        // against the previous frame; see FrameCache::decode.
+        std::vector<Pixel> pixels;
+        std::vector<std::uint32_t> data;
+    };
+
+    // Stores fully composited frames during the first loop of an animation
+    // so later loops can be played back without decoding anything.
+    //
+    // Compressed caches only keep what changed from the previous frame, with
+    // unchanged spans skipped and repeated pixels run length encoded; frames
+    // are then decoded in order onto a canvas.
+    //
+    // Every cache counts against a process-wide budget. Past it, complete
+    // caches are evicted least recently played first, and their compositors
+    // go back to decoding from the file.
+    class FrameCache
+    {
+    private:
+        std::size_t limit;
+        std::size_t size = 0;
+
+        int width;
+        int height;
+
+        bool compressed;
+
+        // The previous frame while a compressed cache is being filled. These
+        // count towards the size (as 'scratch_size') until it's complete.
+        std::vector<Pixel> reference;
+        std::vector<std::uint32_t> encoded;
+        std::size_t scratch_size = 0;
+
+        // When the cache was last played back from, on a process-wide clock.
+        std::atomic<std::uint64_t> last_used = 0;
+
+        // Caches played back without a reader can't be evicted.
+        std::atomic<int> num_pinned = 0;
+        std::atomic<bool> evicted = false;
+
+        // A cache can be shared between compositors on different threads;
+        // frames are only read by others once the cache is complete.
+        std::atomic<bool> complete = false;
+        std::atomic<bool> overflowed = false;
+
+        // Only one compositor fills a (possibly shared) cache.
+        std::atomic<bool> claimed = false;
+
+        std::vector<CachedFrame> frames;
+
+        void encode(const Region& region, const Pixel* pixels);
+        void set_size(std::size_t value);
+        void update_scratch_size();
+
+        friend void enforce_cache_budget();
+
+    public:
+        FrameCache(std::size_t limit, int width, int height, bool is_compressed = false);
+        ~FrameCache();
+
+        std::size_t get_limit() const;
+        std::size_t get_size() const;
+
+        int get_width() const;
+        int get_height() const;
+
+        bool claim();
+        void release();
+
+        bool is_complete() const;
+        bool is_overflowed() const;
+        bool is_evicted() const;
+        bool is_compressed() const;
+
+        void pin();
+        void unpin();
+
+        // Marks the cache as just played back from.
+        void touch();
+
+        int get_num_frames() const;
+        const CachedFrame& get_frame(int index) const;
+
+        // Returns false (and frees everything cached so far) once the limit
+        // is exceeded; the cache stays disabled from then on.
+        bool add(float delay, const Region& region, const Pixel* pixels, std::size_t num_pixels);
+
+        // Only for compressed caches: applies frame 'index' to 'canvas',
+        // which must hold the previous frame (anything, for the first one).
+        void decode(int index, Pixel* canvas) const;
+
+        void finish();
+        void clear();
+    };
+
+    // The most memory every frame cache together may use; unlimited by
+    // default.
+    void set_cache_budget(std::size_t budget);
+    std::size_t get_cache_budget();
+    std::size_t get_cache_usage();
+
+    // Evicts complete caches until usage is within the budget. Must only be
+    // called from the thread playing back caches (i.e., the Lua thread).
+    void enforce_cache_budget();
+}
+
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+
+#ifndef DEVI_FRAME_RING_HPP
+#define DEVI_FRAME_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <vector>
+
+#include "image.hpp"
+#include "region.hpp"
+
+namespace devi
+{
+    struct FrameSlot
+    {
+        // Frame metadata only; the composited canvas is in 'pixels'.
+        Frame frame;
+
+        // Region of the canvas that changed from the previous slot.
+        Region region;
+
+        // Marks the end of a loop or, if 'error' is set, a failed decode.
+        bool is_end = false;
+        std::exception_ptr error;
+
+        std::vector<Pixel> pixels;
+    };
+
+    // Single-producer, single-consumer ring of composited frames. Neither
+    // side takes a lock; a side that can't make progress sleeps on the
+    // other side's index.
+    class FrameRing
+    {
+    private:
+        std::vector<FrameSlot> slots;
+
+        // Next slot to write and next slot to read, respectively. Both only
+        // ever increase.
+        std::atomic<std::size_t> head = 0;
+        std::atomic<std::size_t> tail = 0;
+
+    public:
+        FrameRing(std::size_t capacity, std::size_t num_pixels);
+
+        // Producer. Blocks while the ring is full. Returns nullptr if
+        // 'is_running' is false.
+        FrameSlot* acquire_write(const std::atomic<bool>& is_running);
+        void commit_write();
+
+        // Consumer. Blocks while the ring is empty. The slot stays valid
+        // (and is not reused by the producer) until it is released.
+        FrameSlot* acquire_read();
+        void release_read();
+
+        // Consumer. Discards everything in the ring and wakes the producer.
+        void drain();
+    };
+}
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#ifndef DEVI_GIF_LZW_HPP
+#define DEVI_GIF_LZW_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "devi.hpp"
+
+namespace devi
+{
+    // Strings are copied a word at a time, so the decoder may write up to
+    // this many bytes past the end of the indices.
+    inline constexpr std::size_t GIF_LZW_PADDING = 8;
+
+    // Decodes a whole GIF image at once. 'data' starts at the LZW minimum
+    // code size and runs through the image data sub-blocks (the terminator
+    // is optional). Indices are written in the order they're stored, i.e.
+    // interlaced images still have to be deinterlaced.
+    //
+    // Decodes exactly what giflib would; throws if the data is corrupt or
+    // ends before 'num_indices' indices.
+    void decode_gif_lzw(const std::uint8_t* data, std::size_t size, std::uint8_t* indices, std::size_t num_indices);
+}
+
+#endif
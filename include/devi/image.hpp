@@ -3,6 +3,7 @@
 #ifndef DEVI_IMAGE_HPP
 #define DEVI_IMAGE_HPP
 
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 
@@ -34,6 +35,14 @@ namespace devi
         std::uint8_t alpha;
     };
 
+    struct Rectangle
+    {
+        std::uint32_t x = 0;
+        std::uint32_t y = 0;
+        std::uint32_t width = 0;
+        std::uint32_t height = 0;
+    };
+
     struct Frame
     {
         std::uint32_t x = 0;
@@ -48,6 +57,9 @@ namespace devi
 
     class ImageReader
     {
+    private:
+        Frame frame_buffer;
+
     public:
         virtual ~ImageReader() {}
 
@@ -57,7 +69,40 @@ namespace devi
         virtual int get_num_frames() const = 0;
         virtual int get_current_frame() const = 0;
 
-        virtual bool read(Frame &frame) = 0;
+        // True if the reader never calls back into Lua, i.e. it can be used
+        // off the Lua thread.
+        virtual bool is_buffered() const = 0;
+
+        // Reusable frame for callers that don't keep their own.
+        Frame& get_frame_buffer();
+
+        // Reads the next frame into frame.pixels, which is grown to fit the
+        // whole image and then reused by later reads.
+        bool read(Frame& frame);
+
+        // Reads the next frame's pixels, tightly packed, straight into
+        // 'pixels' instead of frame.pixels. 'pixels' must have room for
+        // get_width() * get_height() pixels; frames never extend past the
+        // image.
+        virtual bool read_into(Frame& frame, Pixel* pixels, std::size_t num_pixels) = 0;
+
+        // Makes the next read return 'frame' (counting from 0). Readers
+        // without an index restart and read up to the frame.
+        virtual bool seek(int frame);
+
+        // True if decode_frame is supported, i.e. the reader has an index
+        // of its frames and doesn't call back into Lua.
+        virtual bool can_decode_frames() const;
+
+        // Decodes frame 'index' on its own (like read_into, but without
+        // moving the reader). May be called from several threads at once
+        // for different frames, as long as nothing else uses the reader.
+        virtual bool decode_frame(int index, Frame& frame, Pixel* pixels, std::size_t num_pixels);
+
+        // Gets the delay of frame 'index' without reading it, if the reader
+        // has an index of its frames.
+        virtual bool get_frame_delay(int index, float& delay) const;
+
         virtual void restart() = 0;
     };
 
@@ -0,0 +1,95 @@
+#pragma once
+
+#ifndef DEVI_INDEXED_FRAMES_HPP
+#define DEVI_INDEXED_FRAMES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "devi.hpp"
+#include "image.hpp"
+#include "palette.hpp"
+#include "region.hpp"
+
+namespace devi
+{
+    struct IndexedFrame
+    {
+        float delay = 0.0f;
+
+        // Region of the canvas that changed from the previous frame.
+        Region region;
+
+        // Color indices of each rectangle of the region in turn, tightly
+        // packed.
+        std::vector<std::uint8_t> indices;
+    };
+
+    // Every frame of an animation with at most 256 distinct colors (e.g., a
+    // GIF whose frames share a palette), composited once and stored as 8-bit
+    // color indices into a single palette. Frames cost a byte per changed
+    // pixel rather than four, and so do uploads; colors are looked up when
+    // drawing.
+    //
+    // Plays back like a Compositor: read() applies the next frame to an
+    // index canvas and grows the dirty region.
+    class IndexedFrames
+    {
+    private:
+        static constexpr int COLOR_TABLE_SIZE = 1024;
+
+        int width;
+        int height;
+
+        std::size_t limit;
+        std::size_t size = 0;
+
+        // Fully transparent pixels all share one color, whatever their RGB.
+        Pixel palette[Palette::MAX_COLORS] = {};
+        int num_colors = 0;
+
+        // Open addressing table from a color (as a word) to its index.
+        std::uint32_t color_keys[COLOR_TABLE_SIZE];
+        std::int16_t color_indices[COLOR_TABLE_SIZE];
+
+        std::vector<IndexedFrame> frames;
+
+        std::vector<std::uint8_t> canvas;
+        int current_frame = 0;
+        Region dirty_region;
+
+        int find_color(const Pixel& pixel);
+        bool add_rectangle(const Pixel* pixels, const Rectangle& rectangle, std::uint8_t* indices);
+
+    public:
+        IndexedFrames(int width, int height, std::size_t limit);
+
+        int get_width() const;
+        int get_height() const;
+
+        std::size_t get_size() const;
+
+        int get_num_colors() const;
+        const Pixel* get_palette() const;
+
+        int get_num_frames() const;
+        int get_current_frame() const;
+        const IndexedFrame& get_frame(int index) const;
+
+        // Adds the next frame (a full canvas) and the region that changed
+        // from the previous one. Returns false if the animation has too many
+        // colors or the frames would grow past the limit.
+        bool add(float delay, const Region& region, const Pixel* pixels);
+
+        bool read();
+        void restart();
+
+        void copy_indices(std::uint8_t* destination, const Rectangle& rectangle) const;
+
+        const Region& get_dirty_region() const;
+        void clear_dirty_region();
+    };
+}
+
+#endif
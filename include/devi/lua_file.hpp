@@ -13,25 +13,67 @@ namespace devi
     {
     private:
         lua_State* L;
+
+        // The file table for streamed files, otherwise whatever owns the
+        // buffer (a string, Data, or mapped file), which is read in place.
         int reference;
+
+        const std::uint8_t* buffer_data = nullptr;
+        std::size_t buffer_size = 0;
+        bool buffered = false;
+
+        // For streamed files, holds the current block read from the Lua
+        // side; read_end is the number of valid bytes in it and
+        // stream_position is the position of the Lua side in the file.
         std::vector<std::uint8_t> read_buffer;
         std::size_t read_offset = 0;
+        std::size_t read_end = 0;
+        std::size_t stream_position = 0;
 
         void handle_error(int result);
+        std::size_t read_lua(std::uint8_t* buffer, std::size_t size);
 
     public:
+        // Decoders tend to read a few bytes at a time, so streamed files are
+        // read from Lua in blocks of this size.
+        static const std::size_t READ_BLOCK_SIZE = 64 * 1024;
+
         LuaFile(lua_State* L, int index);
+
+        // Reads a buffer owned by someone else, which must outlive the file.
+        // Never touches Lua, so it can be made and destroyed on any thread.
+        LuaFile(const std::uint8_t* data, std::size_t size);
+
         LuaFile(LuaFile&& other) noexcept;
         ~LuaFile();
 
+        bool is_buffered() const;
+
+        // The whole buffer of a buffered file (nullptr if streamed).
+        const std::uint8_t* get_data() const;
+        std::size_t get_size() const;
+
         std::size_t read(std::uint8_t* buffer, std::size_t size);
         std::size_t write(const std::uint8_t* buffer, std::size_t size);
 
+        // Reads from an absolute position without moving the file. Only for
+        // buffered files; safe to call from several threads at once.
+        std::size_t read_at(std::size_t position, std::uint8_t* buffer, std::size_t size) const;
+
+        // Position of the next read from the start of the file. Seeking
+        // within the current block of a streamed file doesn't call Lua.
+        std::size_t tell() const;
+        void seek(std::size_t position);
+
         void open();
         void close();
 
         void flush();
     };
+
+    // Gets the bytes of a string, Data, or mapped file at index without
+    // copying them. They stay valid as long as the value is referenced.
+    bool get_lua_buffer(lua_State* L, int index, const std::uint8_t*& data, std::size_t& size);
 }
 
 #endif
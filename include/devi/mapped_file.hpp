@@ -0,0 +1,55 @@
+#pragma once
+
+#ifndef DEVI_MAPPED_FILE_HPP
+#define DEVI_MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "devi.hpp"
+
+namespace devi
+{
+    // A read-only memory mapping of a file on the real filesystem. Readers
+    // decode straight out of the mapping without copying it or calling
+    // back into Lua. Never touches Lua, so it can be opened on any thread.
+    //
+    // If not mapped, the file is read into memory instead (e.g., so it isn't
+    // kept open).
+    class MappedFile
+    {
+    private:
+        const std::uint8_t* data = nullptr;
+        std::size_t size = 0;
+
+        bool is_mapped;
+        std::vector<std::uint8_t> contents;
+
+#ifdef _WIN32
+        void* file_handle = nullptr;
+        void* mapping_handle = nullptr;
+#endif
+
+        void release();
+
+    public:
+        MappedFile(const std::string& path, bool is_mapped = true);
+        MappedFile(const MappedFile& other) = delete;
+        ~MappedFile();
+
+        MappedFile& operator =(const MappedFile& other) = delete;
+
+        const std::uint8_t* get_data() const;
+        std::size_t get_size() const;
+    };
+
+    // Returns the mapping if the value at index is a devi.MappedFile.
+    MappedFile* to_mapped_file(lua_State* L, int index);
+
+    // Hands the mapping over to Lua, which frees it once collected.
+    void push_mapped_file(lua_State* L, MappedFile* mapped_file);
+}
+
+#endif
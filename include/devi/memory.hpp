@@ -0,0 +1,34 @@
+#pragma once
+
+#ifndef DEVI_MEMORY_HPP
+#define DEVI_MEMORY_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "devi.hpp"
+
+namespace devi
+{
+    // Counts heap allocations made for devi's own buffers (and libpng's),
+    // so it's possible to check nothing is allocated during playback.
+    void count_allocation(std::size_t size);
+
+    std::size_t get_num_allocations();
+    std::size_t get_num_allocated_bytes();
+
+    // Like buffer.resize(size), but counts the allocation if the buffer has
+    // to grow. Buffers are never shrunk so they can be reused.
+    template <typename T>
+    void resize_buffer(std::vector<T>& buffer, std::size_t size)
+    {
+        if (size > buffer.capacity())
+        {
+            count_allocation(size * sizeof(T));
+        }
+
+        buffer.resize(size);
+    }
+}
+
+#endif
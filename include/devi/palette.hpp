@@ -0,0 +1,44 @@
+#pragma once
+
+#ifndef DEVI_PALETTE_HPP
+#define DEVI_PALETTE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "devi.hpp"
+#include "image.hpp"
+
+// AVX2 is picked at runtime; every AArch64 CPU has NEON.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DEVI_PALETTE_AVX2
+#elif defined(__aarch64__)
+#define DEVI_PALETTE_NEON
+#endif
+
+namespace devi
+{
+    // Lookup table from color index to pixel, covering every possible
+    // index so expanding a row never has to check a single index.
+    struct Palette
+    {
+        static constexpr int MAX_COLORS = 256;
+
+        // The transparent index (if any) is already folded in as a fully
+        // transparent black pixel, and so are indices past the color map
+        // (which broken files do use).
+        Pixel colors[MAX_COLORS];
+
+#if defined(DEVI_PALETTE_NEON)
+        // The same table, one channel at a time.
+        std::uint8_t planes[4][MAX_COLORS];
+#endif
+    };
+
+    // Colors are packed RGB triples, like GIF color tables.
+    void build_palette(Palette& palette, const std::uint8_t* colors, int num_colors, int transparent_color);
+
+    void expand_palette(const Palette& palette, const std::uint8_t* indices, Pixel* pixels, std::size_t count);
+}
+
+#endif
@@ -0,0 +1,173 @@
+#pragma once
+
+#ifndef DEVI_PRECOMPILED_HPP
+#define DEVI_PRECOMPILED_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "devi.hpp"
+#include "image.hpp"
+#include "lua_file.hpp"
+#include "shared_cache.hpp"
+
+namespace devi
+{
+    // A devi-native container of already decoded frames, made from a GIF or
+    // APNG so later loads skip decoding entirely. Layout:
+    //
+    //   PrecompiledHeader
+    //   PrecompiledFrame * num_frames
+    //   frame pixels, each starting on a PRECOMPILED_ALIGNMENT boundary
+    //
+    // Everything is stored in the platform's byte order; a file from a
+    // platform with another byte order fails the version check and is
+    // simply made again.
+    inline constexpr char PRECOMPILED_MAGIC[8] = { 'D', 'E', 'V', 'I', 'A', 'N', 'I', 'M' };
+    inline constexpr std::uint32_t PRECOMPILED_VERSION = 3;
+    inline constexpr std::size_t PRECOMPILED_ALIGNMENT = 64;
+
+    enum
+    {
+        // Frame pixels, tightly packed.
+        PRECOMPILED_ENCODING_RAW,
+
+        // Runs of 32-bit words: a count with the top bit set repeats the
+        // pixel after it, otherwise that many pixels follow as is.
+        PRECOMPILED_ENCODING_RLE
+    };
+
+    struct PrecompiledHeader
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t flags;
+
+        // Of the file the frames were decoded from: its SHA-256, so stale
+        // frames are never mistaken for current ones. The modification time
+        // (-1 if unknown) lets a file be checked without hashing it.
+        std::uint8_t source_hash[SHA256_SIZE];
+        std::uint64_t source_size;
+        std::int64_t source_modtime;
+
+        std::uint32_t width;
+        std::uint32_t height;
+        std::uint32_t num_frames;
+        std::uint32_t reserved;
+    };
+
+    struct PrecompiledFrame
+    {
+        std::uint32_t x;
+        std::uint32_t y;
+        std::uint32_t width;
+        std::uint32_t height;
+        float delay;
+        std::uint8_t blend_op;
+        std::uint8_t dispose_op;
+        std::uint8_t encoding;
+        std::uint8_t padding;
+
+        // Where the frame's pixels are, from the start of the file.
+        std::uint64_t offset;
+        std::uint64_t size;
+    };
+
+    static_assert(sizeof(PrecompiledHeader) == 80, "precompiled header must be packed");
+    static_assert(sizeof(PrecompiledFrame) == 40, "precompiled frames must be packed");
+
+    // Plays back a precompiled file; reading a frame is a copy (or a run
+    // length decode) out of the file. Only buffered files can be read,
+    // ideally mapped ones.
+    class PrecompiledImageReader : public ImageReader
+    {
+    private:
+        LuaFile file;
+        PrecompiledHeader header;
+        std::vector<PrecompiledFrame> frames;
+        int current_frame = 0;
+
+        void copy_frame(const PrecompiledFrame& entry, Frame& frame, Pixel* pixels, std::size_t num_pixels) const;
+
+    public:
+        PrecompiledImageReader(LuaFile&& file);
+
+        int get_width() const override;
+        int get_height() const override;
+
+        int get_num_frames() const override;
+        int get_current_frame() const override;
+
+        bool is_buffered() const override;
+
+        bool read_into(Frame& frame, Pixel* pixels, std::size_t num_pixels) override;
+        bool seek(int frame) override;
+
+        bool can_decode_frames() const override;
+        bool decode_frame(int index, Frame& frame, Pixel* pixels, std::size_t num_pixels) override;
+        bool get_frame_delay(int index, float& delay) const override;
+        void restart() override;
+    };
+
+    // Builds a precompiled file out of frames as they're decoded, so it can
+    // be made during playback rather than by decoding the file again.
+    class PrecompiledWriter
+    {
+    private:
+        std::uint32_t width;
+        std::uint32_t height;
+        bool is_compressed;
+
+        // Frames are appended to 'data' as they're added; their offsets are
+        // fixed up once the size of the table is known.
+        std::vector<PrecompiledFrame> table;
+        std::vector<std::uint8_t> data;
+        std::vector<std::uint8_t> encoded;
+
+        // Set once the last frame is in. After that, nothing else is changed
+        // by add() or finish(), so whoever decodes can keep calling them.
+        std::atomic<bool> is_finished = false;
+
+    public:
+        // If 'is_compressed', frames that shrink with run length encoding
+        // are stored that way.
+        PrecompiledWriter(int width, int height, bool is_compressed);
+        PrecompiledWriter(const PrecompiledWriter& other) = delete;
+
+        PrecompiledWriter& operator =(const PrecompiledWriter& other) = delete;
+
+        // Adds frame 'index' if it's the next one missing; anything else (a
+        // frame already added, or one after a gap left by seeking) is
+        // ignored, so frames can be added from every loop until one is
+        // complete.
+        void add(int index, const Frame& frame, const Pixel* pixels);
+
+        // Marks the file as complete if every frame before 'num_frames' is
+        // in.
+        void finish(int num_frames);
+        bool is_complete() const;
+
+        void write(const std::uint8_t* source, std::size_t source_size, std::int64_t source_modtime, std::vector<std::uint8_t>& output) const;
+
+        // Frees the frames once they've been written out.
+        void clear();
+    };
+
+    // True if 'data' looks like a precompiled file.
+    bool is_precompiled(const std::uint8_t* data, std::size_t size);
+
+    // True if 'data' is a precompiled file of this version, made from
+    // exactly the file 'source'. If the size and modification time of
+    // 'source' match the ones recorded, it's trusted without being hashed,
+    // so 'source' may be null to only check those.
+    bool is_precompiled_current(const std::uint8_t* data, std::size_t size, const std::uint8_t* source, std::size_t source_size, std::int64_t source_modtime);
+
+    // Reads every frame of 'reader' (from the start) into a precompiled
+    // file. If 'is_compressed', frames that shrink with run length encoding
+    // are stored that way.
+    void write_precompiled(ImageReader& reader, const std::uint8_t* source, std::size_t source_size, std::int64_t source_modtime, bool is_compressed, std::vector<std::uint8_t>& output);
+}
+
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+
+#ifndef DEVI_PREMULTIPLY_HPP
+#define DEVI_PREMULTIPLY_HPP
+
+#include <cstddef>
+
+#include "devi.hpp"
+#include "image.hpp"
+
+// SSE2 is part of x86-64 (and only assumed on 32-bit x86 if enabled);
+// every AArch64 CPU has NEON.
+#if defined(__SSE2__)
+#define DEVI_PREMULTIPLY_SSE2
+#elif defined(__aarch64__)
+#define DEVI_PREMULTIPLY_NEON
+#endif
+
+namespace devi
+{
+    // Multiplies the color of each pixel by its alpha, rounding to nearest.
+    void premultiply(Pixel* pixels, std::size_t count);
+
+    // Premultiplied alpha 'over' operator: each channel of 'destination'
+    // becomes source + destination * (1 - source alpha). Both rows must
+    // already be premultiplied.
+    void blend_premultiplied(Pixel* destination, const Pixel* source, std::size_t count);
+}
+
+#endif
@@ -3,6 +3,10 @@
 #ifndef DEVI_READ_APNG_HPP
 #define DEVI_READ_APNG_HPP
 
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
 #include "png.h"
 
 #include "devi.hpp"
@@ -11,6 +15,37 @@
 
 namespace devi
 {
+    // Image data of a frame (the payload of an IDAT or fdAT chunk, without
+    // the sequence number) in the file.
+    struct APNGDataChunk
+    {
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    struct APNGFrameIndex
+    {
+        // From the frame's fcTL chunk.
+        std::uint32_t x = 0;
+        std::uint32_t y = 0;
+        std::uint32_t width = 0;
+        std::uint32_t height = 0;
+        int blend_op = BLEND_OP_SOURCE;
+        int dispose_op = DISPOSE_OP_BACKGROUND;
+        float delay = 0.0f;
+
+        // Range of the frame's chunks in the reader's chunk list.
+        std::size_t first_chunk = 0;
+        std::size_t num_chunks = 0;
+    };
+
+    // Scratch space for decoding the rows of a frame.
+    struct APNGRows
+    {
+        // Point into the destination; libpng decodes straight into it.
+        std::vector<png_bytep> pointers;
+    };
+
     class APNGImageReader : public ImageReader
     {
     private:
@@ -19,12 +54,26 @@ namespace devi
         LuaFile file;
         int current_frame = 0;
 
-        png_bytepp row_pointers = nullptr;
+        // Sized for the whole image once and reused for every frame.
+        APNGRows rows;
+
+        // Built once by walking the chunks without decoding anything.
+        std::vector<std::uint8_t> header_chunks;
+        std::vector<APNGFrameIndex> frame_index;
+        std::vector<APNGDataChunk> frame_chunks;
+
+        // Set after seeking; frames are then decoded from the index until
+        // the reader is restarted.
+        bool is_indexed = false;
 
         void open();
-        void save_stack();
+        void build_index();
         void release();
 
+        void read_pixels(png_structp png, png_infop info, const Frame& frame, Pixel* pixels, APNGRows& rows);
+        void decode_indexed(int index, Frame& frame, Pixel* pixels, std::size_t num_pixels, APNGRows& rows);
+        bool read_indexed(Frame& frame, Pixel* pixels, std::size_t num_pixels);
+
     public:
         APNGImageReader(LuaFile&& file);
         ~APNGImageReader();
@@ -35,7 +84,14 @@ namespace devi
         int get_num_frames() const override;
         int get_current_frame() const override;
 
-        bool read(Frame& frame) override;
+        bool is_buffered() const override;
+
+        bool read_into(Frame& frame, Pixel* pixels, std::size_t num_pixels) override;
+        bool seek(int frame) override;
+
+        bool can_decode_frames() const override;
+        bool decode_frame(int index, Frame& frame, Pixel* pixels, std::size_t num_pixels) override;
+        bool get_frame_delay(int index, float& delay) const override;
         virtual void restart() override;
     };
 }
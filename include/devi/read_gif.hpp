@@ -3,27 +3,94 @@
 #ifndef DEVI_READ_GIF_HPP
 #define DEVI_READ_GIF_HPP
 
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
 #include "gif_lib.h"
 
 #include "devi.hpp"
 #include "image.hpp"
 #include "lua_file.hpp"
+#include "palette.hpp"
 
 namespace devi
 {
+    enum
+    {
+        // The in-tree LZW decoder: decodes a whole frame at once, straight
+        // from the file's buffer.
+        GIF_DECODER_NATIVE,
+
+        // giflib, a row at a time.
+        GIF_DECODER_GIFLIB
+    };
+
+    struct GIFFrameIndex
+    {
+        // Where the frame's records (extensions, then the image descriptor)
+        // start in the file.
+        std::size_t offset = 0;
+
+        // From the frame's Graphics Control Extension, if any.
+        float delay = 0.0f;
+        int dispose_op = DISPOSE_OP_NONE;
+        int transparent_color = -1;
+
+        // From the image descriptor.
+        int left = 0;
+        int top = 0;
+        int width = 0;
+        int height = 0;
+        bool is_interlaced = false;
+
+        // Offset and number of colors of the local color map, if any.
+        std::size_t color_map_offset = 0;
+        int color_map_size = 0;
+
+        // The LZW minimum code size, followed by the image data sub-blocks.
+        std::size_t data_offset = 0;
+        std::size_t data_size = 0;
+    };
+
     class GIFImageReader : public ImageReader
     {
     private:
         GifFileType* gif = nullptr;
         LuaFile file;
+        int decoder;
         int current_frame = 0;
 
+        // Reused for every row of every frame.
+        std::vector<GifPixelType> gif_row;
+
+        // Rebuilt for every frame, since the color map and transparent
+        // index can change.
+        Palette gif_palette;
+
+        // Reused for every frame by the native decoder: the frame's color
+        // indices, and (for streamed files) its color map & image data.
+        std::vector<std::uint8_t> gif_indices;
+        std::vector<std::uint8_t> gif_data;
+
+        // Built once by walking the file without decoding any image data.
+        std::vector<GIFFrameIndex> frame_index;
+
         void open();
+        void build_index();
         void release();
-        void render(Frame& frame, const GifPixelType* row, int y, int transparent_color);
+        void render(const Palette& palette, Frame& frame, Pixel* pixels, const GifPixelType* row, int y);
+        bool read_frame(GifFileType* source, Frame& frame, Pixel* pixels, std::size_t num_pixels, std::vector<GifPixelType>& row, Palette& palette);
+
+        // Gets bytes of the file; buffered files are read in place.
+        const std::uint8_t* read_bytes(std::size_t offset, std::size_t size, std::vector<std::uint8_t>& storage);
+
+        // Returns false if the frame is too large to decode at once; such
+        // frames are left to giflib.
+        bool read_native(const GIFFrameIndex& entry, Frame& frame, Pixel* pixels, std::size_t num_pixels, std::vector<std::uint8_t>& indices, std::vector<std::uint8_t>& data, Palette& palette);
 
     public:
-        GIFImageReader(LuaFile &&file);
+        GIFImageReader(LuaFile &&file, int decoder = GIF_DECODER_NATIVE);
         ~GIFImageReader();
 
         int get_width() const override;
@@ -32,9 +99,22 @@ namespace devi
         int get_num_frames() const override;
         int get_current_frame() const override;
 
-        bool read(Frame &frame) override;
+        bool is_buffered() const override;
+
+        const std::vector<GIFFrameIndex>& get_frame_index() const;
+
+        bool read_into(Frame& frame, Pixel* pixels, std::size_t num_pixels) override;
+        bool seek(int frame) override;
+
+        bool can_decode_frames() const override;
+        bool decode_frame(int index, Frame& frame, Pixel* pixels, std::size_t num_pixels) override;
+        bool get_frame_delay(int index, float& delay) const override;
         virtual void restart() override;
     };
+
+    // Gets a GIF_DECODER_* from its name ("native" or "giflib") at index;
+    // nil is "native".
+    int get_gif_decoder(lua_State* L, int index);
 }
 
 #endif
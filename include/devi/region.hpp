@@ -0,0 +1,48 @@
+#pragma once
+
+#ifndef DEVI_REGION_HPP
+#define DEVI_REGION_HPP
+
+#include <cstddef>
+
+#include "devi.hpp"
+#include "image.hpp"
+
+namespace devi
+{
+    // A few non-overlapping rectangles covering the changed parts of the
+    // canvas. Far apart changes (e.g., a sprite moving across the canvas,
+    // disposing where it was) stay separate instead of being uploaded as
+    // one rectangle covering both.
+    class Region
+    {
+    public:
+        static constexpr int MAX_RECTANGLES = 4;
+
+    private:
+        Rectangle rectangles[MAX_RECTANGLES];
+        int num_rectangles = 0;
+
+        void remove(int index);
+
+    public:
+        int get_num_rectangles() const;
+        const Rectangle& get_rectangle(int index) const;
+        Rectangle get_bounds() const;
+
+        bool is_empty() const;
+        std::size_t get_area() const;
+
+        // Overlapping rectangles are merged. Past MAX_RECTANGLES, the two
+        // rectangles that grow the least when merged are merged.
+        void add(const Rectangle& rectangle);
+        void add(const Region& other);
+
+        // Shrinks (or drops) a rectangle to the part of it that is set.
+        void set_rectangle(int index, const Rectangle& rectangle);
+
+        void clear();
+    };
+}
+
+#endif
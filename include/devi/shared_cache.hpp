@@ -0,0 +1,32 @@
+#pragma once
+
+#ifndef DEVI_SHARED_CACHE_HPP
+#define DEVI_SHARED_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "devi.hpp"
+#include "frame_cache.hpp"
+
+namespace devi
+{
+    inline constexpr std::size_t SHA256_SIZE = 32;
+
+    // Writes the SHA-256 of 'data' to 'digest' (SHA256_SIZE bytes).
+    void sha256(const std::uint8_t* data, std::size_t size, std::uint8_t* digest);
+
+    // Key of the shared cache for a file's contents: its SHA-256 and size.
+    std::string get_shared_cache_key(const std::uint8_t* data, std::size_t size);
+
+    // Process-wide registry of frame caches keyed by (usually) a hash of the
+    // source file. Entries live as long as some compositor references them.
+    // get_shared_cache only returns a cache with the same limit and
+    // compression; find_shared_cache prefers a complete one.
+    std::shared_ptr<FrameCache> find_shared_cache(const std::string& key);
+    std::shared_ptr<FrameCache> get_shared_cache(const std::string& key, std::size_t limit, int width, int height, bool is_compressed = false);
+}
+
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+#ifndef DEVI_THREAD_POOL_HPP
+#define DEVI_THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace devi
+{
+    // A fixed set of worker threads running tasks in the order they were
+    // submitted. Tasks must not throw; they report errors themselves.
+    class ThreadPool
+    {
+    private:
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::deque<std::function<void()>> tasks;
+        std::vector<std::thread> threads;
+        bool is_stopping = false;
+
+        void run();
+
+    public:
+        ThreadPool(std::size_t num_threads);
+        ~ThreadPool();
+
+        std::size_t get_num_threads() const;
+
+        void submit(std::function<void()> task);
+    };
+
+    // Process-wide pool with a thread per core, created on first use.
+    ThreadPool& get_thread_pool();
+}
+
+#endif
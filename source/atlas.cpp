@@ -0,0 +1,406 @@
+#include <cstring>
+#include <stdexcept>
+#include "devi/atlas.hpp"
+#include "devi/compositor.hpp"
+#include "devi/memory.hpp"
+
+// Only finds candidates for duplicate frames, which are then compared byte
+// by byte, so it just needs to be fast: FNV-1a eight bytes at a time,
+// followed by the MurmurHash3 finalizer to make up for the weaker mixing.
+static std::uint64_t devi_atlas_hash(const std::uint8_t* data, std::size_t size)
+{
+    const std::uint64_t prime = 0x100000001b3ULL;
+
+    std::uint64_t result = 0xcbf29ce484222325ULL ^ size;
+
+    std::size_t i = 0;
+    for (; i + sizeof(std::uint64_t) <= size; i += sizeof(std::uint64_t))
+    {
+        std::uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+
+        result = (result ^ word) * prime;
+        result ^= result >> 32;
+    }
+
+    for (; i < size; ++i)
+    {
+        result = (result ^ data[i]) * prime;
+    }
+
+    result ^= result >> 33;
+    result *= 0xff51afd7ed558ccdULL;
+    result ^= result >> 33;
+    result *= 0xc4ceb9fe1a85ec53ULL;
+    result ^= result >> 33;
+
+    return result;
+}
+
+devi::Atlas::Atlas(int frame_width, int frame_height, int max_size, std::size_t limit) :
+    frame_width(frame_width),
+    frame_height(frame_height),
+    limit(limit)
+{
+    if (frame_width <= 0 || frame_height <= 0)
+    {
+        throw std::runtime_error("can't make an atlas of an empty image");
+    }
+
+    if (frame_width > max_size || frame_height > max_size)
+    {
+        throw std::runtime_error("image too large for an atlas");
+    }
+
+    columns = max_size / frame_width;
+    rows = max_size / frame_height;
+}
+
+int devi::Atlas::get_frame_width() const
+{
+    return frame_width;
+}
+
+int devi::Atlas::get_frame_height() const
+{
+    return frame_height;
+}
+
+std::size_t devi::Atlas::get_size() const
+{
+    return size;
+}
+
+std::size_t devi::Atlas::get_max_size(int num_frames) const
+{
+    // Pages hold a whole number of rows, so every row but the last is full.
+    auto num_rows = ((std::size_t)num_frames + columns - 1) / columns;
+    return num_rows * columns * frame_width * frame_height * sizeof(Pixel);
+}
+
+int devi::Atlas::get_num_pages() const
+{
+    return (int)pages.size();
+}
+
+const devi::AtlasPage& devi::Atlas::get_page(int index) const
+{
+    if (index < 0 || index >= (int)pages.size())
+    {
+        throw std::out_of_range("atlas page index out of bounds");
+    }
+
+    return pages[index];
+}
+
+int devi::Atlas::get_num_cells() const
+{
+    return (int)cells.size();
+}
+
+const devi::AtlasCell& devi::Atlas::get_cell(int index) const
+{
+    if (index < 0 || index >= (int)cells.size())
+    {
+        throw std::out_of_range("atlas cell index out of bounds");
+    }
+
+    return cells[index];
+}
+
+int devi::Atlas::get_num_frames() const
+{
+    return (int)frames.size();
+}
+
+const devi::AtlasFrame& devi::Atlas::get_frame(int index) const
+{
+    if (index < 0 || index >= (int)frames.size())
+    {
+        throw std::out_of_range("atlas frame index out of bounds");
+    }
+
+    return frames[index];
+}
+
+bool devi::Atlas::is_same(const AtlasCell& cell, const Pixel* pixels) const
+{
+    auto& page = pages[cell.page];
+    auto row_size = frame_width * sizeof(Pixel);
+
+    for (auto j = 0; j < frame_height; ++j)
+    {
+        auto row = &page.pixels[(cell.y + j) * page.width + cell.x];
+        if (std::memcmp(row, pixels + j * frame_width, row_size) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void devi::Atlas::write(const AtlasCell& cell, const Pixel* pixels)
+{
+    auto& page = pages[cell.page];
+    auto row_size = frame_width * sizeof(Pixel);
+
+    for (auto j = 0; j < frame_height; ++j)
+    {
+        auto row = &page.pixels[(cell.y + j) * page.width + cell.x];
+        std::memcpy(row, pixels + j * frame_width, row_size);
+    }
+}
+
+bool devi::Atlas::add(float delay, const Pixel* pixels)
+{
+    auto num_pixels = (std::size_t)frame_width * frame_height;
+    auto pixels_hash = devi_atlas_hash((const std::uint8_t*)pixels, num_pixels * sizeof(Pixel));
+
+    // Loops often come back to the same frame (e.g., an idle pose); only
+    // the first one takes up space.
+    auto range = cell_hashes.equal_range(pixels_hash);
+    for (auto iter = range.first; iter != range.second; ++iter)
+    {
+        if (is_same(cells[iter->second], pixels))
+        {
+            frames.push_back({ iter->second, delay });
+            return true;
+        }
+    }
+
+    auto index = (int)cells.size();
+    auto cells_per_page = columns * rows;
+    auto page_index = index / cells_per_page;
+    auto column = (index % cells_per_page) % columns;
+    auto row = (index % cells_per_page) / columns;
+
+    if (page_index == (int)pages.size())
+    {
+        auto& page = pages.emplace_back();
+        page.width = columns * frame_width;
+    }
+
+    // Pages grow a row of cells at a time.
+    auto& page = pages[page_index];
+    if ((row + 1) * frame_height > page.height)
+    {
+        auto row_size = (std::size_t)page.width * frame_height * sizeof(Pixel);
+        if (size + row_size > limit)
+        {
+            return false;
+        }
+
+        page.height += frame_height;
+        resize_buffer(page.pixels, (std::size_t)page.width * page.height);
+
+        size += row_size;
+    }
+
+    AtlasCell cell = { page_index, column * frame_width, row * frame_height };
+    write(cell, pixels);
+
+    cells.push_back(cell);
+    cell_hashes.emplace(pixels_hash, index);
+    frames.push_back({ index, delay });
+
+    return true;
+}
+
+void devi::Atlas::finish()
+{
+    // Only a single, partial row can be narrower than a full page.
+    if (pages.size() != 1 || (int)cells.size() >= columns)
+    {
+        return;
+    }
+
+    auto& page = pages.front();
+    auto width = (int)cells.size() * frame_width;
+
+    for (auto j = 1; j < page.height; ++j)
+    {
+        std::memmove(&page.pixels[j * width], &page.pixels[j * page.width], width * sizeof(Pixel));
+    }
+
+    page.width = width;
+    page.pixels.resize((std::size_t)page.width * page.height);
+    page.pixels.shrink_to_fit();
+
+    size = page.pixels.size() * sizeof(Pixel);
+}
+
+struct LuaAtlas
+{
+    devi::Atlas* atlas;
+};
+
+static int devi_atlas_get_frame_size(lua_State* L)
+{
+    auto atlas = ((LuaAtlas*)luaL_checkudata(L, 1, "devi.Atlas"))->atlas;
+    lua_pushinteger(L, atlas->get_frame_width());
+    lua_pushinteger(L, atlas->get_frame_height());
+
+    return 2;
+}
+
+static int devi_atlas_get_num_pages(lua_State* L)
+{
+    auto atlas = ((LuaAtlas*)luaL_checkudata(L, 1, "devi.Atlas"))->atlas;
+    lua_pushinteger(L, atlas->get_num_pages());
+
+    return 1;
+}
+
+static int devi_atlas_get_page_size(lua_State* L)
+{
+    auto atlas = ((LuaAtlas*)luaL_checkudata(L, 1, "devi.Atlas"))->atlas;
+
+    auto& page = atlas->get_page(luaL_checkinteger(L, 2) - 1);
+    lua_pushinteger(L, page.width);
+    lua_pushinteger(L, page.height);
+
+    return 2;
+}
+
+static int devi_atlas_copy_page(lua_State* L)
+{
+    auto atlas = ((LuaAtlas*)luaL_checkudata(L, 1, "devi.Atlas"))->atlas;
+
+    auto& page = atlas->get_page(luaL_checkinteger(L, 2) - 1);
+
+    luaL_checktype(L, 3, LUA_TLIGHTUSERDATA);
+    auto destination = (devi::Pixel*)lua_touserdata(L, 3);
+
+    std::memcpy(destination, page.pixels.data(), page.pixels.size() * sizeof(devi::Pixel));
+
+    return 0;
+}
+
+static int devi_atlas_get_num_cells(lua_State* L)
+{
+    auto atlas = ((LuaAtlas*)luaL_checkudata(L, 1, "devi.Atlas"))->atlas;
+    lua_pushinteger(L, atlas->get_num_cells());
+
+    return 1;
+}
+
+static int devi_atlas_get_cell(lua_State* L)
+{
+    auto atlas = ((LuaAtlas*)luaL_checkudata(L, 1, "devi.Atlas"))->atlas;
+
+    auto& cell = atlas->get_cell(luaL_checkinteger(L, 2) - 1);
+    lua_pushinteger(L, cell.page + 1);
+    lua_pushinteger(L, cell.x);
+    lua_pushinteger(L, cell.y);
+
+    return 3;
+}
+
+static int devi_atlas_get_num_frames(lua_State* L)
+{
+    auto atlas = ((LuaAtlas*)luaL_checkudata(L, 1, "devi.Atlas"))->atlas;
+    lua_pushinteger(L, atlas->get_num_frames());
+
+    return 1;
+}
+
+static int devi_atlas_get_frame(lua_State* L)
+{
+    auto atlas = ((LuaAtlas*)luaL_checkudata(L, 1, "devi.Atlas"))->atlas;
+
+    auto& frame = atlas->get_frame(luaL_checkinteger(L, 2) - 1);
+    lua_pushinteger(L, frame.cell + 1);
+    lua_pushnumber(L, frame.delay);
+
+    return 2;
+}
+
+static int devi_atlas_gc(lua_State* L)
+{
+    auto lua_atlas = (LuaAtlas*)luaL_checkudata(L, 1, "devi.Atlas");
+
+    delete lua_atlas->atlas;
+    lua_atlas->atlas = nullptr;
+
+    return 0;
+}
+
+static luaL_Reg DEVI_ATLAS_METHODS[] = {
+    { "getFrameSize", &devi_atlas_get_frame_size },
+    { "getNumPages", &devi_atlas_get_num_pages },
+    { "getPageSize", &devi_atlas_get_page_size },
+    { "copyPage", &devi_atlas_copy_page },
+    { "getNumCells", &devi_atlas_get_num_cells },
+    { "getCell", &devi_atlas_get_cell },
+    { "getNumFrames", &devi_atlas_get_num_frames },
+    { "getFrame", &devi_atlas_get_frame },
+    { nullptr, nullptr }
+};
+
+// Atlas(compositor, maxSize, limit): plays the compositor through one loop
+// and packs every frame. Returns nothing if the atlas doesn't fit in limit
+// bytes, without decoding anything when the frame count already rules it
+// out; either way, the compositor is restarted afterwards.
+static int devi_atlas_new(lua_State* L)
+{
+    auto compositor = devi::to_compositor(L, 1);
+    auto max_size = luaL_checkinteger(L, 2);
+    auto limit = luaL_checkinteger(L, 3);
+    auto byte_limit = limit < 0 ? 0 : (std::size_t)limit;
+
+    if (compositor->get_current_frame() != 0)
+    {
+        return luaL_error(L, "atlas must be made from the start of the animation");
+    }
+
+    auto lua_atlas = (LuaAtlas*)lua_newuserdata(L, sizeof(LuaAtlas));
+    lua_atlas->atlas = nullptr;
+
+    if (luaL_newmetatable(L, "devi.Atlas"))
+    {
+        devi::luax_register(L, DEVI_ATLAS_METHODS);
+        lua_setfield(L, -2, "__index");
+
+        devi::luax_pushcfunction(L, &devi_atlas_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+
+    lua_setmetatable(L, -2);
+
+    lua_atlas->atlas = new devi::Atlas(
+        compositor->get_width(), compositor->get_height(),
+        (int)max_size, byte_limit);
+
+    // Counting repeated frames as distinct may turn away an animation that
+    // would have fit, but saves playing a whole loop to find out.
+    if (lua_atlas->atlas->get_max_size(compositor->get_num_frames()) > byte_limit)
+    {
+        return 0;
+    }
+
+    bool fits = true;
+    while (fits && compositor->read())
+    {
+        fits = lua_atlas->atlas->add(compositor->get_frame().delay, compositor->get_pixels());
+    }
+
+    compositor->restart();
+
+    if (!fits || lua_atlas->atlas->get_num_frames() == 0)
+    {
+        return 0;
+    }
+
+    lua_atlas->atlas->finish();
+
+    return 1;
+}
+
+extern "C"
+DEVI_EXPORT int luaopen_devi_Atlas(lua_State* L)
+{
+    devi::luax_pushcfunction(L, &devi_atlas_new);
+
+    return 1;
+}
@@ -0,0 +1,476 @@
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include "devi/batch.hpp"
+#include "devi/lua_file.hpp"
+#include "devi/precompiled.hpp"
+#include "devi/read_apng.hpp"
+#include "devi/read_gif.hpp"
+#include "devi/shared_cache.hpp"
+#include "devi/thread_pool.hpp"
+
+devi::Batch::~Batch()
+{
+    wait();
+
+    for (auto& entry: entries)
+    {
+        delete entry.compositor;
+        delete entry.reader;
+        delete entry.file;
+    }
+}
+
+// The file is already in memory, so the format is picked by its signature
+// rather than its name.
+static devi::ImageReader* devi_batch_new_reader(const std::uint8_t* data, std::size_t size, int gif_decoder, const char*& format)
+{
+    static const std::uint8_t png_signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+    if (size >= sizeof(png_signature) && std::memcmp(data, png_signature, sizeof(png_signature)) == 0)
+    {
+        format = "png";
+        return new devi::APNGImageReader(devi::LuaFile(data, size));
+    }
+
+    if (size >= 6 && (std::memcmp(data, "GIF87a", 6) == 0 || std::memcmp(data, "GIF89a", 6) == 0))
+    {
+        format = "gif";
+        return new devi::GIFImageReader(devi::LuaFile(data, size), gif_decoder);
+    }
+
+    if (devi::is_precompiled(data, size))
+    {
+        format = "devi";
+        return new devi::PrecompiledImageReader(devi::LuaFile(data, size));
+    }
+
+    throw std::runtime_error("not a valid animated image");
+}
+
+// Shared entries are keyed by the contents of the file itself, even if it's
+// played back from a precompiled file.
+static void devi_batch_set_key(devi::BatchEntry& entry)
+{
+    entry.options.key = devi::get_shared_cache_key(entry.data, entry.size);
+    entry.options.has_key = true;
+
+    // Premultiplied frames can't be shared with straight ones.
+    if (entry.options.is_premultiplied)
+    {
+        entry.options.key += ":premultiplied";
+    }
+}
+
+// Opens the file at the entry's path, or defers the entry if it can't be.
+// Either the file or its precompiled copy is read from then on.
+static void devi_batch_open(devi::BatchEntry& entry)
+{
+    try
+    {
+        entry.file = new devi::MappedFile(entry.path, entry.is_mapped);
+    }
+    catch (const std::exception& error)
+    {
+        entry.error = error.what();
+        entry.is_deferred = true;
+
+        return;
+    }
+
+    entry.data = entry.file->get_data();
+    entry.size = entry.file->get_size();
+
+    if (entry.precompiled_data && devi::is_precompiled_current(entry.precompiled_data, entry.precompiled_size, entry.data, entry.size, entry.modtime))
+    {
+        if (entry.is_shared)
+        {
+            devi_batch_set_key(entry);
+        }
+
+        delete entry.file;
+        entry.file = nullptr;
+
+        entry.data = entry.precompiled_data;
+        entry.size = entry.precompiled_size;
+        entry.is_precompiled = true;
+
+        // There's nothing left to record.
+        entry.options.is_recording = false;
+    }
+}
+
+void devi::Batch::load(BatchEntry& entry)
+{
+    if (!entry.path.empty())
+    {
+        devi_batch_open(entry);
+        if (entry.is_deferred)
+        {
+            return;
+        }
+    }
+
+    try
+    {
+        entry.reader = devi_batch_new_reader(entry.data, entry.size, entry.gif_decoder, entry.format);
+
+        if (entry.is_shared && !entry.options.has_key)
+        {
+            devi_batch_set_key(entry);
+        }
+
+        // This already runs on the pool; decoding frames on it as well could
+        // wait forever on tasks queued behind other entries.
+        if (entry.options.has_decode_threads)
+        {
+            entry.options.decode_threads = 1;
+        }
+
+        entry.compositor = new Compositor(entry.reader);
+        entry.compositor->configure(entry.options);
+    }
+    catch (const std::exception& error)
+    {
+        entry.error = error.what();
+    }
+    catch (...)
+    {
+        entry.error = "unknown error";
+    }
+
+    if (!entry.error.empty())
+    {
+        delete entry.compositor;
+        delete entry.reader;
+        delete entry.file;
+
+        entry.compositor = nullptr;
+        entry.reader = nullptr;
+        entry.file = nullptr;
+    }
+}
+
+int devi::Batch::add(const BatchEntry& entry)
+{
+    if (is_started)
+    {
+        throw std::runtime_error("can't add to a batch that has started");
+    }
+
+    entries.push_back(entry);
+    done.push_back(false);
+
+    return (int)entries.size() - 1;
+}
+
+void devi::Batch::start()
+{
+    if (is_started)
+    {
+        return;
+    }
+
+    is_started = true;
+
+    auto& thread_pool = get_thread_pool();
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+        thread_pool.submit([this, i]()
+        {
+            load(entries[i]);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            done[i] = true;
+            ++num_done;
+
+            if (entries[i].is_deferred)
+            {
+                ++num_deferred;
+            }
+
+            condition.notify_all();
+        });
+    }
+}
+
+int devi::Batch::get_num_entries() const
+{
+    return (int)entries.size();
+}
+
+int devi::Batch::get_num_done()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return num_done;
+}
+
+bool devi::Batch::is_done()
+{
+    return get_num_done() == get_num_entries();
+}
+
+int devi::Batch::get_num_loaded()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return num_done - num_deferred;
+}
+
+void devi::Batch::wait()
+{
+    if (!is_started)
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&] { return num_done == (int)entries.size(); });
+}
+
+void devi::Batch::wait(int index)
+{
+    if (index < 0 || index >= (int)entries.size())
+    {
+        throw std::out_of_range("batch entry index out of bounds");
+    }
+
+    start();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&] { return (bool)done[index]; });
+}
+
+devi::BatchEntry devi::Batch::take(int index)
+{
+    wait(index);
+
+    auto& entry = entries[index];
+    auto result = entry;
+
+    entry.reader = nullptr;
+    entry.compositor = nullptr;
+    entry.file = nullptr;
+
+    return result;
+}
+
+struct LuaBatch
+{
+    devi::Batch* batch;
+
+    // The files of the entries (or their precompiled files), kept alive
+    // until the batch is collected.
+    std::vector<int>* references;
+};
+
+static void devi_batch_get_options(lua_State* L, int index, devi::BatchEntry& entry)
+{
+    if (lua_isnoneornil(L, index))
+    {
+        return;
+    }
+
+    devi::get_compositor_options(L, index, entry.options);
+
+    lua_getfield(L, index, "shared");
+    entry.is_shared = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "gifDecoder");
+    entry.gif_decoder = devi::get_gif_decoder(L, lua_gettop(L));
+    lua_pop(L, 1);
+}
+
+static int devi_batch_add(lua_State* L)
+{
+    auto lua_batch = (LuaBatch*)luaL_checkudata(L, 1, "devi.Batch");
+
+    devi::BatchEntry entry;
+    if (!devi::get_lua_buffer(L, 2, entry.data, entry.size))
+    {
+        return luaL_argerror(L, 2, "expected string, Data, or mapped file");
+    }
+
+    devi_batch_get_options(L, 3, entry);
+
+    auto index = lua_batch->batch->add(entry);
+
+    lua_pushvalue(L, 2);
+    lua_batch->references->push_back(luaL_ref(L, LUA_REGISTRYINDEX));
+
+    lua_pushinteger(L, index + 1);
+
+    return 1;
+}
+
+// Like add, but the file at the (native) path is opened by the loading
+// thread; options can also have 'map' (false to read the file rather than
+// map it). precompiled is a precompiled file made from it, used if still
+// current as of modtime.
+static int devi_batch_add_file(lua_State* L)
+{
+    auto lua_batch = (LuaBatch*)luaL_checkudata(L, 1, "devi.Batch");
+
+    devi::BatchEntry entry;
+    entry.path = luaL_checkstring(L, 2);
+
+    devi_batch_get_options(L, 3, entry);
+
+    if (!lua_isnoneornil(L, 3))
+    {
+        lua_getfield(L, 3, "map");
+        entry.is_mapped = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    if (!lua_isnoneornil(L, 4) && !devi::get_lua_buffer(L, 4, entry.precompiled_data, entry.precompiled_size))
+    {
+        return luaL_argerror(L, 4, "expected string, Data, or mapped file");
+    }
+
+    if (lua_isnumber(L, 5))
+    {
+        entry.modtime = (std::int64_t)lua_tonumber(L, 5);
+    }
+
+    auto index = lua_batch->batch->add(entry);
+
+    lua_pushvalue(L, 4);
+    lua_batch->references->push_back(luaL_ref(L, LUA_REGISTRYINDEX));
+
+    lua_pushinteger(L, index + 1);
+
+    return 1;
+}
+
+static int devi_batch_start(lua_State* L)
+{
+    auto batch = ((LuaBatch*)luaL_checkudata(L, 1, "devi.Batch"))->batch;
+    batch->start();
+
+    return 0;
+}
+
+static int devi_batch_get_progress(lua_State* L)
+{
+    auto batch = ((LuaBatch*)luaL_checkudata(L, 1, "devi.Batch"))->batch;
+    lua_pushinteger(L, batch->get_num_loaded());
+    lua_pushinteger(L, batch->get_num_entries());
+
+    return 2;
+}
+
+static int devi_batch_is_done(lua_State* L)
+{
+    auto batch = ((LuaBatch*)luaL_checkudata(L, 1, "devi.Batch"))->batch;
+    lua_pushboolean(L, batch->is_done());
+
+    return 1;
+}
+
+static int devi_batch_wait(lua_State* L)
+{
+    auto batch = ((LuaBatch*)luaL_checkudata(L, 1, "devi.Batch"))->batch;
+    batch->wait();
+
+    return 0;
+}
+
+// Returns the format, reader, compositor and file of a loaded entry (waiting
+// for it if needed), or nil, the error and whether the entry was deferred.
+// The reader reads the file in place, so the caller must keep that alive as
+// long as the reader.
+static int devi_batch_take(lua_State* L)
+{
+    auto lua_batch = (LuaBatch*)luaL_checkudata(L, 1, "devi.Batch");
+
+    auto index = (int)luaL_checkinteger(L, 2) - 1;
+    auto entry = lua_batch->batch->take(index);
+    if (!entry.reader)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, entry.error.empty() ? "already taken" : entry.error.c_str());
+        lua_pushboolean(L, entry.is_deferred);
+
+        return 3;
+    }
+
+    lua_pushstring(L, entry.format);
+
+    devi::push_image_reader(L, entry.reader);
+    devi::push_compositor(L, entry.compositor, lua_gettop(L));
+
+    if (entry.file)
+    {
+        devi::push_mapped_file(L, entry.file);
+    }
+    else
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, (*lua_batch->references)[index]);
+    }
+
+    return 4;
+}
+
+static int devi_batch_gc(lua_State* L)
+{
+    auto lua_batch = (LuaBatch*)luaL_checkudata(L, 1, "devi.Batch");
+
+    delete lua_batch->batch;
+    lua_batch->batch = nullptr;
+
+    if (lua_batch->references)
+    {
+        for (auto reference: *lua_batch->references)
+        {
+            luaL_unref(L, LUA_REGISTRYINDEX, reference);
+        }
+
+        delete lua_batch->references;
+        lua_batch->references = nullptr;
+    }
+
+    return 0;
+}
+
+static luaL_Reg DEVI_BATCH_METHODS[] = {
+    { "add", &devi_batch_add },
+    { "addFile", &devi_batch_add_file },
+    { "start", &devi_batch_start },
+    { "getProgress", &devi_batch_get_progress },
+    { "isDone", &devi_batch_is_done },
+    { "wait", &devi_batch_wait },
+    { "take", &devi_batch_take },
+    { nullptr, nullptr }
+};
+
+static int devi_batch_new(lua_State* L)
+{
+    auto lua_batch = (LuaBatch*)lua_newuserdata(L, sizeof(LuaBatch));
+    lua_batch->batch = nullptr;
+    lua_batch->references = nullptr;
+
+    if (luaL_newmetatable(L, "devi.Batch"))
+    {
+        devi::luax_register(L, DEVI_BATCH_METHODS);
+        lua_setfield(L, -2, "__index");
+
+        devi::luax_pushcfunction(L, &devi_batch_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+
+    lua_setmetatable(L, -2);
+
+    lua_batch->batch = new devi::Batch();
+    lua_batch->references = new std::vector<int>();
+
+    return 1;
+}
+
+extern "C"
+DEVI_EXPORT int luaopen_devi_Batch(lua_State* L)
+{
+    devi::luax_pushcfunction(L, &devi_batch_new);
+
+    return 1;
+}
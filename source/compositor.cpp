@@ -0,0 +1,1760 @@
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include "devi/compositor.hpp"
+#include "devi/memory.hpp"
+#include "devi/premultiply.hpp"
+#include "devi/shared_cache.hpp"
+#include "devi/thread_pool.hpp"
+
+devi::Compositor::Compositor(ImageReader* reader) :
+    reader(reader),
+    width(reader->get_width()),
+    height(reader->get_height()),
+    num_frames(reader->get_num_frames())
+{
+    // Everything needed for playback is allocated up front.
+    resize_buffer(pixels, width * height);
+    resize_buffer(previous_pixels, width * height);
+    resize_buffer(delays, num_frames);
+
+    // Readers with an index know the delays up front, so skip() works from
+    // the start; the rest are filled in as frames are played.
+    while (num_delays < num_frames && reader->get_frame_delay(num_delays, delays[num_delays]))
+    {
+        ++num_delays;
+    }
+}
+
+devi::Compositor::Compositor(const std::shared_ptr<FrameCache>& cache) :
+    reader(nullptr),
+    width(cache->get_width()),
+    height(cache->get_height()),
+    num_frames(cache->get_num_frames()),
+    cache(cache)
+{
+    if (!cache->is_complete())
+    {
+        throw std::runtime_error("cache is not complete");
+    }
+
+    // There's nothing to go back to if the cache were evicted.
+    cache->pin();
+
+    resize_buffer(delays, num_frames);
+    resize_buffer(pixels, width * height);
+
+    for (; num_delays < num_frames; ++num_delays)
+    {
+        delays[num_delays] = cache->get_frame(num_delays).delay;
+    }
+}
+
+devi::Compositor::~Compositor()
+{
+    stop();
+
+    if (cache && !reader)
+    {
+        cache->unpin();
+    }
+
+    if (cache && is_cache_owner && !cache->is_complete())
+    {
+        // Let another compositor sharing the cache fill it instead.
+        cache->clear();
+        cache->release();
+    }
+}
+
+static void devi_copy_frame_info(devi::Frame& target, const devi::Frame& source)
+{
+    target.x = source.x;
+    target.y = source.y;
+    target.width = source.width;
+    target.height = source.height;
+    target.blend_op = source.blend_op;
+    target.dispose_op = source.dispose_op;
+    target.delay = source.delay;
+}
+
+void devi::Compositor::dispose()
+{
+    auto& r = dispose_rectangle;
+
+    switch (dispose_op)
+    {
+        case DISPOSE_OP_BACKGROUND:
+            for (auto j = 0; j < r.height; ++j)
+            {
+                auto row = &pixels[(r.y + j) * width + r.x];
+                std::fill(row, row + r.width, Pixel { 0, 0, 0, 0 });
+            }
+
+            break;
+
+        case DISPOSE_OP_PREVIOUS:
+            for (auto j = 0; j < r.height; ++j)
+            {
+                std::memcpy(
+                    &pixels[(r.y + j) * width + r.x],
+                    &previous_pixels[j * r.width],
+                    r.width * sizeof(Pixel));
+            }
+
+            break;
+
+        case DISPOSE_OP_NONE:
+        default:
+            break;
+    }
+
+    dispose_op = DISPOSE_OP_NONE;
+}
+
+void devi::Compositor::save_previous()
+{
+    auto& r = dispose_rectangle;
+
+    for (auto j = 0; j < r.height; ++j)
+    {
+        std::memcpy(
+            &previous_pixels[j * r.width],
+            &pixels[(r.y + j) * width + r.x],
+            r.width * sizeof(Pixel));
+    }
+}
+
+void devi::Compositor::blend()
+{
+    auto& r = dispose_rectangle;
+
+    for (auto j = 0; j < r.height; ++j)
+    {
+        auto source = &decoded_frame.pixels[j * decoded_frame.width];
+        auto destination = &pixels[(r.y + j) * width + r.x];
+
+        if (decoded_frame.blend_op == BLEND_OP_SOURCE)
+        {
+            std::memcpy(destination, source, r.width * sizeof(Pixel));
+            continue;
+        }
+
+        if (is_premultiplied)
+        {
+            blend_premultiplied(destination, source, r.width);
+            continue;
+        }
+
+        for (auto i = 0; i < r.width; ++i)
+        {
+            auto& s = source[i];
+            auto& d = destination[i];
+
+            if (s.alpha == 255)
+            {
+                d = s;
+            }
+            else if (s.alpha != 0)
+            {
+                // Straight (non-premultiplied) alpha 'over' operator.
+                std::uint32_t destination_alpha = (d.alpha * (255 - s.alpha) + 127) / 255;
+                std::uint32_t alpha = s.alpha + destination_alpha;
+
+                d.red = (std::uint8_t)((s.red * s.alpha + d.red * destination_alpha + alpha / 2) / alpha);
+                d.green = (std::uint8_t)((s.green * s.alpha + d.green * destination_alpha + alpha / 2) / alpha);
+                d.blue = (std::uint8_t)((s.blue * s.alpha + d.blue * destination_alpha + alpha / 2) / alpha);
+                d.alpha = (std::uint8_t)alpha;
+            }
+        }
+    }
+}
+
+void devi::Compositor::save_diff()
+{
+    std::size_t offset = 0;
+    for (auto k = 0; k < changed_region.get_num_rectangles(); ++k)
+    {
+        auto& r = changed_region.get_rectangle(k);
+        for (auto j = 0; j < r.height; ++j)
+        {
+            std::memcpy(
+                &diff_pixels[offset],
+                &pixels[(r.y + j) * width + r.x],
+                r.width * sizeof(Pixel));
+
+            offset += r.width;
+        }
+    }
+}
+
+static bool devi_is_same(const devi::Pixel* a, const devi::Pixel* b, std::uint32_t count)
+{
+    return std::memcmp(a, b, count * sizeof(devi::Pixel)) == 0;
+}
+
+void devi::Compositor::tighten()
+{
+    // Saved pixels are packed in the order save_diff() saw the rectangles;
+    // find each one's offset first, since shrinking reorders the region.
+    std::size_t offsets[Region::MAX_RECTANGLES];
+    std::size_t offset = 0;
+    for (auto k = 0; k < changed_region.get_num_rectangles(); ++k)
+    {
+        offsets[k] = offset;
+        offset += (std::size_t)changed_region.get_rectangle(k).width * changed_region.get_rectangle(k).height;
+    }
+
+    for (auto k = changed_region.get_num_rectangles() - 1; k >= 0; --k)
+    {
+        auto r = changed_region.get_rectangle(k);
+        auto before = &diff_pixels[offsets[k]];
+        auto after = [&](std::uint32_t j) { return &pixels[(r.y + j) * width + r.x]; };
+
+        std::uint32_t top = 0;
+        while (top < r.height && devi_is_same(before + top * r.width, after(top), r.width))
+        {
+            ++top;
+        }
+
+        if (top == r.height)
+        {
+            changed_region.set_rectangle(k, {});
+            continue;
+        }
+
+        auto bottom = r.height;
+        while (devi_is_same(before + (bottom - 1) * r.width, after(bottom - 1), r.width))
+        {
+            --bottom;
+        }
+
+        auto left = r.width;
+        std::uint32_t right = 0;
+        for (auto j = top; j < bottom; ++j)
+        {
+            auto before_row = before + j * r.width;
+            auto after_row = after(j);
+
+            std::uint32_t i = 0;
+            while (i < left && devi_is_same(before_row + i, after_row + i, 1))
+            {
+                ++i;
+            }
+            left = i;
+
+            i = r.width;
+            while (i > right && devi_is_same(before_row + i - 1, after_row + i - 1, 1))
+            {
+                --i;
+            }
+            right = i;
+        }
+
+        changed_region.set_rectangle(k, { r.x + left, r.y + top, right - left, bottom - top });
+    }
+}
+
+bool devi::Compositor::decode()
+{
+    if (!reader->read(decoded_frame))
+    {
+        if (recording)
+        {
+            recording->finish(decoded_index);
+        }
+
+        return false;
+    }
+
+    // Recorded before compositing, which may premultiply the frame.
+    if (recording)
+    {
+        recording->add(decoded_index, decoded_frame, &decoded_frame.pixels[0]);
+    }
+
+    ++decoded_index;
+
+    composite();
+    return true;
+}
+
+void devi::Compositor::composite()
+{
+    if (decoded_frame.pixels.size() < (std::size_t)decoded_frame.width * decoded_frame.height)
+    {
+        throw std::runtime_error("frame pixel data does not match frame size");
+    }
+
+    // Frames can hang off the edge of the canvas in broken files; only the
+    // visible portion is composited.
+    Rectangle r;
+    r.x = std::min<std::uint32_t>(decoded_frame.x, width);
+    r.y = std::min<std::uint32_t>(decoded_frame.y, height);
+    r.width = std::min<std::uint32_t>(decoded_frame.width, width - r.x);
+    r.height = std::min<std::uint32_t>(decoded_frame.height, height - r.y);
+
+    // The previous frame's disposal and this frame are the only changes.
+    changed_region.clear();
+    if (dispose_op != DISPOSE_OP_NONE)
+    {
+        changed_region.add(dispose_rectangle);
+    }
+    changed_region.add(r);
+
+    if (is_diffing)
+    {
+        save_diff();
+    }
+
+    dispose();
+
+    dispose_rectangle = r;
+    if (decoded_frame.dispose_op == DISPOSE_OP_PREVIOUS)
+    {
+        save_previous();
+    }
+
+    if (is_premultiplied)
+    {
+        for (auto j = 0; j < r.height; ++j)
+        {
+            premultiply(&decoded_frame.pixels[j * decoded_frame.width], r.width);
+        }
+    }
+
+    blend();
+
+    dispose_op = decoded_frame.dispose_op;
+
+    if (is_diffing)
+    {
+        tighten();
+    }
+}
+
+bool devi::Compositor::decode_all(std::size_t num_threads)
+{
+    if (current_frame > 0 || is_threaded())
+    {
+        throw std::runtime_error("compositor must decode everything before the first frame is read");
+    }
+
+    if (!cache || !is_cache_owner || cache->is_complete())
+    {
+        return cache && cache->is_complete();
+    }
+
+    auto& thread_pool = get_thread_pool();
+    if (num_threads == 0)
+    {
+        num_threads = thread_pool.get_num_threads();
+    }
+
+    bool is_parallel = num_threads > 1 && num_frames > 1 && reader->can_decode_frames();
+
+    // Frames are decoded on the pool into a window of slots (so memory use
+    // doesn't grow with the length of the animation) and composited here,
+    // in order, as they come in.
+    struct DecodedSlot
+    {
+        Frame frame;
+        int index = -1;
+        std::exception_ptr error;
+    };
+
+    std::size_t num_slots = is_parallel ? num_threads * 2 : 1;
+    std::vector<DecodedSlot> slots(num_slots);
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    int num_pending = 0;
+    int next_frame = 0;
+
+    auto submit = [&]()
+    {
+        auto index = next_frame++;
+        auto slot = &slots[index % num_slots];
+        slot->index = -1;
+        resize_buffer(slot->frame.pixels, pixels.size());
+
+        ++num_pending;
+        thread_pool.submit([&, index, slot]()
+        {
+            std::exception_ptr error;
+            try
+            {
+                if (!reader->decode_frame(index, slot->frame, &slot->frame.pixels[0], slot->frame.pixels.size()))
+                {
+                    throw std::runtime_error("frame index out of bounds");
+                }
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            slot->error = error;
+            slot->index = index;
+            --num_pending;
+            condition.notify_all();
+        });
+    };
+
+    auto wait_for_pending = [&]()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [&] { return num_pending == 0; });
+    };
+
+    bool is_complete = true;
+    try
+    {
+        if (is_parallel)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                while (next_frame < num_frames && next_frame < (int)num_slots)
+                {
+                    submit();
+                }
+            }
+
+            for (auto i = 0; i < num_frames; ++i)
+            {
+                auto& slot = slots[i % num_slots];
+
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [&] { return slot.index == i; });
+                }
+
+                if (slot.error)
+                {
+                    std::rethrow_exception(slot.error);
+                }
+
+                if (recording)
+                {
+                    recording->add(i, slot.frame, &slot.frame.pixels[0]);
+                }
+
+                std::swap(decoded_frame, slot.frame);
+                composite();
+                std::swap(decoded_frame, slot.frame);
+
+                if (!cache->add(slot.frame.delay, changed_region, &pixels[0], pixels.size()))
+                {
+                    is_complete = false;
+                    break;
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (next_frame < num_frames)
+                {
+                    submit();
+                }
+            }
+        }
+        else
+        {
+            while (decode())
+            {
+                if (!cache->add(decoded_frame.delay, changed_region, &pixels[0], pixels.size()))
+                {
+                    is_complete = false;
+                    break;
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        wait_for_pending();
+        cache->clear();
+
+        throw;
+    }
+
+    wait_for_pending();
+
+    if (is_complete)
+    {
+        cache->finish();
+
+        if (recording && is_parallel)
+        {
+            recording->finish(num_frames);
+        }
+    }
+
+    // Either way, the canvas & reader go back to the start: on success,
+    // playback comes from the cache, otherwise frames are decoded as usual.
+    std::fill(pixels.begin(), pixels.end(), Pixel { 0, 0, 0, 0 });
+    dispose_op = DISPOSE_OP_NONE;
+    changed_region.clear();
+    reader->restart();
+    decoded_index = 0;
+
+    return cache->is_complete();
+}
+
+void devi::Compositor::rewind()
+{
+    reader->restart();
+    decoded_index = 0;
+
+    // Keep showing the last frame until the first frame of the next loop is
+    // composited, then start from a clear canvas.
+    dispose_op = DISPOSE_OP_BACKGROUND;
+    dispose_rectangle = { 0, 0, (std::uint32_t)width, (std::uint32_t)height };
+}
+
+void devi::Compositor::run()
+{
+    while (is_running.load(std::memory_order_acquire))
+    {
+        auto slot = ring->acquire_write(is_running);
+        if (!slot)
+        {
+            break;
+        }
+
+        try
+        {
+            if (decode())
+            {
+                devi_copy_frame_info(slot->frame, decoded_frame);
+                slot->region = changed_region;
+                slot->is_end = false;
+                slot->error = nullptr;
+
+                std::memcpy(&slot->pixels[0], &pixels[0], pixels.size() * sizeof(Pixel));
+            }
+            else
+            {
+                slot->is_end = true;
+                slot->error = nullptr;
+
+                rewind();
+            }
+        }
+        catch (...)
+        {
+            slot->is_end = true;
+            slot->error = std::current_exception();
+
+            ring->commit_write();
+            break;
+        }
+
+        ring->commit_write();
+    }
+}
+
+void devi::Compositor::stop()
+{
+    if (thread.joinable())
+    {
+        is_running.store(false, std::memory_order_release);
+        ring->drain();
+
+        thread.join();
+    }
+
+    current_slot = nullptr;
+}
+
+void devi::Compositor::start(std::size_t read_ahead)
+{
+    if (current_frame > 0 || thread.joinable())
+    {
+        throw std::runtime_error("compositor must be started before the first frame is read");
+    }
+
+    if (!reader->is_buffered())
+    {
+        throw std::runtime_error("only images read from memory can be decoded on a thread");
+    }
+
+    if (read_ahead < 1)
+    {
+        throw std::runtime_error("must read at least one frame ahead");
+    }
+
+    // One extra slot for the frame currently being shown.
+    ring = std::make_unique<FrameRing>(read_ahead + 1, pixels.size());
+    this->read_ahead = read_ahead;
+
+    start_thread();
+}
+
+void devi::Compositor::start_thread()
+{
+    // Anything left over from before the worker was last stopped is stale.
+    ring->drain();
+
+    is_running.store(true, std::memory_order_release);
+    thread = std::thread(&Compositor::run, this);
+}
+
+bool devi::Compositor::is_threaded() const
+{
+    return thread.joinable();
+}
+
+void devi::Compositor::finish_read(const Region& region)
+{
+    dirty_region.add(region);
+
+    if (current_frame == num_delays && num_delays < (int)delays.size())
+    {
+        delays[num_delays++] = frame.delay;
+    }
+
+    ++current_frame;
+
+    if (cache && is_cache_owner)
+    {
+        cache->add(frame.delay, region, current_pixels, width * height);
+    }
+}
+
+void devi::Compositor::finish_decode()
+{
+    devi_copy_frame_info(frame, decoded_frame);
+    current_pixels = &pixels[0];
+
+    save_keyframe();
+    finish_read(changed_region);
+}
+
+bool devi::Compositor::read_cached()
+{
+    if (current_frame >= cache->get_num_frames())
+    {
+        return false;
+    }
+
+    auto& cached_frame = cache->get_frame(current_frame);
+
+    auto bounds = cached_frame.region.get_bounds();
+    frame.x = bounds.x;
+    frame.y = bounds.y;
+    frame.width = bounds.width;
+    frame.height = bounds.height;
+    frame.delay = cached_frame.delay;
+
+    // Frames are copied out rather than shown in place, since the cache can
+    // be evicted (by another compositor's read) while a frame is shown.
+    if (cache->is_compressed())
+    {
+        cache->decode(current_frame, &pixels[0]);
+    }
+    else if (current_frame == 0 || !is_reading_cache)
+    {
+        // The canvas may not hold the previous frame when switching over
+        // from the reader (e.g., if the worker was ahead).
+        copy_cached(current_frame, { 0, 0, (std::uint32_t)width, (std::uint32_t)height });
+    }
+    else
+    {
+        for (auto k = 0; k < cached_frame.region.get_num_rectangles(); ++k)
+        {
+            copy_cached(current_frame, cached_frame.region.get_rectangle(k));
+        }
+    }
+
+    current_pixels = &pixels[0];
+    cache->touch();
+    is_reading_cache = true;
+
+    if (current_frame == num_delays && num_delays < (int)delays.size())
+    {
+        delays[num_delays++] = frame.delay;
+    }
+
+    // The first frame replaces whatever the last frame of the previous loop
+    // left behind.
+    if (current_frame == 0)
+    {
+        dirty_region.add({ 0, 0, (std::uint32_t)width, (std::uint32_t)height });
+    }
+    else
+    {
+        dirty_region.add(cached_frame.region);
+    }
+
+    ++current_frame;
+    return true;
+}
+
+void devi::Compositor::copy_cached(int index, const Rectangle& rectangle)
+{
+    auto source = &cache->get_frame(index).pixels[0];
+    for (auto j = 0u; j < rectangle.height; ++j)
+    {
+        auto offset = (std::size_t)(rectangle.y + j) * width + rectangle.x;
+        std::memcpy(&pixels[offset], source + offset, rectangle.width * sizeof(Pixel));
+    }
+}
+
+bool devi::Compositor::read_threaded()
+{
+    if (thread_error)
+    {
+        std::rethrow_exception(thread_error);
+    }
+
+    while (true)
+    {
+        if (current_slot)
+        {
+            ring->release_read();
+            current_slot = nullptr;
+        }
+
+        auto slot = ring->acquire_read();
+        if (slot->error)
+        {
+            thread_error = slot->error;
+            std::rethrow_exception(thread_error);
+        }
+
+        if (slot->is_end)
+        {
+            ring->release_read();
+
+            if (is_skipping)
+            {
+                is_skipping = false;
+                continue;
+            }
+
+            return false;
+        }
+
+        current_slot = slot;
+        if (!is_skipping)
+        {
+            break;
+        }
+    }
+
+    devi_copy_frame_info(frame, current_slot->frame);
+    current_pixels = &current_slot->pixels[0];
+    finish_read(current_slot->region);
+
+    return true;
+}
+
+int devi::Compositor::get_width() const
+{
+    return width;
+}
+
+int devi::Compositor::get_height() const
+{
+    return height;
+}
+
+int devi::Compositor::get_num_frames() const
+{
+    if (cache && cache->is_complete())
+    {
+        return cache->get_num_frames();
+    }
+
+    return num_frames;
+}
+
+int devi::Compositor::get_current_frame() const
+{
+    return current_frame;
+}
+
+void devi::Compositor::set_diff(bool value)
+{
+    if (current_frame > 0 || is_threaded())
+    {
+        throw std::runtime_error("diffing must be enabled before the first frame is read");
+    }
+
+    is_diffing = value;
+    if (is_diffing)
+    {
+        // Changed rectangles never overlap, so they fit in one canvas.
+        resize_buffer(diff_pixels, pixels.size());
+    }
+}
+
+void devi::Compositor::set_premultiplied(bool value)
+{
+    if (current_frame > 0 || is_threaded() || cache)
+    {
+        throw std::runtime_error("premultiplying must be enabled before the cache is set up and the first frame is read");
+    }
+
+    is_premultiplied = value;
+}
+
+void devi::Compositor::set_keyframe_interval(std::size_t interval)
+{
+    if (current_frame > 0 || is_threaded())
+    {
+        throw std::runtime_error("keyframes must be enabled before the first frame is read");
+    }
+
+    keyframe_interval = interval;
+    keyframes.clear();
+
+    if (interval > 0)
+    {
+        keyframes.resize(num_frames / interval);
+    }
+}
+
+void devi::Compositor::save_keyframe()
+{
+    // Only the first loop is kept; later loops composite the same canvas.
+    if (keyframe_interval == 0 || (current_frame + 1) % keyframe_interval != 0)
+    {
+        return;
+    }
+
+    auto index = (current_frame + 1) / keyframe_interval - 1;
+    if (index >= keyframes.size() || keyframes[index].is_set)
+    {
+        return;
+    }
+
+    auto& keyframe = keyframes[index];
+    keyframe.pixels = pixels;
+    count_allocation(pixels.size() * sizeof(Pixel));
+
+    keyframe.dispose_op = dispose_op;
+    keyframe.dispose_rectangle = dispose_rectangle;
+
+    if (dispose_op == DISPOSE_OP_PREVIOUS)
+    {
+        auto num_pixels = (std::size_t)dispose_rectangle.width * dispose_rectangle.height;
+        resize_buffer(keyframe.previous_pixels, num_pixels);
+        std::memcpy(&keyframe.previous_pixels[0], &previous_pixels[0], num_pixels * sizeof(Pixel));
+    }
+
+    keyframe.is_set = true;
+}
+
+void devi::Compositor::restore_keyframe(int index)
+{
+    auto& keyframe = keyframes[index];
+    auto next_frame = (index + 1) * (int)keyframe_interval;
+
+    if (!reader->seek(next_frame))
+    {
+        throw std::runtime_error("couldn't seek to keyframe");
+    }
+
+    decoded_index = next_frame;
+
+    std::memcpy(&pixels[0], &keyframe.pixels[0], pixels.size() * sizeof(Pixel));
+
+    dispose_op = keyframe.dispose_op;
+    dispose_rectangle = keyframe.dispose_rectangle;
+
+    if (dispose_op == DISPOSE_OP_PREVIOUS)
+    {
+        std::memcpy(&previous_pixels[0], &keyframe.previous_pixels[0], keyframe.previous_pixels.size() * sizeof(Pixel));
+    }
+
+    current_frame = next_frame;
+    current_pixels = &pixels[0];
+    is_finished = false;
+
+    dirty_region.add({ 0, 0, (std::uint32_t)width, (std::uint32_t)height });
+}
+
+void devi::Compositor::record(bool is_compressed)
+{
+    if (current_frame > 0 || is_threaded() || !reader)
+    {
+        throw std::runtime_error("recording must be started before the first frame is read");
+    }
+
+    recording = std::make_unique<PrecompiledWriter>(width, height, is_compressed);
+}
+
+devi::PrecompiledWriter* devi::Compositor::get_recording() const
+{
+    if (!recording || !recording->is_complete())
+    {
+        return nullptr;
+    }
+
+    return recording.get();
+}
+
+void devi::Compositor::set_cache_limit(std::size_t limit, bool is_compressed)
+{
+    if (current_frame > 0)
+    {
+        throw std::runtime_error("cache limit must be set before the first frame is read");
+    }
+
+    cache = std::make_shared<FrameCache>(limit, width, height, is_compressed);
+    is_cache_owner = cache->claim();
+}
+
+void devi::Compositor::share_cache(const std::string& key, std::size_t limit, bool is_compressed)
+{
+    if (current_frame > 0)
+    {
+        throw std::runtime_error("cache must be shared before the first frame is read");
+    }
+
+    cache = get_shared_cache(key, limit, width, height, is_compressed);
+    is_cache_owner = cache->claim();
+}
+
+const devi::FrameCache* devi::Compositor::get_cache() const
+{
+    return cache.get();
+}
+
+const devi::Frame& devi::Compositor::get_frame() const
+{
+    return frame;
+}
+
+const devi::Pixel* devi::Compositor::get_pixels() const
+{
+    return current_pixels;
+}
+
+void devi::Compositor::copy_pixels(Pixel* destination, const Rectangle& rectangle) const
+{
+    if (!current_pixels)
+    {
+        throw std::runtime_error("no frame has been read yet");
+    }
+
+    // In 64 bits, so huge rectangles (e.g., negative numbers from Lua) can't
+    // wrap around into bounds.
+    if ((std::uint64_t)rectangle.x + rectangle.width > (std::uint64_t)width || (std::uint64_t)rectangle.y + rectangle.height > (std::uint64_t)height)
+    {
+        throw std::runtime_error("rectangle out of bounds");
+    }
+
+    for (auto j = 0u; j < rectangle.height; ++j)
+    {
+        std::memcpy(
+            destination + (std::size_t)j * rectangle.width,
+            &current_pixels[(std::size_t)(rectangle.y + j) * width + rectangle.x],
+            rectangle.width * sizeof(Pixel));
+    }
+}
+
+const devi::Region& devi::Compositor::get_dirty_region() const
+{
+    return dirty_region;
+}
+
+void devi::Compositor::clear_dirty_region()
+{
+    dirty_region.clear();
+}
+
+void devi::Compositor::evict()
+{
+    auto was_reading_cache = is_reading_cache;
+
+    cache.reset();
+    is_cache_owner = false;
+    is_reading_cache = false;
+
+    if (!was_reading_cache)
+    {
+        return;
+    }
+
+    // The canvas still shows the frame last read from the cache; carry on
+    // from the next one by compositing up to it again from the reader.
+    auto position = current_frame;
+    auto region = dirty_region;
+
+    current_frame = 0;
+    is_finished = false;
+    is_skipping = false;
+
+    if (position == 0 || position >= num_frames)
+    {
+        // Between loops, the next frame starts a new one anyway.
+        rewind();
+        return;
+    }
+
+    std::fill(pixels.begin(), pixels.end(), Pixel { 0, 0, 0, 0 });
+    dispose_op = DISPOSE_OP_NONE;
+    reader->restart();
+    decoded_index = 0;
+
+    seek(position);
+
+    // Nothing changed on screen.
+    dirty_region = region;
+}
+
+bool devi::Compositor::read()
+{
+    enforce_cache_budget();
+
+    if (cache && cache->is_evicted())
+    {
+        evict();
+    }
+
+    // The worker was stopped to play back from the cache.
+    if (!cache && read_ahead > 0 && !is_threaded())
+    {
+        start_thread();
+    }
+
+    if (cache && cache->is_complete() && (is_reading_cache || current_frame == 0 || !cache->is_compressed()))
+    {
+        // A shared cache can be completed by another compositor while this
+        // one is still decoding; the worker isn't needed any more.
+        stop();
+
+        return read_cached();
+    }
+
+    if (is_finished)
+    {
+        return false;
+    }
+
+    if (is_threaded())
+    {
+        if (!read_threaded())
+        {
+            is_finished = true;
+            return false;
+        }
+
+        return true;
+    }
+
+    if (!decode())
+    {
+        is_finished = true;
+        return false;
+    }
+
+    finish_decode();
+
+    return true;
+}
+
+bool devi::Compositor::seek_cached(int target)
+{
+    if (target >= cache->get_num_frames())
+    {
+        return false;
+    }
+
+    Rectangle canvas = { 0, 0, (std::uint32_t)width, (std::uint32_t)height };
+
+    // Whole frames are cached, so the canvas only needs the frame before
+    // the target for read() to carry on from.
+    if (!cache->is_compressed() && target != current_frame)
+    {
+        if (target > 0)
+        {
+            copy_cached(target - 1, canvas);
+            current_pixels = &pixels[0];
+        }
+
+        current_frame = target;
+        is_reading_cache = true;
+        dirty_region.add(canvas);
+
+        return true;
+    }
+
+    if (target < current_frame)
+    {
+        current_frame = 0;
+    }
+
+    // The frames in between are never shown, but what they changed is.
+    while (current_frame < target)
+    {
+        auto& cached_frame = cache->get_frame(current_frame);
+
+        if (cache->is_compressed())
+        {
+            cache->decode(current_frame, &pixels[0]);
+            current_pixels = &pixels[0];
+        }
+
+        if (current_frame == 0)
+        {
+            dirty_region.add(canvas);
+        }
+        else
+        {
+            dirty_region.add(cached_frame.region);
+        }
+
+        ++current_frame;
+    }
+
+    is_reading_cache = true;
+
+    return true;
+}
+
+bool devi::Compositor::seek(int index)
+{
+    if (index < 0 || index >= num_frames || is_threaded())
+    {
+        return false;
+    }
+
+    if (cache && cache->is_evicted())
+    {
+        evict();
+    }
+
+    if (cache && cache->is_complete() && (is_reading_cache || current_frame == 0 || !cache->is_compressed()))
+    {
+        return seek_cached(index);
+    }
+
+    if (!reader)
+    {
+        return false;
+    }
+
+    // A cache being filled needs every frame of the loop, in order.
+    bool is_filling = cache && is_cache_owner && !cache->is_complete();
+
+    if (is_finished || index < current_frame)
+    {
+        // Restarting mid-loop would throw away everything cached so far, so
+        // the rest of the loop is read first and the cache completed.
+        while (is_filling && !is_finished && current_frame < num_frames)
+        {
+            if (!decode())
+            {
+                is_finished = true;
+                break;
+            }
+
+            finish_decode();
+        }
+
+        restart();
+
+        if (is_filling && cache->is_complete())
+        {
+            return seek_cached(index);
+        }
+    }
+
+    if (!is_filling && keyframe_interval > 0)
+    {
+        auto keyframe = (int)(index / keyframe_interval) - 1;
+        while (keyframe >= 0 && !keyframes[keyframe].is_set)
+        {
+            --keyframe;
+        }
+
+        if (keyframe >= 0 && (keyframe + 1) * (int)keyframe_interval > current_frame)
+        {
+            restore_keyframe(keyframe);
+        }
+    }
+
+    while (current_frame < index)
+    {
+        if (!decode())
+        {
+            is_finished = true;
+            return false;
+        }
+
+        finish_decode();
+    }
+
+    return true;
+}
+
+bool devi::Compositor::build_schedule(float min_delay)
+{
+    if (num_frames == 0 || num_delays < num_frames)
+    {
+        return false;
+    }
+
+    if (min_delay != schedule_min_delay)
+    {
+        resize_buffer(schedule, num_frames + 1);
+
+        double time = 0.0;
+        for (auto i = 0; i < num_frames; ++i)
+        {
+            schedule[i] = time;
+            time += std::max(delays[i], min_delay);
+        }
+
+        schedule[num_frames] = time;
+        schedule_min_delay = min_delay;
+    }
+
+    return schedule[num_frames] > 0.0;
+}
+
+bool devi::Compositor::read_to(int target)
+{
+    if (is_finished || current_frame > target)
+    {
+        while (read())
+        {
+        }
+
+        restart();
+    }
+
+    while (current_frame < target)
+    {
+        if (!read())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool devi::Compositor::skip(double overdue, float min_delay, double& remaining)
+{
+    if (!build_schedule(min_delay))
+    {
+        return false;
+    }
+
+    // However long the stall, only the time into the current loop matters.
+    auto next_frame = current_frame < num_frames && !is_finished ? current_frame : 0;
+    auto position = std::fmod(schedule[next_frame] + std::max(overdue, 0.0), schedule[num_frames]);
+
+    auto iter = std::upper_bound(schedule.begin(), schedule.begin() + num_frames, position);
+    auto target = std::max((int)(iter - schedule.begin()) - 1, 0);
+
+    // Threaded, the worker already composites every frame in order, so
+    // they're read up to the target instead.
+    auto is_at_target = is_threaded() ? read_to(target) : seek(target);
+    if (!is_at_target || !read())
+    {
+        return false;
+    }
+
+    remaining = schedule[target + 1] - position;
+
+    return true;
+}
+
+void devi::Compositor::restart()
+{
+    auto is_loop_done = is_finished || (num_frames > 0 && current_frame == num_frames);
+
+    // Playback usually restarts right after the last frame, before the
+    // reader gets to say there are no more. Threaded, the worker reads on
+    // to the end by itself.
+    if (recording && is_loop_done && !is_reading_cache && !is_threaded())
+    {
+        recording->finish(decoded_index);
+    }
+
+    if (cache && is_cache_owner && !cache->is_complete())
+    {
+        // Only a full loop can be played back from the cache.
+        if (is_loop_done)
+        {
+            cache->finish();
+        }
+        else
+        {
+            cache->clear();
+        }
+    }
+
+    auto is_mid_loop = !is_finished;
+
+    current_frame = 0;
+    is_finished = false;
+
+    if (cache && cache->is_complete())
+    {
+        // The worker has nothing left to do. The cached frames are copies, so
+        // the slot being shown can go away.
+        stop();
+        return;
+    }
+
+    if (is_threaded())
+    {
+        // The worker rewinds by itself when it reaches the end of a loop.
+        is_skipping = is_mid_loop;
+        return;
+    }
+
+    rewind();
+}
+
+struct LuaCompositor
+{
+    devi::Compositor* compositor;
+    int reader_reference;
+};
+
+devi::Compositor* devi::to_compositor(lua_State* L, int index)
+{
+    return ((LuaCompositor*)luaL_checkudata(L, index, "devi.Compositor"))->compositor;
+}
+
+static int devi_compositor_get_width(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+    lua_pushinteger(L, compositor->get_width());
+
+    return 1;
+}
+
+static int devi_compositor_get_height(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+    lua_pushinteger(L, compositor->get_height());
+
+    return 1;
+}
+
+static int devi_compositor_get_num_frames(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+    lua_pushinteger(L, compositor->get_num_frames());
+
+    return 1;
+}
+
+static int devi_compositor_get_current_frame(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+    lua_pushinteger(L, compositor->get_current_frame());
+
+    return 1;
+}
+
+static int devi_compositor_is_cached(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+
+    auto cache = compositor->get_cache();
+    lua_pushboolean(L, cache && cache->is_complete());
+
+    return 1;
+}
+
+static int devi_compositor_read(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+
+    if (compositor->read())
+    {
+        auto& frame = compositor->get_frame();
+
+        // Reuse the caller's table (if any) so nothing is allocated per frame.
+        if (lua_istable(L, 2))
+        {
+            lua_pushvalue(L, 2);
+        }
+        else
+        {
+            lua_newtable(L);
+        }
+
+        lua_pushinteger(L, frame.x);
+        lua_setfield(L, -2, "x");
+
+        lua_pushinteger(L, frame.y);
+        lua_setfield(L, -2, "y");
+
+        lua_pushinteger(L, frame.width);
+        lua_setfield(L, -2, "width");
+
+        lua_pushinteger(L, frame.height);
+        lua_setfield(L, -2, "height");
+
+        lua_pushnumber(L, frame.delay);
+        lua_setfield(L, -2, "delay");
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// skip(overdue, minDelay): returns how long the frame it lands on has left,
+// or nothing if frames have to be read one by one.
+static int devi_compositor_skip(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+    auto overdue = luaL_checknumber(L, 2);
+    auto min_delay = luaL_checknumber(L, 3);
+
+    double remaining;
+    if (!compositor->skip(overdue, (float)min_delay, remaining))
+    {
+        return 0;
+    }
+
+    lua_pushnumber(L, remaining);
+
+    return 1;
+}
+
+static int devi_compositor_get_pixels(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+
+    auto num_pixels = compositor->get_width() * compositor->get_height();
+    lua_pushlstring(L, (const char*)compositor->get_pixels(), num_pixels * sizeof(devi::Pixel));
+
+    return 1;
+}
+
+static int devi_compositor_copy_pixels(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+    auto destination = (devi::Pixel*)lua_touserdata(L, 2);
+
+    devi::Rectangle rectangle;
+    rectangle.x = luaL_checkinteger(L, 3);
+    rectangle.y = luaL_checkinteger(L, 4);
+    rectangle.width = luaL_checkinteger(L, 5);
+    rectangle.height = luaL_checkinteger(L, 6);
+
+    compositor->copy_pixels(destination, rectangle);
+
+    return 0;
+}
+
+static int devi_compositor_get_dirty_rectangle(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+
+    auto rectangle = compositor->get_dirty_region().get_bounds();
+    lua_pushinteger(L, rectangle.x);
+    lua_pushinteger(L, rectangle.y);
+    lua_pushinteger(L, rectangle.width);
+    lua_pushinteger(L, rectangle.height);
+
+    return 4;
+}
+
+// Fills the table with x, y, width, height of every dirty rectangle in turn
+// and returns how many there are.
+static int devi_compositor_get_dirty_rectangles(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    auto& region = compositor->get_dirty_region();
+    for (auto i = 0; i < region.get_num_rectangles(); ++i)
+    {
+        auto& rectangle = region.get_rectangle(i);
+
+        lua_pushinteger(L, rectangle.x);
+        lua_rawseti(L, 2, i * 4 + 1);
+
+        lua_pushinteger(L, rectangle.y);
+        lua_rawseti(L, 2, i * 4 + 2);
+
+        lua_pushinteger(L, rectangle.width);
+        lua_rawseti(L, 2, i * 4 + 3);
+
+        lua_pushinteger(L, rectangle.height);
+        lua_rawseti(L, 2, i * 4 + 4);
+    }
+
+    lua_pushinteger(L, region.get_num_rectangles());
+
+    return 1;
+}
+
+static int devi_compositor_clear_dirty_rectangle(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+    compositor->clear_dirty_region();
+
+    return 0;
+}
+
+static int devi_compositor_restart(lua_State* L)
+{
+    auto compositor = ((LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor"))->compositor;
+    compositor->restart();
+
+    return 0;
+}
+
+static int devi_compositor_gc(lua_State* L)
+{
+    auto lua_compositor = (LuaCompositor*)luaL_checkudata(L, 1, "devi.Compositor");
+
+    delete lua_compositor->compositor;
+    lua_compositor->compositor = nullptr;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, lua_compositor->reader_reference);
+    lua_compositor->reader_reference = LUA_NOREF;
+
+    return 0;
+}
+
+static luaL_Reg DEVI_COMPOSITOR_METHODS[] = {
+    { "getWidth", &devi_compositor_get_width },
+    { "getHeight", &devi_compositor_get_height },
+    { "getNumFrames", &devi_compositor_get_num_frames },
+    { "getCurrentFrame", &devi_compositor_get_current_frame },
+    { "isCached", &devi_compositor_is_cached },
+    { "read", &devi_compositor_read },
+    { "skip", &devi_compositor_skip },
+    { "getPixels", &devi_compositor_get_pixels },
+    { "copyPixels", &devi_compositor_copy_pixels },
+    { "getDirtyRectangle", &devi_compositor_get_dirty_rectangle },
+    { "getDirtyRectangles", &devi_compositor_get_dirty_rectangles },
+    { "clearDirtyRectangle", &devi_compositor_clear_dirty_rectangle },
+    { "restart", &devi_compositor_restart },
+    { nullptr, nullptr }
+};
+
+static bool devi_compositor_get_option(lua_State* L, int index, const char* name, lua_Integer& value)
+{
+    lua_getfield(L, index, name);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        return false;
+    }
+
+    if (!lua_isnumber(L, -1))
+    {
+        lua_pop(L, 1);
+        luaL_error(L, "expected number for option '%s'", name);
+        return false;
+    }
+
+    value = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    if (value < 0)
+    {
+        luaL_error(L, "option '%s' cannot be negative", name);
+        return false;
+    }
+
+    return true;
+}
+
+void devi::get_compositor_options(lua_State* L, int index, CompositorOptions& options)
+{
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    lua_getfield(L, index, "key");
+    if (lua_type(L, -1) == LUA_TSTRING)
+    {
+        options.key = lua_tostring(L, -1);
+        options.has_key = true;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "diff");
+    options.is_diffing = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "premultiplied");
+    options.is_premultiplied = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "compress");
+    options.is_compressed = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_Integer value;
+    if (devi_compositor_get_option(L, index, "cacheLimit", value))
+    {
+        options.cache_limit = (std::size_t)value;
+        options.has_cache_limit = true;
+    }
+
+    if (devi_compositor_get_option(L, index, "decodeAll", value))
+    {
+        options.decode_threads = (std::size_t)value;
+        options.has_decode_threads = true;
+    }
+
+    if (devi_compositor_get_option(L, index, "readAhead", value))
+    {
+        if (value < 1)
+        {
+            luaL_error(L, "option 'readAhead' must be at least 1");
+        }
+
+        options.read_ahead = (std::size_t)value;
+        options.has_read_ahead = true;
+    }
+
+    if (devi_compositor_get_option(L, index, "keyframes", value))
+    {
+        options.keyframe_interval = (std::size_t)value;
+        options.has_keyframe_interval = true;
+    }
+
+    lua_getfield(L, index, "record");
+    options.is_recording = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "recordCompress");
+    options.is_recording_compressed = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+}
+
+void devi::Compositor::configure(const CompositorOptions& options)
+{
+    if (options.is_diffing)
+    {
+        set_diff(true);
+    }
+
+    if (options.is_premultiplied)
+    {
+        set_premultiplied(true);
+    }
+
+    if (options.has_keyframe_interval)
+    {
+        set_keyframe_interval(options.keyframe_interval);
+    }
+
+    if (options.is_recording)
+    {
+        record(options.is_recording_compressed);
+    }
+
+    if (options.has_key)
+    {
+        share_cache(
+            options.key,
+            options.has_cache_limit ? options.cache_limit : std::numeric_limits<std::size_t>::max(),
+            options.is_compressed);
+    }
+    else if (options.has_cache_limit)
+    {
+        set_cache_limit(options.cache_limit, options.is_compressed);
+    }
+
+    // Everything decoded up front is played back from the cache, so
+    // there's no need for a worker thread afterwards.
+    bool is_decoded = false;
+    if (options.has_decode_threads)
+    {
+        is_decoded = decode_all(options.decode_threads);
+    }
+
+    if (!is_decoded && options.has_read_ahead)
+    {
+        start(options.read_ahead);
+    }
+}
+
+void devi::push_compositor(lua_State* L, Compositor* compositor, int reader_index)
+{
+    auto lua_compositor = (LuaCompositor*)lua_newuserdata(L, sizeof(LuaCompositor));
+    lua_compositor->compositor = nullptr;
+    lua_compositor->reader_reference = LUA_NOREF;
+
+    if (luaL_newmetatable(L, "devi.Compositor"))
+    {
+        devi::luax_register(L, DEVI_COMPOSITOR_METHODS);
+        lua_setfield(L, -2, "__index");
+
+        devi::luax_pushcfunction(L, &devi_compositor_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+
+    lua_setmetatable(L, -2);
+
+    lua_compositor->compositor = compositor;
+
+    // The reader must outlive the compositor.
+    if (reader_index != 0)
+    {
+        lua_pushvalue(L, reader_index);
+        lua_compositor->reader_reference = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
+static int devi_compositor_new(lua_State* L)
+{
+    devi::ImageReader* image_reader = nullptr;
+    if (!lua_isnil(L, 1))
+    {
+        image_reader = *((devi::ImageReader**)luaL_checkudata(L, 1, "devi.ImageReader"));
+    }
+
+    devi::CompositorOptions options;
+    if (!lua_isnoneornil(L, 2))
+    {
+        devi::get_compositor_options(L, 2, options);
+    }
+
+    if (!image_reader)
+    {
+        if (!options.has_key)
+        {
+            return luaL_error(L, "expected reader or key of a shared cache");
+        }
+
+        // Without a reader, only a complete shared cache can be played back.
+        auto shared_cache = devi::find_shared_cache(options.key);
+        if (!shared_cache || !shared_cache->is_complete())
+        {
+            return 0;
+        }
+
+        devi::push_compositor(L, new devi::Compositor(shared_cache), 0);
+        return 1;
+    }
+
+    auto compositor = new devi::Compositor(image_reader);
+    devi::push_compositor(L, compositor, 1);
+
+    compositor->configure(options);
+
+    return 1;
+}
+
+extern "C"
+DEVI_EXPORT int luaopen_devi_Compositor(lua_State* L)
+{
+    devi::luax_pushcfunction(L, &devi_compositor_new);
+
+    return 1;
+}
@@ -0,0 +1,438 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include "devi/frame_cache.hpp"
+#include "devi/memory.hpp"
+
+// Compressed frames are runs of 32-bit words: an op and a count of pixels,
+// followed by the pixels of a literal or the single pixel of a run.
+static const std::uint32_t DEVI_FRAME_CACHE_SKIP = 0u << 30;
+static const std::uint32_t DEVI_FRAME_CACHE_LITERAL = 1u << 30;
+static const std::uint32_t DEVI_FRAME_CACHE_RUN = 2u << 30;
+static const std::uint32_t DEVI_FRAME_CACHE_COUNT = (1u << 30) - 1;
+
+// Shorter runs are cheaper as literals.
+static const std::uint32_t DEVI_FRAME_CACHE_MIN_RUN = 3;
+
+static std::mutex devi_frame_cache_mutex;
+static std::vector<devi::FrameCache*> devi_frame_caches;
+
+static std::atomic<std::size_t> devi_frame_cache_budget = std::numeric_limits<std::size_t>::max();
+static std::atomic<std::size_t> devi_frame_cache_usage = 0;
+static std::atomic<std::uint64_t> devi_frame_cache_clock = 0;
+
+devi::FrameCache::FrameCache(std::size_t limit, int width, int height, bool is_compressed) :
+    limit(limit),
+    width(width),
+    height(height),
+    compressed(is_compressed)
+{
+    std::lock_guard<std::mutex> lock(devi_frame_cache_mutex);
+    devi_frame_caches.push_back(this);
+}
+
+devi::FrameCache::~FrameCache()
+{
+    std::lock_guard<std::mutex> lock(devi_frame_cache_mutex);
+
+    devi_frame_caches.erase(std::find(devi_frame_caches.begin(), devi_frame_caches.end(), this));
+    devi_frame_cache_usage.fetch_sub(size, std::memory_order_relaxed);
+}
+
+std::size_t devi::FrameCache::get_limit() const
+{
+    return limit;
+}
+
+std::size_t devi::FrameCache::get_size() const
+{
+    return size;
+}
+
+int devi::FrameCache::get_width() const
+{
+    return width;
+}
+
+int devi::FrameCache::get_height() const
+{
+    return height;
+}
+
+bool devi::FrameCache::claim()
+{
+    if (complete || overflowed)
+    {
+        return false;
+    }
+
+    return !claimed.exchange(true);
+}
+
+void devi::FrameCache::release()
+{
+    claimed = false;
+}
+
+bool devi::FrameCache::is_complete() const
+{
+    return complete;
+}
+
+bool devi::FrameCache::is_overflowed() const
+{
+    return overflowed;
+}
+
+bool devi::FrameCache::is_evicted() const
+{
+    return evicted;
+}
+
+bool devi::FrameCache::is_compressed() const
+{
+    return compressed;
+}
+
+void devi::FrameCache::pin()
+{
+    ++num_pinned;
+}
+
+void devi::FrameCache::unpin()
+{
+    --num_pinned;
+}
+
+void devi::FrameCache::touch()
+{
+    last_used.store(++devi_frame_cache_clock, std::memory_order_relaxed);
+}
+
+void devi::FrameCache::set_size(std::size_t value)
+{
+    if (value > size)
+    {
+        devi_frame_cache_usage.fetch_add(value - size, std::memory_order_relaxed);
+    }
+    else
+    {
+        devi_frame_cache_usage.fetch_sub(size - value, std::memory_order_relaxed);
+    }
+
+    size = value;
+}
+
+void devi::FrameCache::update_scratch_size()
+{
+    auto value = reference.capacity() * sizeof(Pixel) + encoded.capacity() * sizeof(std::uint32_t);
+
+    set_size(size - scratch_size + value);
+    scratch_size = value;
+}
+
+int devi::FrameCache::get_num_frames() const
+{
+    return (int)frames.size();
+}
+
+const devi::CachedFrame& devi::FrameCache::get_frame(int index) const
+{
+    if (index < 0 || index >= (int)frames.size())
+    {
+        throw std::out_of_range("cached frame index out of bounds");
+    }
+
+    return frames[index];
+}
+
+bool devi::FrameCache::add(float delay, const Region& region, const Pixel* pixels, std::size_t num_pixels)
+{
+    if (overflowed || complete)
+    {
+        return false;
+    }
+
+    if (num_pixels != (std::size_t)width * height)
+    {
+        throw std::runtime_error("cached frame does not match cache size");
+    }
+
+    std::size_t frame_size;
+    if (compressed)
+    {
+        encode(region, pixels);
+        update_scratch_size();
+
+        frame_size = encoded.size() * sizeof(std::uint32_t);
+    }
+    else
+    {
+        frame_size = num_pixels * sizeof(Pixel);
+    }
+
+    if (size + frame_size > limit)
+    {
+        clear();
+        overflowed = true;
+
+        return false;
+    }
+
+    auto& frame = frames.emplace_back();
+    frame.delay = delay;
+    frame.region = region;
+
+    if (compressed)
+    {
+        frame.data.assign(encoded.begin(), encoded.end());
+    }
+    else
+    {
+        frame.pixels.assign(pixels, pixels + num_pixels);
+    }
+
+    count_allocation(frame_size);
+    set_size(size + frame_size);
+
+    return true;
+}
+
+static std::uint32_t devi_frame_cache_word(const devi::Pixel& pixel)
+{
+    std::uint32_t word;
+    std::memcpy(&word, &pixel, sizeof(word));
+
+    return word;
+}
+
+static void devi_frame_cache_encode_row(const devi::Pixel* row, const devi::Pixel* previous, std::uint32_t width, std::vector<std::uint32_t>& output)
+{
+    std::uint32_t i = 0;
+    while (i < width)
+    {
+        auto start = i;
+
+        while (i < width && devi_frame_cache_word(row[i]) == devi_frame_cache_word(previous[i]))
+        {
+            ++i;
+        }
+
+        if (i > start)
+        {
+            output.push_back(DEVI_FRAME_CACHE_SKIP | (i - start));
+            continue;
+        }
+
+        auto pixel = devi_frame_cache_word(row[start]);
+        while (i < width && devi_frame_cache_word(row[i]) == pixel)
+        {
+            ++i;
+        }
+
+        if (i - start >= DEVI_FRAME_CACHE_MIN_RUN)
+        {
+            output.push_back(DEVI_FRAME_CACHE_RUN | (i - start));
+            output.push_back(pixel);
+            continue;
+        }
+
+        // Up to the next unchanged pixel or run.
+        i = start;
+        while (i < width && devi_frame_cache_word(row[i]) != devi_frame_cache_word(previous[i]))
+        {
+            if (i + DEVI_FRAME_CACHE_MIN_RUN <= width &&
+                devi_frame_cache_word(row[i]) == devi_frame_cache_word(row[i + 1]) &&
+                devi_frame_cache_word(row[i]) == devi_frame_cache_word(row[i + 2]))
+            {
+                break;
+            }
+
+            ++i;
+        }
+
+        // The first pixel neither starts a run nor is unchanged, so this
+        // always takes at least one.
+        i = std::max(i, start + 1);
+
+        output.push_back(DEVI_FRAME_CACHE_LITERAL | (i - start));
+        for (auto k = start; k < i; ++k)
+        {
+            output.push_back(devi_frame_cache_word(row[k]));
+        }
+    }
+}
+
+void devi::FrameCache::encode(const Region& region, const Pixel* pixels)
+{
+    if ((std::uint32_t)width > DEVI_FRAME_CACHE_COUNT)
+    {
+        throw std::runtime_error("image too wide to compress");
+    }
+
+    // The first frame is encoded in full, against a clear canvas, so a loop
+    // can start over whatever the last frame left behind.
+    Region encoded_region;
+    if (frames.empty())
+    {
+        resize_buffer(reference, (std::size_t)width * height);
+        std::fill(reference.begin(), reference.end(), Pixel { 0, 0, 0, 0 });
+
+        encoded_region.add({ 0, 0, (std::uint32_t)width, (std::uint32_t)height });
+    }
+    else
+    {
+        encoded_region = region;
+    }
+
+    encoded.clear();
+    for (auto k = 0; k < encoded_region.get_num_rectangles(); ++k)
+    {
+        auto& r = encoded_region.get_rectangle(k);
+        for (auto j = 0u; j < r.height; ++j)
+        {
+            auto offset = (std::size_t)(r.y + j) * width + r.x;
+
+            devi_frame_cache_encode_row(pixels + offset, &reference[offset], r.width, encoded);
+            std::memcpy(&reference[offset], pixels + offset, r.width * sizeof(Pixel));
+        }
+    }
+}
+
+void devi::FrameCache::decode(int index, Pixel* canvas) const
+{
+    auto& frame = get_frame(index);
+
+    Region decoded_region;
+    if (index == 0)
+    {
+        std::fill(canvas, canvas + (std::size_t)width * height, Pixel { 0, 0, 0, 0 });
+        decoded_region.add({ 0, 0, (std::uint32_t)width, (std::uint32_t)height });
+    }
+    else
+    {
+        decoded_region = frame.region;
+    }
+
+    auto data = frame.data.data();
+    for (auto k = 0; k < decoded_region.get_num_rectangles(); ++k)
+    {
+        auto& r = decoded_region.get_rectangle(k);
+        for (auto j = 0u; j < r.height; ++j)
+        {
+            auto row = canvas + (std::size_t)(r.y + j) * width + r.x;
+
+            std::uint32_t i = 0;
+            while (i < r.width)
+            {
+                auto word = *data++;
+                auto count = word & DEVI_FRAME_CACHE_COUNT;
+
+                switch (word & ~DEVI_FRAME_CACHE_COUNT)
+                {
+                    case DEVI_FRAME_CACHE_LITERAL:
+                        std::memcpy(row + i, data, count * sizeof(Pixel));
+                        data += count;
+                        break;
+
+                    case DEVI_FRAME_CACHE_RUN:
+                    {
+                        Pixel pixel;
+                        std::memcpy(&pixel, data++, sizeof(pixel));
+                        std::fill(row + i, row + i + count, pixel);
+                        break;
+                    }
+
+                    case DEVI_FRAME_CACHE_SKIP:
+                    default:
+                        break;
+                }
+
+                i += count;
+            }
+        }
+    }
+}
+
+void devi::FrameCache::finish()
+{
+    if (!overflowed && !frames.empty())
+    {
+        complete = true;
+    }
+
+    // Only needed while filling.
+    reference = std::vector<Pixel>();
+    encoded = std::vector<std::uint32_t>();
+    update_scratch_size();
+}
+
+void devi::FrameCache::clear()
+{
+    frames.clear();
+    frames.shrink_to_fit();
+
+    reference = std::vector<Pixel>();
+    encoded = std::vector<std::uint32_t>();
+
+    set_size(0);
+    scratch_size = 0;
+    complete = false;
+}
+
+void devi::set_cache_budget(std::size_t budget)
+{
+    devi_frame_cache_budget.store(budget, std::memory_order_relaxed);
+}
+
+std::size_t devi::get_cache_budget()
+{
+    return devi_frame_cache_budget.load(std::memory_order_relaxed);
+}
+
+std::size_t devi::get_cache_usage()
+{
+    return devi_frame_cache_usage.load(std::memory_order_relaxed);
+}
+
+void devi::enforce_cache_budget()
+{
+    auto budget = get_cache_budget();
+    if (get_cache_usage() <= budget)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(devi_frame_cache_mutex);
+
+    // Caches still being filled may be in use on another thread; they count
+    // towards the budget, but only complete ones are evicted.
+    std::vector<FrameCache*> candidates;
+    for (auto cache: devi_frame_caches)
+    {
+        if (cache->complete && !cache->evicted && cache->num_pinned == 0)
+        {
+            candidates.push_back(cache);
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](auto a, auto b)
+    {
+        return a->last_used.load(std::memory_order_relaxed) < b->last_used.load(std::memory_order_relaxed);
+    });
+
+    for (auto cache: candidates)
+    {
+        if (get_cache_usage() <= budget)
+        {
+            break;
+        }
+
+        // Never filled again; its compositors decode from then on.
+        cache->evicted = true;
+        cache->overflowed = true;
+        cache->clear();
+    }
+}
@@ -0,0 +1,72 @@
+#include <stdexcept>
+#include "devi/frame_ring.hpp"
+#include "devi/memory.hpp"
+
+devi::FrameRing::FrameRing(std::size_t capacity, std::size_t num_pixels)
+{
+    if (capacity < 2)
+    {
+        throw std::runtime_error("frame ring needs room for at least two frames");
+    }
+
+    slots.resize(capacity);
+    for (auto& slot: slots)
+    {
+        resize_buffer(slot.pixels, num_pixels);
+    }
+}
+
+devi::FrameSlot* devi::FrameRing::acquire_write(const std::atomic<bool>& is_running)
+{
+    auto current_head = head.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+        auto current_tail = tail.load(std::memory_order_acquire);
+        if (current_head - current_tail < slots.size())
+        {
+            return &slots[current_head % slots.size()];
+        }
+
+        if (!is_running.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+
+        tail.wait(current_tail, std::memory_order_acquire);
+    }
+}
+
+void devi::FrameRing::commit_write()
+{
+    head.fetch_add(1, std::memory_order_release);
+    head.notify_one();
+}
+
+devi::FrameSlot* devi::FrameRing::acquire_read()
+{
+    auto current_tail = tail.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+        auto current_head = head.load(std::memory_order_acquire);
+        if (current_head != current_tail)
+        {
+            return &slots[current_tail % slots.size()];
+        }
+
+        head.wait(current_head, std::memory_order_acquire);
+    }
+}
+
+void devi::FrameRing::release_read()
+{
+    tail.fetch_add(1, std::memory_order_release);
+    tail.notify_one();
+}
+
+void devi::FrameRing::drain()
+{
+    tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+    tail.notify_one();
+}
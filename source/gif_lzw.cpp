@@ -0,0 +1,224 @@
+#include <bit>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include "devi/gif_lzw.hpp"
+
+static const int DEVI_GIF_LZW_MAX_CODES = 4096;
+static const int DEVI_GIF_LZW_MAX_CODE_SIZE = 12;
+
+// Reads codes LSB first across the data sub-blocks.
+struct GIFLZWBits
+{
+    const std::uint8_t* data;
+    const std::uint8_t* data_end;
+    const std::uint8_t* block_end;
+
+    std::uint64_t bits = 0;
+    int num_bits = 0;
+};
+
+static std::uint64_t devi_gif_lzw_load(const std::uint8_t* data)
+{
+    std::uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+
+    if constexpr (std::endian::native == std::endian::big)
+    {
+        word = __builtin_bswap64(word);
+    }
+
+    return word;
+}
+
+static void devi_gif_lzw_refill(GIFLZWBits& reader)
+{
+    // In the middle of a sub-block, take as many whole bytes as fit in one
+    // go. The bits loaded past num_bits are the bytes that come next in the
+    // same sub-block, so loading them again later changes nothing.
+    if (reader.block_end - reader.data >= (std::ptrdiff_t)sizeof(std::uint64_t))
+    {
+        auto num_bytes = (63 - reader.num_bits) >> 3;
+
+        reader.bits |= devi_gif_lzw_load(reader.data) << reader.num_bits;
+        reader.data += num_bytes;
+        reader.num_bits += num_bytes * 8;
+
+        return;
+    }
+
+    while (reader.num_bits <= 56)
+    {
+        if (reader.data == reader.block_end)
+        {
+            // A zero length sub-block ends the image data. A truncated one
+            // is only an error if its codes are actually needed.
+            if (reader.data == reader.data_end || *reader.data == 0 || *reader.data >= reader.data_end - reader.data)
+            {
+                return;
+            }
+
+            auto block_size = *reader.data++;
+            reader.block_end = reader.data + block_size;
+
+            continue;
+        }
+
+        reader.bits |= (std::uint64_t)*reader.data++ << reader.num_bits;
+        reader.num_bits += 8;
+    }
+}
+
+// Copies a string from earlier in the output a word at a time. Every
+// string ends at or before 'destination', so only bytes past 'size' (which
+// are overwritten later) can come out wrong.
+static void devi_gif_lzw_copy(std::uint8_t* destination, const std::uint8_t* source, std::size_t size)
+{
+    for (std::size_t i = 0; i < size; i += sizeof(std::uint64_t))
+    {
+        std::uint64_t word;
+        std::memcpy(&word, source + i, sizeof(word));
+        std::memcpy(destination + i, &word, sizeof(word));
+    }
+}
+
+void devi::decode_gif_lzw(const std::uint8_t* data, std::size_t size, std::uint8_t* indices, std::size_t num_indices)
+{
+    if (num_indices == 0)
+    {
+        return;
+    }
+
+    if (size == 0)
+    {
+        throw std::runtime_error("GIF image has no data");
+    }
+
+    if (num_indices > std::numeric_limits<std::uint32_t>::max())
+    {
+        throw std::runtime_error("GIF image too large");
+    }
+
+    int min_code_size = data[0];
+    if (min_code_size < 1 || min_code_size > 8)
+    {
+        throw std::runtime_error("invalid GIF LZW code size");
+    }
+
+    const int clear_code = 1 << min_code_size;
+    const int end_code = clear_code + 1;
+
+    // Rather than a prefix chain, every string is kept as where it was last
+    // written in the output: a new string is always the previous one plus
+    // the first index of the current one, which is exactly what follows the
+    // previous string in the output.
+    std::uint32_t offsets[DEVI_GIF_LZW_MAX_CODES];
+    std::uint16_t lengths[DEVI_GIF_LZW_MAX_CODES];
+
+    GIFLZWBits reader = { data + 1, data + size, data + 1 };
+
+    int code_size = min_code_size + 1;
+    int code_limit = 1 << code_size;
+    int num_codes = end_code + 1;
+
+    // giflib grows the code size based on its own count, which differs
+    // from num_codes for the first code after a clear; mirroring it keeps
+    // odd files (e.g., with a code size of 1) decoding the same.
+    int running_code = end_code + 1;
+
+    int previous_code = -1;
+    std::size_t previous_position = 0;
+    std::size_t previous_length = 0;
+
+    std::size_t position = 0;
+    while (position < num_indices)
+    {
+        if (reader.num_bits < code_size)
+        {
+            devi_gif_lzw_refill(reader);
+            if (reader.num_bits < code_size)
+            {
+                throw std::runtime_error("GIF image data ended early");
+            }
+        }
+
+        int code = (int)(reader.bits & (std::uint64_t)(code_limit - 1));
+        reader.bits >>= code_size;
+        reader.num_bits -= code_size;
+
+        if (running_code < DEVI_GIF_LZW_MAX_CODES + 1 && ++running_code > code_limit && code_size < DEVI_GIF_LZW_MAX_CODE_SIZE)
+        {
+            code_limit <<= 1;
+            ++code_size;
+        }
+
+        std::size_t length;
+        if (code < clear_code)
+        {
+            indices[position] = (std::uint8_t)code;
+            length = 1;
+        }
+        else if (code > end_code && code < num_codes)
+        {
+            length = lengths[code];
+
+            auto remaining = num_indices - position;
+            if (length <= remaining)
+            {
+                devi_gif_lzw_copy(indices + position, indices + offsets[code], length);
+            }
+            else
+            {
+                std::memcpy(indices + position, indices + offsets[code], remaining);
+            }
+        }
+        else if (code == num_codes && previous_code >= 0)
+        {
+            // The string being defined by this very code: the previous
+            // string followed by its own first index.
+            length = previous_length + 1;
+
+            auto remaining = num_indices - position;
+            if (length <= remaining)
+            {
+                devi_gif_lzw_copy(indices + position, indices + previous_position, previous_length);
+                indices[position + previous_length] = indices[previous_position];
+            }
+            else
+            {
+                std::memcpy(indices + position, indices + previous_position, remaining);
+            }
+        }
+        else if (code == clear_code)
+        {
+            code_size = min_code_size + 1;
+            code_limit = 1 << code_size;
+            num_codes = end_code + 1;
+            running_code = end_code + 1;
+            previous_code = -1;
+
+            continue;
+        }
+        else if (code == end_code)
+        {
+            throw std::runtime_error("GIF image data ended early");
+        }
+        else
+        {
+            throw std::runtime_error("invalid GIF LZW code");
+        }
+
+        if (previous_code >= 0 && num_codes < DEVI_GIF_LZW_MAX_CODES)
+        {
+            offsets[num_codes] = (std::uint32_t)previous_position;
+            lengths[num_codes] = (std::uint16_t)(previous_length + 1);
+            ++num_codes;
+        }
+
+        previous_code = code;
+        previous_position = position;
+        previous_length = length;
+
+        position += length;
+    }
+}
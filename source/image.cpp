@@ -1,4 +1,104 @@
+#include <stdexcept>
 #include "devi/image.hpp"
+#include "devi/memory.hpp"
+
+devi::Frame& devi::ImageReader::get_frame_buffer()
+{
+    return frame_buffer;
+}
+
+bool devi::ImageReader::read(Frame& frame)
+{
+    std::size_t num_pixels = get_width() * get_height();
+    if (frame.pixels.size() < num_pixels)
+    {
+        resize_buffer(frame.pixels, num_pixels);
+    }
+
+    return read_into(frame, &frame.pixels[0], frame.pixels.size());
+}
+
+bool devi::ImageReader::seek(int frame)
+{
+    if (frame < 0 || (get_num_frames() > 0 && frame >= get_num_frames()))
+    {
+        return false;
+    }
+
+    restart();
+    while (get_current_frame() < frame)
+    {
+        if (!read(frame_buffer))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool devi::ImageReader::can_decode_frames() const
+{
+    return false;
+}
+
+bool devi::ImageReader::decode_frame(int, Frame&, Pixel*, std::size_t)
+{
+    throw std::runtime_error("reader can't decode frames on their own");
+}
+
+bool devi::ImageReader::get_frame_delay(int, float&) const
+{
+    return false;
+}
+
+static void devi_set_frame_fields(lua_State* L, const devi::Frame& frame)
+{
+    lua_pushinteger(L, frame.x);
+    lua_setfield(L, -2, "x");
+
+    lua_pushinteger(L, frame.y);
+    lua_setfield(L, -2, "y");
+
+    lua_pushinteger(L, frame.width);
+    lua_setfield(L, -2, "width");
+
+    lua_pushinteger(L, frame.height);
+    lua_setfield(L, -2, "height");
+
+    lua_pushnumber(L, frame.delay);
+    lua_setfield(L, -2, "delay");
+
+    switch (frame.blend_op)
+    {
+        case devi::BLEND_OP_SOURCE:
+        default:
+            lua_pushstring(L, "replace");
+            break;
+        
+        case devi::BLEND_OP_OVER:
+            lua_pushstring(L, "alpha");
+            break;
+    }
+    lua_setfield(L, -2, "blendMode");
+
+    switch (frame.dispose_op)
+    {
+        case devi::DISPOSE_OP_BACKGROUND:
+        default:
+            lua_pushstring(L, "background");
+            break;
+        
+        case devi::DISPOSE_OP_NONE:
+            lua_pushstring(L, "none");
+            break;
+        
+        case devi::DISPOSE_OP_PREVIOUS:
+            lua_pushstring(L, "previous");
+            break;
+    }
+    lua_setfield(L, -2, "dispose");
+}
 
 static int devi_image_reader_get_width(lua_State* L)
 {
@@ -36,65 +136,62 @@ static int devi_image_reader_read(lua_State *L)
 {
     auto image_reader = *((devi::ImageReader **)luaL_checkudata(L, 1, "devi.ImageReader"));
 
-    devi::Frame frame;
+    auto& frame = image_reader->get_frame_buffer();
     if (image_reader->read(frame))
     {
         lua_newtable(L);
+        devi_set_frame_fields(L, frame);
 
-        lua_pushinteger(L, frame.x);
-        lua_setfield(L, -2, "x");
-
-        lua_pushinteger(L, frame.y);
-        lua_setfield(L, -2, "y");
+        lua_pushlstring(L, (const char*)&frame.pixels[0], frame.width * frame.height * sizeof(devi::Pixel));
+        lua_setfield(L, -2, "pixels");
 
-        lua_pushinteger(L, frame.width);
-        lua_setfield(L, -2, "width");
+        return 1;
+    }
 
-        lua_pushinteger(L, frame.height);
-        lua_setfield(L, -2, "height");
+    return 0;
+}
 
-        lua_pushnumber(L, frame.delay);
-        lua_setfield(L, -2, "delay");
+static int devi_image_reader_read_into(lua_State* L)
+{
+    auto image_reader = *((devi::ImageReader **)luaL_checkudata(L, 1, "devi.ImageReader"));
 
-        switch (frame.blend_op)
-        {
-            case devi::BLEND_OP_SOURCE:
-            default:
-                lua_pushstring(L, "replace");
-                break;
-            
-            case devi::BLEND_OP_OVER:
-                lua_pushstring(L, "alpha");
-                break;
-        }
-        lua_setfield(L, -2, "blendMode");
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+    auto pixels = (devi::Pixel*)lua_touserdata(L, 2);
 
-        switch (frame.dispose_op)
-        {
-            case devi::DISPOSE_OP_BACKGROUND:
-            default:
-                lua_pushstring(L, "background");
-                break;
-            
-            case devi::DISPOSE_OP_NONE:
-                lua_pushstring(L, "none");
-                break;
-            
-            case devi::DISPOSE_OP_PREVIOUS:
-                lua_pushstring(L, "previous");
-                break;
-        }
-        lua_setfield(L, -2, "dispose");
+    auto size = luaL_checkinteger(L, 3);
+    if (size < 0 || (std::size_t)size < image_reader->get_width() * image_reader->get_height() * sizeof(devi::Pixel))
+    {
+        return luaL_error(L, "buffer too small for image");
+    }
 
-        lua_pushlstring(L, (const char*)&frame.pixels[0], frame.pixels.size() * sizeof(devi::Pixel));
-        lua_setfield(L, -2, "pixels");
+    // Reuse the caller's table (if any) so nothing is allocated per frame.
+    if (lua_istable(L, 4))
+    {
+        lua_pushvalue(L, 4);
+    }
+    else
+    {
+        lua_newtable(L);
+    }
 
+    devi::Frame frame;
+    if (image_reader->read_into(frame, pixels, (std::size_t)size / sizeof(devi::Pixel)))
+    {
+        devi_set_frame_fields(L, frame);
         return 1;
     }
 
     return 0;
 }
 
+static int devi_image_reader_seek(lua_State *L)
+{
+    auto image_reader = *((devi::ImageReader **)luaL_checkudata(L, 1, "devi.ImageReader"));
+    lua_pushboolean(L, image_reader->seek((int)luaL_checkinteger(L, 2)));
+
+    return 1;
+}
+
 static int devi_image_reader_restart(lua_State *L)
 {
     auto image_reader = *((devi::ImageReader **)luaL_checkudata(L, 1, "devi.ImageReader"));
@@ -117,6 +214,8 @@ static luaL_Reg DEVI_IMAGE_READER_METHODS[] = {
     { "getNumFrames", &devi_image_reader_get_num_frames },
     { "getCurrentFrame", &devi_image_reader_get_current_frame },
     { "read", &devi_image_reader_read },
+    { "readInto", &devi_image_reader_read_into },
+    { "seek", &devi_image_reader_seek },
     { "restart", &devi_image_reader_restart },
     { nullptr, nullptr }
 };
@@ -0,0 +1,498 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "devi/compositor.hpp"
+#include "devi/indexed_frames.hpp"
+#include "devi/memory.hpp"
+
+devi::IndexedFrames::IndexedFrames(int width, int height, std::size_t limit) :
+    width(width),
+    height(height),
+    limit(limit)
+{
+    if (width <= 0 || height <= 0)
+    {
+        throw std::runtime_error("can't index an empty image");
+    }
+
+    std::fill(std::begin(color_indices), std::end(color_indices), -1);
+}
+
+int devi::IndexedFrames::get_width() const
+{
+    return width;
+}
+
+int devi::IndexedFrames::get_height() const
+{
+    return height;
+}
+
+std::size_t devi::IndexedFrames::get_size() const
+{
+    return size;
+}
+
+int devi::IndexedFrames::get_num_colors() const
+{
+    return num_colors;
+}
+
+const devi::Pixel* devi::IndexedFrames::get_palette() const
+{
+    return palette;
+}
+
+int devi::IndexedFrames::get_num_frames() const
+{
+    return (int)frames.size();
+}
+
+int devi::IndexedFrames::get_current_frame() const
+{
+    return current_frame;
+}
+
+const devi::IndexedFrame& devi::IndexedFrames::get_frame(int index) const
+{
+    if (index < 0 || index >= (int)frames.size())
+    {
+        throw std::out_of_range("indexed frame index out of bounds");
+    }
+
+    return frames[index];
+}
+
+int devi::IndexedFrames::find_color(const Pixel& pixel)
+{
+    std::uint32_t key = 0;
+    if (pixel.alpha != 0)
+    {
+        std::memcpy(&key, &pixel, sizeof(key));
+    }
+
+    auto slot = (key * 0x9e3779b1u) >> 22;
+    while (color_indices[slot] >= 0)
+    {
+        if (color_keys[slot] == key)
+        {
+            return color_indices[slot];
+        }
+
+        slot = (slot + 1) % COLOR_TABLE_SIZE;
+    }
+
+    if (num_colors == Palette::MAX_COLORS)
+    {
+        return -1;
+    }
+
+    if (pixel.alpha != 0)
+    {
+        palette[num_colors] = pixel;
+    }
+
+    color_keys[slot] = key;
+    color_indices[slot] = (std::int16_t)num_colors;
+
+    return num_colors++;
+}
+
+bool devi::IndexedFrames::add_rectangle(const Pixel* pixels, const Rectangle& rectangle, std::uint8_t* indices)
+{
+    // Neighboring pixels are usually the same color, so the last lookup is
+    // tried before the table.
+    std::uint32_t last_word = 0;
+    int last_index = -1;
+
+    for (auto j = 0u; j < rectangle.height; ++j)
+    {
+        auto row = pixels + (std::size_t)(rectangle.y + j) * width + rectangle.x;
+        for (auto i = 0u; i < rectangle.width; ++i)
+        {
+            std::uint32_t word;
+            std::memcpy(&word, &row[i], sizeof(word));
+
+            if (word != last_word || last_index < 0)
+            {
+                last_index = find_color(row[i]);
+                if (last_index < 0)
+                {
+                    return false;
+                }
+
+                last_word = word;
+            }
+
+            *indices++ = (std::uint8_t)last_index;
+        }
+    }
+
+    return true;
+}
+
+bool devi::IndexedFrames::add(float delay, const Region& region, const Pixel* pixels)
+{
+    auto& frame = frames.emplace_back();
+    frame.delay = delay;
+
+    // The first frame replaces whatever the last frame of the previous loop
+    // left behind.
+    if (frames.size() == 1)
+    {
+        frame.region.add({ 0, 0, (std::uint32_t)width, (std::uint32_t)height });
+    }
+    else
+    {
+        frame.region = region;
+    }
+
+    auto num_indices = frame.region.get_area();
+    if (size + num_indices > limit)
+    {
+        frames.pop_back();
+        return false;
+    }
+
+    resize_buffer(frame.indices, num_indices);
+
+    auto indices = frame.indices.data();
+    for (auto i = 0; i < frame.region.get_num_rectangles(); ++i)
+    {
+        auto& rectangle = frame.region.get_rectangle(i);
+        if (!add_rectangle(pixels, rectangle, indices))
+        {
+            frames.pop_back();
+            return false;
+        }
+
+        indices += (std::size_t)rectangle.width * rectangle.height;
+    }
+
+    size += num_indices;
+
+    return true;
+}
+
+bool devi::IndexedFrames::read()
+{
+    if (current_frame >= (int)frames.size())
+    {
+        return false;
+    }
+
+    if (canvas.empty())
+    {
+        resize_buffer(canvas, (std::size_t)width * height);
+    }
+
+    auto& frame = frames[current_frame];
+
+    auto indices = frame.indices.data();
+    for (auto i = 0; i < frame.region.get_num_rectangles(); ++i)
+    {
+        auto& rectangle = frame.region.get_rectangle(i);
+        for (auto j = 0u; j < rectangle.height; ++j)
+        {
+            std::memcpy(&canvas[(std::size_t)(rectangle.y + j) * width + rectangle.x], indices, rectangle.width);
+            indices += rectangle.width;
+        }
+    }
+
+    dirty_region.add(frame.region);
+    ++current_frame;
+
+    return true;
+}
+
+void devi::IndexedFrames::restart()
+{
+    current_frame = 0;
+}
+
+void devi::IndexedFrames::copy_indices(std::uint8_t* destination, const Rectangle& rectangle) const
+{
+    if (canvas.empty())
+    {
+        throw std::runtime_error("no frame has been read yet");
+    }
+
+    // In 64 bits, so huge rectangles can't wrap around into bounds.
+    if ((std::uint64_t)rectangle.x + rectangle.width > (std::uint64_t)width || (std::uint64_t)rectangle.y + rectangle.height > (std::uint64_t)height)
+    {
+        throw std::runtime_error("rectangle out of bounds");
+    }
+
+    for (auto j = 0u; j < rectangle.height; ++j)
+    {
+        std::memcpy(
+            destination + (std::size_t)j * rectangle.width,
+            &canvas[(std::size_t)(rectangle.y + j) * width + rectangle.x],
+            rectangle.width);
+    }
+}
+
+const devi::Region& devi::IndexedFrames::get_dirty_region() const
+{
+    return dirty_region;
+}
+
+void devi::IndexedFrames::clear_dirty_region()
+{
+    dirty_region.clear();
+}
+
+struct LuaIndexedFrames
+{
+    devi::IndexedFrames* frames;
+};
+
+static devi::IndexedFrames* devi_to_indexed_frames(lua_State* L, int index)
+{
+    return ((LuaIndexedFrames*)luaL_checkudata(L, index, "devi.IndexedFrames"))->frames;
+}
+
+static int devi_indexed_frames_get_width(lua_State* L)
+{
+    auto frames = devi_to_indexed_frames(L, 1);
+    lua_pushinteger(L, frames->get_width());
+
+    return 1;
+}
+
+static int devi_indexed_frames_get_height(lua_State* L)
+{
+    auto frames = devi_to_indexed_frames(L, 1);
+    lua_pushinteger(L, frames->get_height());
+
+    return 1;
+}
+
+static int devi_indexed_frames_get_num_frames(lua_State* L)
+{
+    auto frames = devi_to_indexed_frames(L, 1);
+    lua_pushinteger(L, frames->get_num_frames());
+
+    return 1;
+}
+
+static int devi_indexed_frames_get_current_frame(lua_State* L)
+{
+    auto frames = devi_to_indexed_frames(L, 1);
+    lua_pushinteger(L, frames->get_current_frame());
+
+    return 1;
+}
+
+static int devi_indexed_frames_get_num_colors(lua_State* L)
+{
+    auto frames = devi_to_indexed_frames(L, 1);
+    lua_pushinteger(L, frames->get_num_colors());
+
+    return 1;
+}
+
+// Copies all 256 palette entries; unused ones are transparent black.
+static int devi_indexed_frames_copy_palette(lua_State* L)
+{
+    auto frames = devi_to_indexed_frames(L, 1);
+
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+    auto destination = (devi::Pixel*)lua_touserdata(L, 2);
+
+    std::memcpy(destination, frames->get_palette(), devi::Palette::MAX_COLORS * sizeof(devi::Pixel));
+
+    return 0;
+}
+
+// Same as Compositor:read, so images can play either back.
+static int devi_indexed_frames_read(lua_State* L)
+{
+    auto frames = devi_to_indexed_frames(L, 1);
+
+    if (!frames->read())
+    {
+        return 0;
+    }
+
+    auto& frame = frames->get_frame(frames->get_current_frame() - 1);
+    auto bounds = frame.region.get_bounds();
+
+    if (lua_istable(L, 2))
+    {
+        lua_pushvalue(L, 2);
+    }
+    else
+    {
+        lua_newtable(L);
+    }
+
+    lua_pushinteger(L, bounds.x);
+    lua_setfield(L, -2, "x");
+
+    lua_pushinteger(L, bounds.y);
+    lua_setfield(L, -2, "y");
+
+    lua_pushinteger(L, bounds.width);
+    lua_setfield(L, -2, "width");
+
+    lua_pushinteger(L, bounds.height);
+    lua_setfield(L, -2, "height");
+
+    lua_pushnumber(L, frame.delay);
+    lua_setfield(L, -2, "delay");
+
+    return 1;
+}
+
+// copyPixels(pointer, x, y, width, height): copies indices (a byte each)
+// of the current frame, like Compositor:copyPixels.
+static int devi_indexed_frames_copy_pixels(lua_State* L)
+{
+    auto frames = devi_to_indexed_frames(L, 1);
+
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+    auto destination = (std::uint8_t*)lua_touserdata(L, 2);
+
+    devi::Rectangle rectangle;
+    rectangle.x = luaL_checkinteger(L, 3);
+    rectangle.y = luaL_checkinteger(L, 4);
+    rectangle.width = luaL_checkinteger(L, 5);
+    rectangle.height = luaL_checkinteger(L, 6);
+
+    frames->copy_indices(destination, rectangle);
+
+    return 0;
+}
+
+static int devi_indexed_frames_get_dirty_rectangles(lua_State* L)
+{
+    auto frames = devi_to_indexed_frames(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    auto& region = frames->get_dirty_region();
+    for (auto i = 0; i < region.get_num_rectangles(); ++i)
+    {
+        auto& rectangle = region.get_rectangle(i);
+
+        lua_pushinteger(L, rectangle.x);
+        lua_rawseti(L, 2, i * 4 + 1);
+
+        lua_pushinteger(L, rectangle.y);
+        lua_rawseti(L, 2, i * 4 + 2);
+
+        lua_pushinteger(L, rectangle.width);
+        lua_rawseti(L, 2, i * 4 + 3);
+
+        lua_pushinteger(L, rectangle.height);
+        lua_rawseti(L, 2, i * 4 + 4);
+    }
+
+    lua_pushinteger(L, region.get_num_rectangles());
+
+    return 1;
+}
+
+static int devi_indexed_frames_clear_dirty_rectangle(lua_State* L)
+{
+    auto frames = devi_to_indexed_frames(L, 1);
+    frames->clear_dirty_region();
+
+    return 0;
+}
+
+static int devi_indexed_frames_restart(lua_State* L)
+{
+    auto frames = devi_to_indexed_frames(L, 1);
+    frames->restart();
+
+    return 0;
+}
+
+static int devi_indexed_frames_gc(lua_State* L)
+{
+    auto lua_frames = (LuaIndexedFrames*)luaL_checkudata(L, 1, "devi.IndexedFrames");
+
+    delete lua_frames->frames;
+    lua_frames->frames = nullptr;
+
+    return 0;
+}
+
+static luaL_Reg DEVI_INDEXED_FRAMES_METHODS[] = {
+    { "getWidth", &devi_indexed_frames_get_width },
+    { "getHeight", &devi_indexed_frames_get_height },
+    { "getNumFrames", &devi_indexed_frames_get_num_frames },
+    { "getCurrentFrame", &devi_indexed_frames_get_current_frame },
+    { "getNumColors", &devi_indexed_frames_get_num_colors },
+    { "copyPalette", &devi_indexed_frames_copy_palette },
+    { "read", &devi_indexed_frames_read },
+    { "copyPixels", &devi_indexed_frames_copy_pixels },
+    { "getDirtyRectangles", &devi_indexed_frames_get_dirty_rectangles },
+    { "clearDirtyRectangle", &devi_indexed_frames_clear_dirty_rectangle },
+    { "restart", &devi_indexed_frames_restart },
+    { nullptr, nullptr }
+};
+
+// IndexedFrames(compositor, limit): plays the compositor through one loop
+// and indexes every frame. Returns nothing if the animation has more than
+// 256 colors or doesn't fit in limit bytes; either way, the compositor is
+// restarted afterwards.
+static int devi_indexed_frames_new(lua_State* L)
+{
+    auto compositor = devi::to_compositor(L, 1);
+    auto limit = luaL_checkinteger(L, 2);
+
+    if (compositor->get_current_frame() != 0)
+    {
+        return luaL_error(L, "indexed frames must be made from the start of the animation");
+    }
+
+    auto lua_frames = (LuaIndexedFrames*)lua_newuserdata(L, sizeof(LuaIndexedFrames));
+    lua_frames->frames = nullptr;
+
+    if (luaL_newmetatable(L, "devi.IndexedFrames"))
+    {
+        devi::luax_register(L, DEVI_INDEXED_FRAMES_METHODS);
+        lua_setfield(L, -2, "__index");
+
+        devi::luax_pushcfunction(L, &devi_indexed_frames_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+
+    lua_setmetatable(L, -2);
+
+    lua_frames->frames = new devi::IndexedFrames(
+        compositor->get_width(), compositor->get_height(),
+        limit < 0 ? 0 : (std::size_t)limit);
+
+    compositor->clear_dirty_region();
+
+    bool fits = true;
+    while (fits && compositor->read())
+    {
+        fits = lua_frames->frames->add(
+            compositor->get_frame().delay,
+            compositor->get_dirty_region(),
+            compositor->get_pixels());
+
+        compositor->clear_dirty_region();
+    }
+
+    compositor->restart();
+
+    if (!fits || lua_frames->frames->get_num_frames() == 0)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+extern "C"
+DEVI_EXPORT int luaopen_devi_IndexedFrames(lua_State* L)
+{
+    devi::luax_pushcfunction(L, &devi_indexed_frames_new);
+
+    return 1;
+}
@@ -4,35 +4,141 @@
 #include <string>
 
 #include "devi/lua_file.hpp"
+#include "devi/mapped_file.hpp"
+#include "devi/memory.hpp"
 
-devi::LuaFile::LuaFile(lua_State* L, int index) : L(L)
+// Turns a failed lua_pcall into an exception, popping the error message
+// and the 'num_values' values beneath it.
+static void devi_handle_lua_error(lua_State* L, int result, int num_values)
+{
+    if (result)
+    {
+        switch (result)
+        {
+        case LUA_ERRRUN:
+        case LUA_ERRMEM:
+        {
+            std::string message(lua_tostring(L, -1));
+            lua_pop(L, num_values + 1);
+
+            throw std::runtime_error(message);
+        }
+
+        default:
+            lua_pop(L, num_values + 1);
+            throw std::runtime_error("unknown error");
+        }
+    }
+}
+
+bool devi::get_lua_buffer(lua_State* L, int index, const std::uint8_t*& data, std::size_t& size)
 {
     if (lua_type(L, index) == LUA_TSTRING)
     {
-        reference = -1;
+        data = (const std::uint8_t*)lua_tolstring(L, index, &size);
+        return true;
+    }
 
-        std::size_t size;
-        auto value = luaL_checklstring(L, index, &size);
+    if (lua_type(L, index) != LUA_TUSERDATA)
+    {
+        return false;
+    }
 
-        read_buffer.resize(size);
-        std::memcpy(&read_buffer[0], value, size);
+    if (auto mapped_file = to_mapped_file(L, index))
+    {
+        data = mapped_file->get_data();
+        size = mapped_file->get_size();
+        return true;
     }
-    else if (lua_type(L, index) == LUA_TTABLE)
+
+    // LÖVE Data objects.
+    if (!lua_getmetatable(L, index))
+    {
+        return false;
+    }
+
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "getPointer");
+    lua_getfield(L, index, "getSize");
+    if (!lua_isfunction(L, -2) || !lua_isfunction(L, -1))
+    {
+        lua_pop(L, 2);
+        return false;
+    }
+
+    // getSize is on top, so it's called first; getPointer is left beneath
+    // it until then.
+    lua_pushvalue(L, index);
+    devi_handle_lua_error(L, lua_pcall(L, 1, 1, 0), 1);
+    auto data_size = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, index);
+    devi_handle_lua_error(L, lua_pcall(L, 1, 1, 0), 0);
+    auto data_pointer = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (!data_pointer && data_size > 0)
+    {
+        return false;
+    }
+
+    data = (const std::uint8_t*)data_pointer;
+    size = (std::size_t)data_size;
+
+    return true;
+}
+
+devi::LuaFile::LuaFile(lua_State* L, int index) : L(L)
+{
+    if (lua_type(L, index) == LUA_TTABLE)
     {
         lua_pushvalue(L, index);
         reference = luaL_ref(L, LUA_REGISTRYINDEX);
     }
+    else if (get_lua_buffer(L, index, buffer_data, buffer_size))
+    {
+        buffered = true;
+
+        // Keeps the buffer alive (and in place) for as long as the file.
+        lua_pushvalue(L, index);
+        reference = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
     else
     {
-        luaL_error(L, "expected table or string at index %d", index);
+        luaL_error(L, "expected table, string, Data, or mapped file at index %d", index);
     }
 }
 
-devi::LuaFile::LuaFile(LuaFile&& other) noexcept : L(other.L), reference(other.reference), read_buffer(other.read_buffer), read_offset(other.read_offset)
+devi::LuaFile::LuaFile(const std::uint8_t* data, std::size_t size) :
+    L(nullptr),
+    reference(LUA_NOREF),
+    buffer_data(data),
+    buffer_size(size),
+    buffered(true)
+{
+    // Nothing.
+}
+
+devi::LuaFile::LuaFile(LuaFile&& other) noexcept :
+    L(other.L),
+    reference(other.reference),
+    buffer_data(other.buffer_data),
+    buffer_size(other.buffer_size),
+    buffered(other.buffered),
+    read_buffer(std::move(other.read_buffer)),
+    read_offset(other.read_offset),
+    read_end(other.read_end),
+    stream_position(other.stream_position)
 {
     other.L = nullptr;
-    other.read_buffer.clear();
+    other.reference = LUA_NOREF;
+    other.buffer_data = nullptr;
+    other.buffer_size = 0;
     other.read_offset = 0;
+    other.read_end = 0;
+    other.stream_position = 0;
 }
 
 devi::LuaFile::~LuaFile()
@@ -45,39 +151,27 @@ devi::LuaFile::~LuaFile()
 
 void devi::LuaFile::handle_error(int result)
 {
-    if (result)
-    {
-        switch (result)
-        {
-        case LUA_ERRRUN:
-        case LUA_ERRMEM:
-        {
-            std::string message(lua_tostring(L, -1));
-            lua_pop(L, 2);
-
-            throw std::runtime_error(message);
-        }
-
-        default:
-            lua_pop(L, 1);
-            throw std::runtime_error("unknown error");
-        }
-    }
+    // The file's table is under the error message.
+    devi_handle_lua_error(L, result, 1);
 }
 
-std::size_t devi::LuaFile::read(std::uint8_t* buffer, std::size_t size)
+bool devi::LuaFile::is_buffered() const
 {
-    if (reference < 0)
-    {
-        auto end_offset = std::min(read_offset + size, read_buffer.size());
-        auto num_bytes_read = end_offset - read_offset;
+    return buffered;
+}
 
-        std::memcpy(buffer, &read_buffer[read_offset], num_bytes_read);
+const std::uint8_t* devi::LuaFile::get_data() const
+{
+    return buffer_data;
+}
 
-        read_offset = end_offset;
-        return num_bytes_read;
-    }
+std::size_t devi::LuaFile::get_size() const
+{
+    return buffer_size;
+}
 
+std::size_t devi::LuaFile::read_lua(std::uint8_t* buffer, std::size_t size)
+{
     lua_rawgeti(L, LUA_REGISTRYINDEX, reference);
 
     lua_getfield(L, -1, "read");
@@ -91,22 +185,146 @@ std::size_t devi::LuaFile::read(std::uint8_t* buffer, std::size_t size)
 
     if (!result_buffer)
     {
+        lua_pop(L, 2);
         throw std::runtime_error("expected buffer as result from read");
     }
 
     if (result_buffer_size > size)
     {
+        lua_pop(L, 2);
         throw std::runtime_error("read more bytes than expected");
     }
 
-    std::memcpy(buffer, result_buffer, std::min(size, result_buffer_size));
+    std::memcpy(buffer, result_buffer, result_buffer_size);
+    lua_pop(L, 2);
+
+    stream_position += result_buffer_size;
 
     return result_buffer_size;
 }
 
+std::size_t devi::LuaFile::read(std::uint8_t* buffer, std::size_t size)
+{
+    if (buffered)
+    {
+        auto end_offset = std::min(read_offset + size, buffer_size);
+        auto num_bytes_read = end_offset - read_offset;
+
+        if (num_bytes_read > 0)
+        {
+            std::memcpy(buffer, buffer_data + read_offset, num_bytes_read);
+        }
+
+        read_offset = end_offset;
+        return num_bytes_read;
+    }
+
+    std::size_t num_bytes_read = 0;
+    while (num_bytes_read < size)
+    {
+        if (read_offset < read_end)
+        {
+            auto num_bytes = std::min(size - num_bytes_read, read_end - read_offset);
+            std::memcpy(buffer + num_bytes_read, &read_buffer[read_offset], num_bytes);
+
+            read_offset += num_bytes;
+            num_bytes_read += num_bytes;
+
+            continue;
+        }
+
+        // Large reads go straight into the destination instead of through
+        // the block.
+        auto remaining = size - num_bytes_read;
+        if (remaining >= READ_BLOCK_SIZE)
+        {
+            read_offset = 0;
+            read_end = 0;
+
+            auto num_bytes = read_lua(buffer + num_bytes_read, remaining);
+            if (num_bytes == 0)
+            {
+                break;
+            }
+
+            num_bytes_read += num_bytes;
+            continue;
+        }
+
+        resize_buffer(read_buffer, READ_BLOCK_SIZE);
+        read_offset = 0;
+        read_end = read_lua(&read_buffer[0], READ_BLOCK_SIZE);
+
+        if (read_end == 0)
+        {
+            break;
+        }
+    }
+
+    return num_bytes_read;
+}
+
+std::size_t devi::LuaFile::read_at(std::size_t position, std::uint8_t* buffer, std::size_t size) const
+{
+    if (!buffered)
+    {
+        throw std::runtime_error("only buffered files can be read at a position");
+    }
+
+    if (position >= buffer_size)
+    {
+        return 0;
+    }
+
+    auto num_bytes_read = std::min(size, buffer_size - position);
+    std::memcpy(buffer, buffer_data + position, num_bytes_read);
+
+    return num_bytes_read;
+}
+
+std::size_t devi::LuaFile::tell() const
+{
+    if (buffered)
+    {
+        return read_offset;
+    }
+
+    return stream_position - (read_end - read_offset);
+}
+
+void devi::LuaFile::seek(std::size_t position)
+{
+    if (buffered)
+    {
+        read_offset = std::min(position, buffer_size);
+        return;
+    }
+
+    auto block_position = stream_position - read_end;
+    if (position >= block_position && position <= stream_position)
+    {
+        read_offset = position - block_position;
+        return;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, reference);
+
+    lua_getfield(L, -1, "seek");
+    lua_pushvalue(L, -2);
+    lua_pushinteger(L, position);
+
+    handle_error(lua_pcall(L, 2, 0, 0));
+
+    lua_pop(L, 1);
+
+    read_offset = 0;
+    read_end = 0;
+    stream_position = position;
+}
+
 std::size_t devi::LuaFile::write(const std::uint8_t* buffer, std::size_t size)
 {
-    if (reference < 0)
+    if (is_buffered())
     {
         throw std::runtime_error("cannot write to read-only buffer");
     }
@@ -138,7 +356,7 @@ std::size_t devi::LuaFile::write(const std::uint8_t* buffer, std::size_t size)
 
 void devi::LuaFile::flush()
 {
-    if (reference < 0)
+    if (is_buffered())
     {
         throw std::runtime_error("cannot flush read-only buffer");
     }
@@ -155,12 +373,16 @@ void devi::LuaFile::flush()
 
 void devi::LuaFile::open()
 {
-    if (reference < 0)
+    if (is_buffered())
     {
         read_offset = 0;
         return;
     }
 
+    read_offset = 0;
+    read_end = 0;
+    stream_position = 0;
+
     lua_rawgeti(L, LUA_REGISTRYINDEX, reference);
 
     lua_getfield(L, -1, "open");
@@ -173,12 +395,16 @@ void devi::LuaFile::open()
 
 void devi::LuaFile::close()
 {
-    if (reference < 0)
+    if (buffered)
     {
-        read_offset = read_buffer.size();
+        read_offset = buffer_size;
         return;
     }
 
+    read_offset = 0;
+    read_end = 0;
+    stream_position = 0;
+
     lua_rawgeti(L, LUA_REGISTRYINDEX, reference);
 
     lua_getfield(L, -1, "close");
@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include "devi/mapped_file.hpp"
+
+#ifdef _WIN32
+devi::MappedFile::MappedFile(const std::string& path, bool is_mapped) : is_mapped(is_mapped)
+{
+    auto path_length = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+    if (path_length <= 0)
+    {
+        throw std::runtime_error("invalid file path");
+    }
+
+    std::wstring wide_path(path_length, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wide_path[0], path_length);
+
+    auto file = CreateFileW(wide_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        throw std::runtime_error("could not open file");
+    }
+
+    file_handle = file;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size))
+    {
+        release();
+        throw std::runtime_error("could not get file size");
+    }
+
+    size = (std::size_t)file_size.QuadPart;
+
+    // Empty files can't be mapped, but there's nothing to read anyway.
+    if (size == 0)
+    {
+        return;
+    }
+
+    if (!is_mapped)
+    {
+        contents.resize(size);
+
+        std::size_t offset = 0;
+        while (offset < size)
+        {
+            auto count = (DWORD)std::min<std::size_t>(size - offset, 1u << 30);
+
+            DWORD num_bytes_read;
+            if (!ReadFile(file, &contents[offset], count, &num_bytes_read, nullptr) || num_bytes_read == 0)
+            {
+                release();
+                throw std::runtime_error("could not read file");
+            }
+
+            offset += num_bytes_read;
+        }
+
+        data = contents.data();
+
+        CloseHandle(file_handle);
+        file_handle = nullptr;
+
+        return;
+    }
+
+    mapping_handle = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_handle)
+    {
+        release();
+        throw std::runtime_error("could not map file");
+    }
+
+    data = (const std::uint8_t*)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+    if (!data)
+    {
+        release();
+        throw std::runtime_error("could not map file");
+    }
+}
+
+void devi::MappedFile::release()
+{
+    if (data && is_mapped)
+    {
+        UnmapViewOfFile(data);
+    }
+
+    data = nullptr;
+    contents = std::vector<std::uint8_t>();
+
+    if (mapping_handle)
+    {
+        CloseHandle(mapping_handle);
+        mapping_handle = nullptr;
+    }
+
+    if (file_handle)
+    {
+        CloseHandle(file_handle);
+        file_handle = nullptr;
+    }
+
+    size = 0;
+}
+#else
+devi::MappedFile::MappedFile(const std::string& path, bool is_mapped) : is_mapped(is_mapped)
+{
+    auto file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0)
+    {
+        throw std::runtime_error("could not open file");
+    }
+
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0)
+    {
+        ::close(file);
+        throw std::runtime_error("could not get file size");
+    }
+
+    size = (std::size_t)file_stat.st_size;
+
+    if (size > 0 && !is_mapped)
+    {
+        contents.resize(size);
+
+        std::size_t offset = 0;
+        while (offset < size)
+        {
+            auto num_bytes_read = ::read(file, &contents[offset], size - offset);
+            if (num_bytes_read <= 0)
+            {
+                ::close(file);
+                throw std::runtime_error("could not read file");
+            }
+
+            offset += (std::size_t)num_bytes_read;
+        }
+
+        data = contents.data();
+    }
+
+    // Empty files can't be mapped, but there's nothing to read anyway.
+    if (size > 0 && is_mapped)
+    {
+        auto mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (mapping == MAP_FAILED)
+        {
+            ::close(file);
+            throw std::runtime_error("could not map file");
+        }
+
+        // Decoders read front to back.
+        madvise(mapping, size, MADV_SEQUENTIAL);
+
+        data = (const std::uint8_t*)mapping;
+    }
+
+    // The mapping stays valid after the descriptor is closed.
+    ::close(file);
+}
+
+void devi::MappedFile::release()
+{
+    if (data && is_mapped)
+    {
+        munmap((void*)data, size);
+    }
+
+    data = nullptr;
+    contents = std::vector<std::uint8_t>();
+    size = 0;
+}
+#endif
+
+devi::MappedFile::~MappedFile()
+{
+    release();
+}
+
+const std::uint8_t* devi::MappedFile::get_data() const
+{
+    return data;
+}
+
+std::size_t devi::MappedFile::get_size() const
+{
+    return size;
+}
+
+struct LuaMappedFile
+{
+    devi::MappedFile* mapped_file;
+};
+
+devi::MappedFile* devi::to_mapped_file(lua_State* L, int index)
+{
+    if (lua_type(L, index) != LUA_TUSERDATA || !lua_getmetatable(L, index))
+    {
+        return nullptr;
+    }
+
+    luaL_getmetatable(L, "devi.MappedFile");
+    auto is_mapped_file = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+
+    if (!is_mapped_file)
+    {
+        return nullptr;
+    }
+
+    return ((LuaMappedFile*)lua_touserdata(L, index))->mapped_file;
+}
+
+static int devi_mapped_file_get_size(lua_State* L)
+{
+    auto mapped_file = ((LuaMappedFile*)luaL_checkudata(L, 1, "devi.MappedFile"))->mapped_file;
+    lua_pushnumber(L, (lua_Number)mapped_file->get_size());
+
+    return 1;
+}
+
+static int devi_mapped_file_gc(lua_State* L)
+{
+    auto lua_mapped_file = (LuaMappedFile*)luaL_checkudata(L, 1, "devi.MappedFile");
+    if (lua_mapped_file->mapped_file)
+    {
+        delete lua_mapped_file->mapped_file;
+        lua_mapped_file->mapped_file = nullptr;
+    }
+
+    return 0;
+}
+
+static luaL_Reg DEVI_MAPPED_FILE_METHODS[] = {
+    { "getSize", &devi_mapped_file_get_size },
+    { nullptr, nullptr }
+};
+
+void devi::push_mapped_file(lua_State* L, MappedFile* mapped_file)
+{
+    auto lua_mapped_file = (LuaMappedFile*)lua_newuserdata(L, sizeof(LuaMappedFile));
+    lua_mapped_file->mapped_file = nullptr;
+
+    if (luaL_newmetatable(L, "devi.MappedFile"))
+    {
+        devi::luax_register(L, DEVI_MAPPED_FILE_METHODS);
+        lua_setfield(L, -2, "__index");
+
+        devi::luax_pushcfunction(L, &devi_mapped_file_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+
+    lua_setmetatable(L, -2);
+
+    lua_mapped_file->mapped_file = mapped_file;
+}
+
+static int devi_mapped_file_new(lua_State* L)
+{
+    std::string path(luaL_checkstring(L, 1));
+
+    // Opened first, so a failure doesn't leave a userdata without a file.
+    auto mapped_file = new devi::MappedFile(path);
+    devi::push_mapped_file(L, mapped_file);
+
+    return 1;
+}
+
+extern "C"
+DEVI_EXPORT int luaopen_devi_MappedFile(lua_State* L)
+{
+    devi::luax_pushcfunction(L, &devi_mapped_file_new);
+
+    return 1;
+}
@@ -0,0 +1,98 @@
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include "devi/frame_cache.hpp"
+#include "devi/memory.hpp"
+
+static std::atomic<std::size_t> devi_num_allocations = 0;
+static std::atomic<std::size_t> devi_num_allocated_bytes = 0;
+
+void devi::count_allocation(std::size_t size)
+{
+    devi_num_allocations.fetch_add(1, std::memory_order_relaxed);
+    devi_num_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+std::size_t devi::get_num_allocations()
+{
+    return devi_num_allocations.load(std::memory_order_relaxed);
+}
+
+std::size_t devi::get_num_allocated_bytes()
+{
+    return devi_num_allocated_bytes.load(std::memory_order_relaxed);
+}
+
+static int devi_memory_get_allocations(lua_State* L)
+{
+    lua_pushnumber(L, (lua_Number)devi::get_num_allocations());
+    lua_pushnumber(L, (lua_Number)devi::get_num_allocated_bytes());
+
+    return 2;
+}
+
+// setCacheBudget(bytes): nil for no budget.
+static int devi_memory_set_cache_budget(lua_State* L)
+{
+    if (lua_isnoneornil(L, 1))
+    {
+        devi::set_cache_budget(std::numeric_limits<std::size_t>::max());
+        return 0;
+    }
+
+    auto budget = luaL_checknumber(L, 1);
+    if (std::isnan(budget))
+    {
+        return luaL_argerror(L, 1, "budget must be a number");
+    }
+
+    if (budget < 0)
+    {
+        return luaL_argerror(L, 1, "budget cannot be negative");
+    }
+
+    // Anything past the largest size (e.g., math.huge) is no budget at all;
+    // converting it would be undefined.
+    if (budget >= (lua_Number)std::numeric_limits<std::size_t>::max())
+    {
+        devi::set_cache_budget(std::numeric_limits<std::size_t>::max());
+        return 0;
+    }
+
+    devi::set_cache_budget((std::size_t)budget);
+
+    return 0;
+}
+
+// Returns the bytes used by every frame cache, and the budget (or nil).
+static int devi_memory_get_cache_usage(lua_State* L)
+{
+    lua_pushnumber(L, (lua_Number)devi::get_cache_usage());
+
+    auto budget = devi::get_cache_budget();
+    if (budget == std::numeric_limits<std::size_t>::max())
+    {
+        lua_pushnil(L);
+    }
+    else
+    {
+        lua_pushnumber(L, (lua_Number)budget);
+    }
+
+    return 2;
+}
+
+static luaL_Reg DEVI_MEMORY_FUNCTIONS[] = {
+    { "getAllocations", &devi_memory_get_allocations },
+    { "setCacheBudget", &devi_memory_set_cache_budget },
+    { "getCacheUsage", &devi_memory_get_cache_usage },
+    { nullptr, nullptr }
+};
+
+extern "C"
+DEVI_EXPORT int luaopen_devi_Memory(lua_State* L)
+{
+    devi::luax_register(L, DEVI_MEMORY_FUNCTIONS);
+
+    return 1;
+}
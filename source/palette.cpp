@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cstring>
+#include "devi/palette.hpp"
+
+#if defined(DEVI_PALETTE_AVX2)
+#include <immintrin.h>
+#elif defined(DEVI_PALETTE_NEON)
+#include <arm_neon.h>
+#endif
+
+static_assert(sizeof(devi::Pixel) == sizeof(std::uint32_t), "pixels must be packed");
+
+void devi::build_palette(Palette& palette, const std::uint8_t* colors, int num_colors, int transparent_color)
+{
+    num_colors = std::clamp(num_colors, 0, Palette::MAX_COLORS);
+
+    for (auto i = 0; i < num_colors; ++i)
+    {
+        auto& pixel = palette.colors[i];
+        pixel.red = colors[i * 3];
+        pixel.green = colors[i * 3 + 1];
+        pixel.blue = colors[i * 3 + 2];
+        pixel.alpha = 255;
+    }
+
+    // Out of range indices are checked once here rather than on every row:
+    // they simply look up a transparent pixel.
+    std::memset(&palette.colors[num_colors], 0, (Palette::MAX_COLORS - num_colors) * sizeof(Pixel));
+
+    if (transparent_color >= 0 && transparent_color < Palette::MAX_COLORS)
+    {
+        palette.colors[transparent_color] = { 0, 0, 0, 0 };
+    }
+
+#if defined(DEVI_PALETTE_NEON)
+    for (auto i = 0; i < Palette::MAX_COLORS; ++i)
+    {
+        palette.planes[0][i] = palette.colors[i].red;
+        palette.planes[1][i] = palette.colors[i].green;
+        palette.planes[2][i] = palette.colors[i].blue;
+        palette.planes[3][i] = palette.colors[i].alpha;
+    }
+#endif
+}
+
+static void devi_palette_expand_scalar(const devi::Palette& palette, const std::uint8_t* indices, devi::Pixel* pixels, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        pixels[i] = palette.colors[indices[i]];
+    }
+}
+
+#if defined(DEVI_PALETTE_AVX2)
+__attribute__((target("avx2")))
+static void devi_palette_expand_avx2(const devi::Palette& palette, const std::uint8_t* indices, devi::Pixel* pixels, std::size_t count)
+{
+    auto table = (const int*)palette.colors;
+
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        auto offsets = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indices + i)));
+        auto colors = _mm256_i32gather_epi32(table, offsets, sizeof(devi::Pixel));
+        _mm256_storeu_si256((__m256i*)(pixels + i), colors);
+    }
+
+    devi_palette_expand_scalar(palette, indices + i, pixels + i, count - i);
+}
+
+static bool devi_palette_has_avx2()
+{
+    static const bool result = __builtin_cpu_supports("avx2");
+    return result;
+}
+#elif defined(DEVI_PALETTE_NEON)
+static void devi_palette_expand_neon(const devi::Palette& palette, const std::uint8_t* indices, devi::Pixel* pixels, std::size_t count)
+{
+    // NEON has no gather, but TBL looks up 64 bytes at a time (and TBX
+    // leaves out of range lanes alone), so each channel's plane is looked
+    // up a quarter at a time.
+    uint8x16x4_t tables[4][4];
+    for (auto channel = 0; channel < 4; ++channel)
+    {
+        for (auto quarter = 0; quarter < 4; ++quarter)
+        {
+            tables[channel][quarter] = vld1q_u8_x4(&palette.planes[channel][quarter * 64]);
+        }
+    }
+
+    auto quarter_size = vdupq_n_u8(64);
+
+    std::size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        uint8x16_t offsets[4];
+        offsets[0] = vld1q_u8(indices + i);
+        offsets[1] = vsubq_u8(offsets[0], quarter_size);
+        offsets[2] = vsubq_u8(offsets[1], quarter_size);
+        offsets[3] = vsubq_u8(offsets[2], quarter_size);
+
+        uint8x16x4_t result;
+        for (auto channel = 0; channel < 4; ++channel)
+        {
+            auto value = vqtbl4q_u8(tables[channel][0], offsets[0]);
+            value = vqtbx4q_u8(value, tables[channel][1], offsets[1]);
+            value = vqtbx4q_u8(value, tables[channel][2], offsets[2]);
+            value = vqtbx4q_u8(value, tables[channel][3], offsets[3]);
+
+            result.val[channel] = value;
+        }
+
+        vst4q_u8((std::uint8_t*)(pixels + i), result);
+    }
+
+    devi_palette_expand_scalar(palette, indices + i, pixels + i, count - i);
+}
+#endif
+
+void devi::expand_palette(const Palette& palette, const std::uint8_t* indices, Pixel* pixels, std::size_t count)
+{
+#if defined(DEVI_PALETTE_AVX2)
+    if (devi_palette_has_avx2())
+    {
+        devi_palette_expand_avx2(palette, indices, pixels, count);
+        return;
+    }
+#elif defined(DEVI_PALETTE_NEON)
+    if (count >= 16)
+    {
+        devi_palette_expand_neon(palette, indices, pixels, count);
+        return;
+    }
+#endif
+
+    devi_palette_expand_scalar(palette, indices, pixels, count);
+}
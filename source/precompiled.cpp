@@ -0,0 +1,558 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include "devi/compositor.hpp"
+#include "devi/memory.hpp"
+#include "devi/precompiled.hpp"
+#include "devi/shared_cache.hpp"
+
+static const std::uint32_t DEVI_PRECOMPILED_RUN = 0x80000000u;
+
+// Shortest run worth storing as one; anything shorter costs more than the
+// pixels themselves.
+static const std::size_t DEVI_PRECOMPILED_MIN_RUN = 3;
+
+static bool devi_precompiled_read_header(const std::uint8_t* data, std::size_t size, devi::PrecompiledHeader& header)
+{
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+
+    // The buffer may not be aligned (e.g., a Lua string), so fields are
+    // copied out rather than read in place.
+    std::memcpy(&header, data, sizeof(header));
+
+    return
+        std::memcmp(header.magic, devi::PRECOMPILED_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == devi::PRECOMPILED_VERSION;
+}
+
+bool devi::is_precompiled(const std::uint8_t* data, std::size_t size)
+{
+    return size >= sizeof(PRECOMPILED_MAGIC) && std::memcmp(data, PRECOMPILED_MAGIC, sizeof(PRECOMPILED_MAGIC)) == 0;
+}
+
+bool devi::is_precompiled_current(const std::uint8_t* data, std::size_t size, const std::uint8_t* source, std::size_t source_size, std::int64_t source_modtime)
+{
+    PrecompiledHeader header;
+    if (!devi_precompiled_read_header(data, size, header) || header.source_size != source_size)
+    {
+        return false;
+    }
+
+    if (source_modtime >= 0 && header.source_modtime == source_modtime)
+    {
+        return true;
+    }
+
+    if (!source)
+    {
+        return false;
+    }
+
+    std::uint8_t source_hash[SHA256_SIZE];
+    sha256(source, source_size, source_hash);
+
+    return std::memcmp(header.source_hash, source_hash, sizeof(source_hash)) == 0;
+}
+
+devi::PrecompiledImageReader::PrecompiledImageReader(LuaFile&& file) : file(std::move(file))
+{
+    if (!this->file.is_buffered())
+    {
+        throw std::runtime_error("precompiled images can't be streamed");
+    }
+
+    auto data = this->file.get_data();
+    auto size = this->file.get_size();
+
+    if (!devi_precompiled_read_header(data, size, header))
+    {
+        throw std::runtime_error("not a precompiled image (or made by another version of devi)");
+    }
+
+    auto table_size = (std::size_t)header.num_frames * sizeof(PrecompiledFrame);
+    if (table_size > size - sizeof(header))
+    {
+        throw std::runtime_error("precompiled image is truncated");
+    }
+
+    frames.resize(header.num_frames);
+    std::memcpy(frames.data(), data + sizeof(header), table_size);
+
+    // Checked once here, so reading a frame can trust the table.
+    for (auto& entry: frames)
+    {
+        auto num_pixels = (std::uint64_t)entry.width * entry.height;
+
+        bool is_valid =
+            entry.x <= header.width && entry.width <= header.width - entry.x &&
+            entry.y <= header.height && entry.height <= header.height - entry.y &&
+            entry.offset <= size && entry.size <= size - entry.offset &&
+            entry.size % sizeof(std::uint32_t) == 0;
+
+        if (entry.encoding == PRECOMPILED_ENCODING_RAW)
+        {
+            is_valid = is_valid && entry.size == num_pixels * sizeof(Pixel);
+        }
+        else if (entry.encoding != PRECOMPILED_ENCODING_RLE)
+        {
+            is_valid = false;
+        }
+
+        if (!is_valid)
+        {
+            throw std::runtime_error("precompiled image is corrupt");
+        }
+    }
+}
+
+int devi::PrecompiledImageReader::get_width() const
+{
+    return (int)header.width;
+}
+
+int devi::PrecompiledImageReader::get_height() const
+{
+    return (int)header.height;
+}
+
+int devi::PrecompiledImageReader::get_num_frames() const
+{
+    return (int)frames.size();
+}
+
+int devi::PrecompiledImageReader::get_current_frame() const
+{
+    return current_frame;
+}
+
+bool devi::PrecompiledImageReader::is_buffered() const
+{
+    return true;
+}
+
+void devi::PrecompiledImageReader::copy_frame(const PrecompiledFrame& entry, Frame& frame, Pixel* pixels, std::size_t num_pixels) const
+{
+    if ((std::size_t)header.width * header.height > num_pixels)
+    {
+        throw std::runtime_error("buffer too small for image");
+    }
+
+    frame.x = entry.x;
+    frame.y = entry.y;
+    frame.width = entry.width;
+    frame.height = entry.height;
+    frame.blend_op = entry.blend_op;
+    frame.dispose_op = entry.dispose_op;
+    frame.delay = entry.delay;
+
+    auto source = file.get_data() + entry.offset;
+    auto frame_size = (std::size_t)entry.width * entry.height;
+
+    if (entry.encoding == PRECOMPILED_ENCODING_RAW)
+    {
+        std::memcpy(pixels, source, frame_size * sizeof(Pixel));
+        return;
+    }
+
+    auto source_end = source + entry.size;
+    std::size_t position = 0;
+
+    while (source < source_end)
+    {
+        std::uint32_t count;
+        std::memcpy(&count, source, sizeof(count));
+        source += sizeof(count);
+
+        bool is_run = (count & DEVI_PRECOMPILED_RUN) != 0;
+        count &= ~DEVI_PRECOMPILED_RUN;
+
+        auto count_size = is_run ? sizeof(Pixel) : count * sizeof(Pixel);
+        if (count > frame_size - position || count_size > (std::size_t)(source_end - source))
+        {
+            throw std::runtime_error("precompiled image is corrupt");
+        }
+
+        if (is_run)
+        {
+            Pixel pixel;
+            std::memcpy(&pixel, source, sizeof(pixel));
+            std::fill_n(pixels + position, count, pixel);
+        }
+        else
+        {
+            std::memcpy(pixels + position, source, count_size);
+        }
+
+        source += count_size;
+        position += count;
+    }
+
+    if (position != frame_size)
+    {
+        throw std::runtime_error("precompiled image is corrupt");
+    }
+}
+
+bool devi::PrecompiledImageReader::read_into(Frame& frame, Pixel* pixels, std::size_t num_pixels)
+{
+    if (current_frame >= (int)frames.size())
+    {
+        return false;
+    }
+
+    copy_frame(frames[current_frame], frame, pixels, num_pixels);
+    ++current_frame;
+
+    return true;
+}
+
+bool devi::PrecompiledImageReader::seek(int frame)
+{
+    if (frame < 0 || frame >= (int)frames.size())
+    {
+        return false;
+    }
+
+    current_frame = frame;
+
+    return true;
+}
+
+bool devi::PrecompiledImageReader::get_frame_delay(int index, float& delay) const
+{
+    if (index < 0 || index >= (int)frames.size())
+    {
+        return false;
+    }
+
+    delay = frames[index].delay;
+
+    return true;
+}
+
+bool devi::PrecompiledImageReader::can_decode_frames() const
+{
+    return !frames.empty();
+}
+
+bool devi::PrecompiledImageReader::decode_frame(int index, Frame& frame, Pixel* pixels, std::size_t num_pixels)
+{
+    if (index < 0 || index >= (int)frames.size())
+    {
+        return false;
+    }
+
+    copy_frame(frames[index], frame, pixels, num_pixels);
+
+    return true;
+}
+
+void devi::PrecompiledImageReader::restart()
+{
+    current_frame = 0;
+}
+
+static void devi_precompiled_append(std::vector<std::uint8_t>& output, const void* data, std::size_t size)
+{
+    auto bytes = (const std::uint8_t*)data;
+    output.insert(output.end(), bytes, bytes + size);
+}
+
+static bool devi_precompiled_is_same(const devi::Pixel& a, const devi::Pixel& b)
+{
+    return std::memcmp(&a, &b, sizeof(devi::Pixel)) == 0;
+}
+
+static std::size_t devi_precompiled_get_run(const devi::Pixel* pixels, std::size_t start, std::size_t count)
+{
+    auto end = start + 1;
+    while (end < count && end - start < DEVI_PRECOMPILED_RUN - 1 && devi_precompiled_is_same(pixels[end], pixels[start]))
+    {
+        ++end;
+    }
+
+    return end - start;
+}
+
+static void devi_precompiled_encode_rle(const devi::Pixel* pixels, std::size_t count, std::vector<std::uint8_t>& output)
+{
+    std::size_t i = 0;
+    while (i < count)
+    {
+        auto run = devi_precompiled_get_run(pixels, i, count);
+        if (run >= DEVI_PRECOMPILED_MIN_RUN)
+        {
+            auto header = (std::uint32_t)run | DEVI_PRECOMPILED_RUN;
+            devi_precompiled_append(output, &header, sizeof(header));
+            devi_precompiled_append(output, &pixels[i], sizeof(devi::Pixel));
+
+            i += run;
+            continue;
+        }
+
+        // Pixels up to the next run worth encoding are stored as is.
+        auto end = i + run;
+        while (
+            end < count && end - i < DEVI_PRECOMPILED_RUN - 1 &&
+            devi_precompiled_get_run(pixels, end, std::min(count, end + DEVI_PRECOMPILED_MIN_RUN)) < DEVI_PRECOMPILED_MIN_RUN)
+        {
+            ++end;
+        }
+
+        auto header = (std::uint32_t)(end - i);
+        devi_precompiled_append(output, &header, sizeof(header));
+        devi_precompiled_append(output, &pixels[i], (end - i) * sizeof(devi::Pixel));
+
+        i = end;
+    }
+}
+
+devi::PrecompiledWriter::PrecompiledWriter(int width, int height, bool is_compressed) :
+    width((std::uint32_t)width),
+    height((std::uint32_t)height),
+    is_compressed(is_compressed)
+{
+    // Nothing.
+}
+
+void devi::PrecompiledWriter::add(int index, const Frame& frame, const Pixel* pixels)
+{
+    if (is_finished.load(std::memory_order_acquire) || index != (int)table.size())
+    {
+        return;
+    }
+
+    auto frame_size = (std::size_t)frame.width * frame.height;
+
+    PrecompiledFrame entry = {};
+    entry.x = frame.x;
+    entry.y = frame.y;
+    entry.width = frame.width;
+    entry.height = frame.height;
+    entry.delay = frame.delay;
+    entry.blend_op = (std::uint8_t)frame.blend_op;
+    entry.dispose_op = (std::uint8_t)frame.dispose_op;
+    entry.encoding = PRECOMPILED_ENCODING_RAW;
+
+    data.resize((data.size() + PRECOMPILED_ALIGNMENT - 1) / PRECOMPILED_ALIGNMENT * PRECOMPILED_ALIGNMENT);
+    entry.offset = data.size();
+
+    encoded.clear();
+    if (is_compressed)
+    {
+        devi_precompiled_encode_rle(pixels, frame_size, encoded);
+    }
+
+    if (is_compressed && encoded.size() < frame_size * sizeof(Pixel))
+    {
+        entry.encoding = PRECOMPILED_ENCODING_RLE;
+        devi_precompiled_append(data, encoded.data(), encoded.size());
+    }
+    else
+    {
+        devi_precompiled_append(data, pixels, frame_size * sizeof(Pixel));
+    }
+
+    entry.size = data.size() - entry.offset;
+    table.push_back(entry);
+}
+
+void devi::PrecompiledWriter::finish(int num_frames)
+{
+    if (is_finished.load(std::memory_order_acquire) || num_frames != (int)table.size())
+    {
+        return;
+    }
+
+    encoded = std::vector<std::uint8_t>();
+    is_finished.store(true, std::memory_order_release);
+}
+
+bool devi::PrecompiledWriter::is_complete() const
+{
+    return is_finished.load(std::memory_order_acquire) && !table.empty();
+}
+
+void devi::PrecompiledWriter::write(const std::uint8_t* source, std::size_t source_size, std::int64_t source_modtime, std::vector<std::uint8_t>& output) const
+{
+    PrecompiledHeader header = {};
+    std::memcpy(header.magic, PRECOMPILED_MAGIC, sizeof(header.magic));
+    header.version = PRECOMPILED_VERSION;
+    sha256(source, source_size, header.source_hash);
+    header.source_size = source_size;
+    header.source_modtime = source_modtime;
+    header.width = width;
+    header.height = height;
+    header.num_frames = (std::uint32_t)table.size();
+
+    auto table_end = sizeof(header) + table.size() * sizeof(PrecompiledFrame);
+    auto data_start = (table_end + PRECOMPILED_ALIGNMENT - 1) / PRECOMPILED_ALIGNMENT * PRECOMPILED_ALIGNMENT;
+
+    output.clear();
+    output.reserve(data_start + data.size());
+    devi_precompiled_append(output, &header, sizeof(header));
+
+    for (auto entry: table)
+    {
+        entry.offset += data_start;
+        devi_precompiled_append(output, &entry, sizeof(entry));
+    }
+
+    output.resize(data_start);
+    devi_precompiled_append(output, data.data(), data.size());
+}
+
+void devi::PrecompiledWriter::clear()
+{
+    table = std::vector<PrecompiledFrame>();
+    data = std::vector<std::uint8_t>();
+}
+
+void devi::write_precompiled(ImageReader& reader, const std::uint8_t* source, std::size_t source_size, std::int64_t source_modtime, bool is_compressed, std::vector<std::uint8_t>& output)
+{
+    reader.restart();
+
+    auto num_pixels = (std::size_t)reader.get_width() * reader.get_height();
+    std::vector<Pixel> pixels;
+    resize_buffer(pixels, num_pixels);
+
+    PrecompiledWriter writer(reader.get_width(), reader.get_height(), is_compressed);
+
+    Frame frame;
+    int index = 0;
+    while (reader.read_into(frame, pixels.data(), pixels.size()))
+    {
+        writer.add(index++, frame, pixels.data());
+    }
+
+    reader.restart();
+
+    writer.write(source, source_size, source_modtime, output);
+}
+
+static int devi_precompiled_image_reader_new(lua_State* L)
+{
+    devi::LuaFile file(L, 1);
+
+    devi::push_image_reader(L, new devi::PrecompiledImageReader(std::move(file)));
+
+    return 1;
+}
+
+extern "C"
+DEVI_EXPORT int luaopen_devi_PrecompiledImageReader(lua_State* L)
+{
+    devi::luax_pushcfunction(L, &devi_precompiled_image_reader_new);
+
+    return 1;
+}
+
+// Modification time argument at index, or -1 if there isn't one.
+static std::int64_t devi_precompiled_get_modtime(lua_State* L, int index)
+{
+    if (lua_isnoneornil(L, index))
+    {
+        return -1;
+    }
+
+    return (std::int64_t)luaL_checkinteger(L, index);
+}
+
+// save(reader, source, compress, modtime): returns the precompiled file (as
+// a string) of every frame of reader, which was made from source, last
+// modified at modtime (if known).
+static int devi_precompiled_save(lua_State* L)
+{
+    auto reader = *((devi::ImageReader**)luaL_checkudata(L, 1, "devi.ImageReader"));
+
+    const std::uint8_t* source;
+    std::size_t source_size;
+    if (!devi::get_lua_buffer(L, 2, source, source_size))
+    {
+        return luaL_argerror(L, 2, "expected string, Data, or mapped file");
+    }
+
+    std::vector<std::uint8_t> output;
+    devi::write_precompiled(*reader, source, source_size, devi_precompiled_get_modtime(L, 4), lua_toboolean(L, 3), output);
+
+    lua_pushlstring(L, (const char*)output.data(), output.size());
+
+    return 1;
+}
+
+// saveRecording(compositor, source, modtime): like save, but out of the frames the
+// compositor recorded while playing back, made from source. Returns nothing
+// until the recording is complete, and frees it once saved.
+static int devi_precompiled_save_recording(lua_State* L)
+{
+    auto compositor = devi::to_compositor(L, 1);
+
+    const std::uint8_t* source;
+    std::size_t source_size;
+    if (!devi::get_lua_buffer(L, 2, source, source_size))
+    {
+        return luaL_argerror(L, 2, "expected string, Data, or mapped file");
+    }
+
+    auto recording = compositor->get_recording();
+    if (!recording)
+    {
+        return 0;
+    }
+
+    std::vector<std::uint8_t> output;
+    recording->write(source, source_size, devi_precompiled_get_modtime(L, 3), output);
+    recording->clear();
+
+    lua_pushlstring(L, (const char*)output.data(), output.size());
+
+    return 1;
+}
+
+// isCurrent(file, source, modtime): true if file is a precompiled file of
+// this version of devi, made from source. Source is only hashed if its
+// modtime (if given) doesn't match; it can also be just its size, to check
+// without reading it.
+static int devi_precompiled_is_current(lua_State* L)
+{
+    const std::uint8_t* data;
+    std::size_t size;
+    if (!devi::get_lua_buffer(L, 1, data, size))
+    {
+        return luaL_argerror(L, 1, "expected string, Data, or mapped file");
+    }
+
+    const std::uint8_t* source = nullptr;
+    std::size_t source_size;
+    if (lua_type(L, 2) == LUA_TNUMBER)
+    {
+        source_size = (std::size_t)lua_tointeger(L, 2);
+    }
+    else if (!devi::get_lua_buffer(L, 2, source, source_size))
+    {
+        return luaL_argerror(L, 2, "expected size, string, Data, or mapped file");
+    }
+
+    lua_pushboolean(L, devi::is_precompiled_current(data, size, source, source_size, devi_precompiled_get_modtime(L, 3)));
+
+    return 1;
+}
+
+static luaL_Reg DEVI_PRECOMPILED_FUNCTIONS[] = {
+    { "save", &devi_precompiled_save },
+    { "saveRecording", &devi_precompiled_save_recording },
+    { "isCurrent", &devi_precompiled_is_current },
+    { nullptr, nullptr }
+};
+
+extern "C"
+DEVI_EXPORT int luaopen_devi_Precompiled(lua_State* L)
+{
+    devi::luax_register(L, DEVI_PRECOMPILED_FUNCTIONS);
+
+    return 1;
+}
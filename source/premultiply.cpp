@@ -0,0 +1,190 @@
+#include <algorithm>
+#include "devi/premultiply.hpp"
+
+#if defined(DEVI_PREMULTIPLY_SSE2)
+#include <emmintrin.h>
+#elif defined(DEVI_PREMULTIPLY_NEON)
+#include <arm_neon.h>
+#endif
+
+static_assert(sizeof(devi::Pixel) == sizeof(std::uint32_t), "pixels must be packed");
+
+// x / 255, rounded to nearest, for any x up to 255 * 255. The SIMD kernels
+// use the same formula, so every path gives exactly the same result.
+static std::uint8_t devi_premultiply_divide(std::uint32_t x)
+{
+    x += 128;
+    return (std::uint8_t)((x + (x >> 8)) >> 8);
+}
+
+static void devi_premultiply_scalar(devi::Pixel* pixels, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        auto& p = pixels[i];
+        p.red = devi_premultiply_divide(p.red * p.alpha);
+        p.green = devi_premultiply_divide(p.green * p.alpha);
+        p.blue = devi_premultiply_divide(p.blue * p.alpha);
+    }
+}
+
+// Colors greater than their alpha aren't valid premultiplied colors, but
+// saturate like the SIMD kernels rather than wrap around.
+static std::uint8_t devi_premultiply_add(std::uint32_t source, std::uint32_t destination)
+{
+    return (std::uint8_t)std::min<std::uint32_t>(source + destination, 255);
+}
+
+static void devi_blend_premultiplied_scalar(devi::Pixel* destination, const devi::Pixel* source, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        auto& s = source[i];
+        auto& d = destination[i];
+
+        std::uint32_t inverse_alpha = 255 - s.alpha;
+        d.red = devi_premultiply_add(s.red, devi_premultiply_divide(d.red * inverse_alpha));
+        d.green = devi_premultiply_add(s.green, devi_premultiply_divide(d.green * inverse_alpha));
+        d.blue = devi_premultiply_add(s.blue, devi_premultiply_divide(d.blue * inverse_alpha));
+        d.alpha = devi_premultiply_add(s.alpha, devi_premultiply_divide(d.alpha * inverse_alpha));
+    }
+}
+
+#if defined(DEVI_PREMULTIPLY_SSE2)
+// Each half of a row of four pixels is widened to 16-bit channels, two
+// pixels (RGBA RGBA) at a time.
+static __m128i devi_premultiply_divide_sse2(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+static __m128i devi_premultiply_alpha_sse2(__m128i x)
+{
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+static void devi_premultiply_sse2(devi::Pixel* pixels, std::size_t count)
+{
+    auto zero = _mm_setzero_si128();
+
+    // Alpha is multiplied by 255 (i.e., left as is) rather than by itself.
+    auto color_mask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    auto alpha_one = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        auto row = _mm_loadu_si128((const __m128i*)(pixels + i));
+
+        auto low = _mm_unpacklo_epi8(row, zero);
+        auto high = _mm_unpackhi_epi8(row, zero);
+
+        auto low_alpha = _mm_or_si128(_mm_and_si128(devi_premultiply_alpha_sse2(low), color_mask), alpha_one);
+        auto high_alpha = _mm_or_si128(_mm_and_si128(devi_premultiply_alpha_sse2(high), color_mask), alpha_one);
+
+        low = devi_premultiply_divide_sse2(_mm_mullo_epi16(low, low_alpha));
+        high = devi_premultiply_divide_sse2(_mm_mullo_epi16(high, high_alpha));
+
+        _mm_storeu_si128((__m128i*)(pixels + i), _mm_packus_epi16(low, high));
+    }
+
+    devi_premultiply_scalar(pixels + i, count - i);
+}
+
+static void devi_blend_premultiplied_sse2(devi::Pixel* destination, const devi::Pixel* source, std::size_t count)
+{
+    auto zero = _mm_setzero_si128();
+    auto one = _mm_set1_epi16(255);
+
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        auto s = _mm_loadu_si128((const __m128i*)(source + i));
+        auto d = _mm_loadu_si128((const __m128i*)(destination + i));
+
+        auto s_low = _mm_unpacklo_epi8(s, zero);
+        auto s_high = _mm_unpackhi_epi8(s, zero);
+        auto d_low = _mm_unpacklo_epi8(d, zero);
+        auto d_high = _mm_unpackhi_epi8(d, zero);
+
+        auto low_inverse = _mm_sub_epi16(one, devi_premultiply_alpha_sse2(s_low));
+        auto high_inverse = _mm_sub_epi16(one, devi_premultiply_alpha_sse2(s_high));
+
+        d_low = _mm_add_epi16(s_low, devi_premultiply_divide_sse2(_mm_mullo_epi16(d_low, low_inverse)));
+        d_high = _mm_add_epi16(s_high, devi_premultiply_divide_sse2(_mm_mullo_epi16(d_high, high_inverse)));
+
+        _mm_storeu_si128((__m128i*)(destination + i), _mm_packus_epi16(d_low, d_high));
+    }
+
+    devi_blend_premultiplied_scalar(destination + i, source + i, count - i);
+}
+#elif defined(DEVI_PREMULTIPLY_NEON)
+// VRADDHN adds the rounding 128 and takes the high byte, so together with
+// VRSHR this is exactly devi_premultiply_divide.
+static uint8x8_t devi_premultiply_divide_neon(uint16x8_t x)
+{
+    return vraddhn_u16(x, vrshrq_n_u16(x, 8));
+}
+
+static void devi_premultiply_neon(devi::Pixel* pixels, std::size_t count)
+{
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        auto row = vld4_u8((const std::uint8_t*)(pixels + i));
+        auto alpha = row.val[3];
+
+        row.val[0] = devi_premultiply_divide_neon(vmull_u8(row.val[0], alpha));
+        row.val[1] = devi_premultiply_divide_neon(vmull_u8(row.val[1], alpha));
+        row.val[2] = devi_premultiply_divide_neon(vmull_u8(row.val[2], alpha));
+
+        vst4_u8((std::uint8_t*)(pixels + i), row);
+    }
+
+    devi_premultiply_scalar(pixels + i, count - i);
+}
+
+static void devi_blend_premultiplied_neon(devi::Pixel* destination, const devi::Pixel* source, std::size_t count)
+{
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        auto s = vld4_u8((const std::uint8_t*)(source + i));
+        auto d = vld4_u8((std::uint8_t*)(destination + i));
+        auto inverse_alpha = vmvn_u8(s.val[3]);
+
+        for (auto channel = 0; channel < 4; ++channel)
+        {
+            auto value = devi_premultiply_divide_neon(vmull_u8(d.val[channel], inverse_alpha));
+            d.val[channel] = vqadd_u8(s.val[channel], value);
+        }
+
+        vst4_u8((std::uint8_t*)(destination + i), d);
+    }
+
+    devi_blend_premultiplied_scalar(destination + i, source + i, count - i);
+}
+#endif
+
+void devi::premultiply(Pixel* pixels, std::size_t count)
+{
+#if defined(DEVI_PREMULTIPLY_SSE2)
+    devi_premultiply_sse2(pixels, count);
+#elif defined(DEVI_PREMULTIPLY_NEON)
+    devi_premultiply_neon(pixels, count);
+#else
+    devi_premultiply_scalar(pixels, count);
+#endif
+}
+
+void devi::blend_premultiplied(Pixel* destination, const Pixel* source, std::size_t count)
+{
+#if defined(DEVI_PREMULTIPLY_SSE2)
+    devi_blend_premultiplied_sse2(destination, source, count);
+#elif defined(DEVI_PREMULTIPLY_NEON)
+    devi_blend_premultiplied_neon(destination, source, count);
+#else
+    devi_blend_premultiplied_scalar(destination, source, count);
+#endif
+}
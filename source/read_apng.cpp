@@ -1,12 +1,203 @@
+#include <algorithm>
 #include <csetjmp>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <stdexcept>
 #include <utility>
+#include "devi/memory.hpp"
 #include "devi/read_apng.hpp"
 
+// Offsets into the signature followed by the IHDR chunk.
+static const std::size_t DEVI_APNG_IHDR_WIDTH_OFFSET = 16;
+static const std::size_t DEVI_APNG_IHDR_HEIGHT_OFFSET = 20;
+
+struct APNGFrameStream
+{
+    devi::LuaFile* file = nullptr;
+    const devi::APNGDataChunk* chunks = nullptr;
+    std::size_t num_chunks = 0;
+
+    // Signature, IHDR, and the other chunks before the first frame.
+    std::vector<std::uint8_t> prefix;
+
+    // Bytes of the chunk currently being generated; data comes from the
+    // file in between its header and CRC.
+    std::uint8_t chunk_bytes[12];
+    std::size_t chunk_offset = 0;
+    std::size_t chunk_size = 0;
+
+    std::size_t prefix_offset = 0;
+    std::size_t current_chunk = 0;
+    std::size_t data_offset = 0;
+    bool is_in_data = false;
+    bool is_done = false;
+};
+
+static std::uint32_t devi_apng_read_uint32(const std::uint8_t* bytes)
+{
+    return ((std::uint32_t)bytes[0] << 24) | ((std::uint32_t)bytes[1] << 16) | ((std::uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static void devi_apng_write_uint32(std::uint8_t* bytes, std::uint32_t value)
+{
+    bytes[0] = (std::uint8_t)(value >> 24);
+    bytes[1] = (std::uint8_t)(value >> 16);
+    bytes[2] = (std::uint8_t)(value >> 8);
+    bytes[3] = (std::uint8_t)value;
+}
+
+static void devi_apng_set_frame_control(devi::Frame& frame, std::uint16_t delay_numerator, std::uint16_t delay_denominator, std::uint8_t dispose_op, std::uint8_t blend_op)
+{
+    switch (dispose_op)
+    {
+        case PNG_DISPOSE_OP_NONE:
+            frame.dispose_op = devi::DISPOSE_OP_NONE;
+            break;
+        
+        case PNG_DISPOSE_OP_PREVIOUS:
+            frame.dispose_op = devi::DISPOSE_OP_PREVIOUS;
+            break;
+
+        case PNG_DISPOSE_OP_BACKGROUND:
+        default:
+            frame.dispose_op = devi::DISPOSE_OP_BACKGROUND;
+            break;
+    }
+
+    switch (blend_op)
+    {
+        case PNG_BLEND_OP_OVER:
+            frame.blend_op = devi::BLEND_OP_OVER;
+            break;
+        
+        case PNG_BLEND_OP_SOURCE:
+        default:
+            frame.blend_op = devi::BLEND_OP_SOURCE;
+            break;
+    }
+
+    if (delay_denominator == 0)
+    {
+        delay_denominator = 100;
+    }
+
+    if (delay_numerator == 0)
+    {
+        frame.delay = 0;
+    }
+    else
+    {
+        frame.delay = (float)delay_numerator / (float)delay_denominator;
+    }
+}
+
+static void devi_apng_read_frame_stream(png_structp png_ptr, png_bytep buffer, png_size_t size)
+{
+    auto stream = (APNGFrameStream*)png_get_io_ptr(png_ptr);
+
+    while (size > 0)
+    {
+        if (stream->prefix_offset < stream->prefix.size())
+        {
+            auto num_bytes = std::min(size, stream->prefix.size() - stream->prefix_offset);
+            std::memcpy(buffer, &stream->prefix[stream->prefix_offset], num_bytes);
+
+            stream->prefix_offset += num_bytes;
+            buffer += num_bytes;
+            size -= num_bytes;
+
+            continue;
+        }
+
+        if (stream->chunk_offset < stream->chunk_size)
+        {
+            auto num_bytes = std::min(size, stream->chunk_size - stream->chunk_offset);
+            std::memcpy(buffer, &stream->chunk_bytes[stream->chunk_offset], num_bytes);
+
+            stream->chunk_offset += num_bytes;
+            buffer += num_bytes;
+            size -= num_bytes;
+
+            continue;
+        }
+
+        if (stream->is_in_data)
+        {
+            auto& chunk = stream->chunks[stream->current_chunk];
+
+            auto num_bytes = std::min(size, chunk.size - stream->data_offset);
+            auto position = chunk.offset + stream->data_offset;
+
+            // Buffered files are read without moving them, so several
+            // frames can be decoded at once.
+            std::size_t num_bytes_read;
+            if (stream->file->is_buffered())
+            {
+                num_bytes_read = stream->file->read_at(position, buffer, num_bytes);
+            }
+            else
+            {
+                stream->file->seek(position);
+                num_bytes_read = stream->file->read(buffer, num_bytes);
+            }
+
+            if (num_bytes_read != num_bytes)
+            {
+                png_error(png_ptr, "unexpected end of APNG frame data");
+            }
+
+            stream->data_offset += num_bytes;
+            buffer += num_bytes;
+            size -= num_bytes;
+
+            if (stream->data_offset == chunk.size)
+            {
+                // The CRC isn't checked; see read_indexed.
+                std::memset(stream->chunk_bytes, 0, 4);
+                stream->chunk_offset = 0;
+                stream->chunk_size = 4;
+
+                stream->is_in_data = false;
+                ++stream->current_chunk;
+            }
+
+            continue;
+        }
+
+        if (stream->current_chunk < stream->num_chunks)
+        {
+            devi_apng_write_uint32(stream->chunk_bytes, (std::uint32_t)stream->chunks[stream->current_chunk].size);
+            std::memcpy(stream->chunk_bytes + 4, "IDAT", 4);
+            stream->chunk_offset = 0;
+            stream->chunk_size = 8;
+
+            stream->data_offset = 0;
+            stream->is_in_data = true;
+
+            continue;
+        }
+
+        if (!stream->is_done)
+        {
+            static const std::uint8_t iend[] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82 };
+            std::memcpy(stream->chunk_bytes, iend, sizeof(iend));
+            stream->chunk_offset = 0;
+            stream->chunk_size = sizeof(iend);
+
+            stream->is_done = true;
+
+            continue;
+        }
+
+        png_error(png_ptr, "read past end of APNG frame");
+    }
+}
+
 devi::APNGImageReader::APNGImageReader(LuaFile&& file) : file(std::move(file))
 {
     open();
+    build_index();
 }
 
 devi::APNGImageReader::~APNGImageReader()
@@ -23,6 +214,29 @@ static void devi_apng_read(png_structp png_ptr, png_bytep buffer, png_size_t siz
     }
 }
 
+static png_voidp devi_apng_malloc(png_structp png_ptr, png_alloc_size_t size)
+{
+    devi::count_allocation(size);
+    return std::malloc(size);
+}
+
+static void devi_apng_free(png_structp png_ptr, png_voidp pointer)
+{
+    std::free(pointer);
+}
+
+// Makes libpng hand back 8-bit RGBA rows whatever the color type and bit
+// depth: palettes and low bit depths are expanded (tRNS becoming alpha),
+// 16-bit samples are stripped to 8 bits, gray becomes RGB, and opaque
+// images get a filler alpha. Must be called before the first row is read.
+static void devi_apng_set_transforms(png_structp png)
+{
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+}
+
 void devi::APNGImageReader::open()
 {
     release();
@@ -35,81 +249,205 @@ void devi::APNGImageReader::open()
         throw std::runtime_error("couldn't read PNG signature or PNG signature not valid");
     }
 
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_ptr = png_create_read_struct_2(
+        PNG_LIBPNG_VER_STRING,
+        nullptr, nullptr, nullptr,
+        nullptr, &devi_apng_malloc, &devi_apng_free);
     info_ptr = png_create_info_struct(png_ptr);
 
-    png_set_read_fn(png_ptr, &file, &devi_apng_read);
-    png_set_sig_bytes(png_ptr, sizeof(signature));
-
-    save_stack();
-    png_read_info(png_ptr, info_ptr);
+    if (!png_ptr || !info_ptr)
+    {
+        throw std::runtime_error("PNG not valid");
+    }
 
-    if (!png_get_valid(png_ptr, info_ptr, PNG_INFO_acTL))
+    // libpng errors longjmp back to the function that set this, so it has
+    // to be the one calling into libpng, not a helper that has returned.
+    if (setjmp(png_jmpbuf(png_ptr)))
     {
-        throw std::runtime_error("file is not animated");
+        release();
+        throw std::runtime_error("error reading APNG");
     }
 
-    row_pointers = (png_bytepp)png_malloc(png_ptr, sizeof(png_bytep) * get_height());
-    if (!row_pointers)
+    // Opening fails from the constructor too, where the destructor won't
+    // run to free libpng's structs.
+    try
+    {
+        png_set_read_fn(png_ptr, &file, &devi_apng_read);
+        png_set_sig_bytes(png_ptr, sizeof(signature));
+
+        png_read_info(png_ptr, info_ptr);
+        devi_apng_set_transforms(png_ptr);
+
+        if (!png_get_valid(png_ptr, info_ptr, PNG_INFO_acTL))
+        {
+            throw std::runtime_error("file is not animated");
+        }
+
+        // The row pointers survive restarts, so they're only allocated once.
+        resize_buffer(rows.pointers, get_height());
+    }
+    catch (...)
     {
-        throw std::runtime_error("could not allocate row pointers");
+        release();
+        throw;
     }
+}
+
+void devi::APNGImageReader::build_index()
+{
+    // libpng has already read up to the first image data, so the index is
+    // built with a separate walk over the chunks and then the position is
+    // restored.
+    auto position = file.tell();
 
-    for (auto i = 0; i < get_height(); ++i)
+    header_chunks.clear();
+    frame_index.clear();
+    frame_chunks.clear();
+
+    try
     {
-        row_pointers[i] = (png_bytep)png_malloc(png_ptr, png_get_rowbytes(png_ptr, info_ptr));
-        if (!row_pointers)
+        file.seek(0);
+
+        std::uint8_t signature[8];
+        if (file.read(signature, sizeof(signature)) != sizeof(signature))
         {
-            for (auto j = 0; j < i; ++j)
+            throw std::runtime_error("unexpected end of PNG");
+        }
+
+        header_chunks.assign(signature, signature + sizeof(signature));
+
+        bool is_header = true;
+        bool is_done = false;
+        while (!is_done)
+        {
+            auto chunk_offset = file.tell();
+
+            std::uint8_t chunk_header[8];
+            if (file.read(chunk_header, sizeof(chunk_header)) != sizeof(chunk_header))
+            {
+                break;
+            }
+
+            auto length = devi_apng_read_uint32(chunk_header);
+            auto data_offset = chunk_offset + sizeof(chunk_header);
+            auto next_offset = data_offset + length + 4;
+
+            if (std::memcmp(chunk_header + 4, "fcTL", 4) == 0)
             {
-                png_free(png_ptr, row_pointers[i]);
-                row_pointers[i] = nullptr;
+                is_header = false;
+
+                std::uint8_t fctl[26];
+                if (length < sizeof(fctl) || file.read(fctl, sizeof(fctl)) != sizeof(fctl))
+                {
+                    throw std::runtime_error("invalid fcTL chunk");
+                }
+
+                Frame frame;
+                frame.width = devi_apng_read_uint32(fctl + 4);
+                frame.height = devi_apng_read_uint32(fctl + 8);
+                frame.x = devi_apng_read_uint32(fctl + 12);
+                frame.y = devi_apng_read_uint32(fctl + 16);
+                devi_apng_set_frame_control(
+                    frame,
+                    (std::uint16_t)((fctl[20] << 8) | fctl[21]),
+                    (std::uint16_t)((fctl[22] << 8) | fctl[23]),
+                    fctl[24], fctl[25]);
+
+                auto& index = frame_index.emplace_back();
+                index.x = frame.x;
+                index.y = frame.y;
+                index.width = frame.width;
+                index.height = frame.height;
+                index.blend_op = frame.blend_op;
+                index.dispose_op = frame.dispose_op;
+                index.delay = frame.delay;
+                index.first_chunk = frame_chunks.size();
             }
+            else if (std::memcmp(chunk_header + 4, "IDAT", 4) == 0)
+            {
+                is_header = false;
 
-            png_free(png_ptr, row_pointers);
-            row_pointers = nullptr;
+                // Image data before any fcTL is a default image that isn't
+                // part of the animation.
+                if (!frame_index.empty())
+                {
+                    frame_chunks.push_back({ data_offset, length });
+                    ++frame_index.back().num_chunks;
+                }
+            }
+            else if (std::memcmp(chunk_header + 4, "fdAT", 4) == 0)
+            {
+                // The data follows a sequence number.
+                if (!frame_index.empty() && length >= 4)
+                {
+                    frame_chunks.push_back({ data_offset + 4, length - 4 });
+                    ++frame_index.back().num_chunks;
+                }
+            }
+            else if (std::memcmp(chunk_header + 4, "IEND", 4) == 0)
+            {
+                is_done = true;
+            }
+            else if (is_header && std::memcmp(chunk_header + 4, "acTL", 4) != 0)
+            {
+                // Everything else before the first frame (IHDR, PLTE, tRNS,
+                // gAMA, ...) is needed to decode a frame on its own.
+                auto size = header_chunks.size();
+                header_chunks.resize(size + sizeof(chunk_header) + length + 4);
+                std::memcpy(&header_chunks[size], chunk_header, sizeof(chunk_header));
 
-            throw std::runtime_error("could not allocate row pointers");
+                if (file.read(&header_chunks[size + sizeof(chunk_header)], length + 4) != length + 4)
+                {
+                    throw std::runtime_error("unexpected end of PNG");
+                }
+            }
+
+            file.seek(next_offset);
         }
     }
-}
+    catch (const std::runtime_error&)
+    {
+        // Frames past a truncated or broken chunk can't be decoded from
+        // the index.
+        frame_index.clear();
+        frame_chunks.clear();
+    }
 
-void devi::APNGImageReader::save_stack()
-{
-    if (!png_ptr)
+    // A frame without data can't be decoded, so neither can the frames
+    // after it (they might depend on it).
+    for (std::size_t i = 0; i < frame_index.size(); ++i)
     {
-        throw std::runtime_error("PNG not valid");
+        if (frame_index[i].num_chunks == 0)
+        {
+            frame_index.resize(i);
+            break;
+        }
     }
-    
-    if (setjmp(png_jmpbuf(png_ptr)))
+
+    if (header_chunks.size() < DEVI_APNG_IHDR_HEIGHT_OFFSET + 4 || std::memcmp(&header_chunks[12], "IHDR", 4) != 0)
     {
-        throw std::runtime_error("error reading APNG");
+        frame_index.clear();
     }
+
+    file.seek(position);
 }
 
 void devi::APNGImageReader::release()
 {
     current_frame = 0;
 
-    if (png_ptr && row_pointers)
-    {
-        for (auto i = 0; i < get_height(); ++i)
-        {
-            png_free(png_ptr, row_pointers[i]);
-        }
-
-        png_free(png_ptr, row_pointers);
-        row_pointers = nullptr;
-    }
-
     if (png_ptr && info_ptr)
     {
-        png_read_end(png_ptr, info_ptr);
+        // Nothing after the image data is used, so there's no point in
+        // png_read_end; it would fail (with no setjmp to return to) if the
+        // reader is released mid-animation or after indexed reads.
         png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
 
         png_ptr = nullptr;
         info_ptr = nullptr;
     }
+
+    is_indexed = false;
 }
 
 int devi::APNGImageReader::get_width() const
@@ -126,7 +464,7 @@ int devi::APNGImageReader::get_height() const
 {
     if (png_ptr && info_ptr)
     {
-        return png_get_image_width(png_ptr, info_ptr);
+        return png_get_image_height(png_ptr, info_ptr);
     }
 
     return 0;
@@ -137,6 +475,11 @@ int devi::APNGImageReader::get_current_frame() const
     return current_frame;
 }
 
+bool devi::APNGImageReader::is_buffered() const
+{
+    return file.is_buffered();
+}
+
 int devi::APNGImageReader::get_num_frames() const
 {
     if (png_ptr && info_ptr)
@@ -147,11 +490,40 @@ int devi::APNGImageReader::get_num_frames() const
     return 0;
 }
 
-bool devi::APNGImageReader::read(Frame& frame)
+void devi::APNGImageReader::read_pixels(png_structp png, png_infop, const Frame& frame, Pixel* pixels, APNGRows& rows)
+{
+    // With the transforms set up, rows have the same layout as Pixel, so
+    // libpng can decode straight into the destination.
+    resize_buffer(rows.pointers, frame.height);
+    for (auto j = 0; j < frame.height; ++j)
+    {
+        rows.pointers[j] = (png_bytep)(pixels + j * frame.width);
+    }
+
+    png_read_image(png, &rows.pointers[0]);
+}
+
+bool devi::APNGImageReader::read_into(Frame& frame, Pixel* pixels, std::size_t num_pixels)
 {
+    if (is_indexed)
+    {
+        return read_indexed(frame, pixels, num_pixels);
+    }
+
+    if (!png_ptr || !info_ptr)
+    {
+        throw std::runtime_error("PNG not valid");
+    }
+
+    // As in open(), errors from png_read_frame_head and png_read_image (in
+    // read_pixels) land here.
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        throw std::runtime_error("error reading APNG");
+    }
+
     while (current_frame < png_get_num_frames(png_ptr, info_ptr))
     {
-        save_stack();
         png_read_frame_head(png_ptr, info_ptr);
         ++current_frame;
 
@@ -168,77 +540,14 @@ bool devi::APNGImageReader::read(Frame& frame)
                 &dispose_op, &blend_op
             );
 
-            switch (dispose_op)
-            {
-                case PNG_DISPOSE_OP_NONE:
-                    frame.dispose_op = DISPOSE_OP_NONE;
-                    break;
-                
-                case PNG_DISPOSE_OP_PREVIOUS:
-                    frame.dispose_op = DISPOSE_OP_PREVIOUS;
-                    break;
-
-                case PNG_DISPOSE_OP_BACKGROUND:
-                default:
-                    frame.dispose_op = DISPOSE_OP_BACKGROUND;
-                    break;
-            }
-
-            switch (blend_op)
-            {
-                case PNG_BLEND_OP_OVER:
-                    frame.blend_op = BLEND_OP_OVER;
-                    break;
-                
-                case PNG_BLEND_OP_SOURCE:
-                default:
-                    frame.blend_op = BLEND_OP_SOURCE;
-                    break;
-            }
+            devi_apng_set_frame_control(frame, delay_numerator, delay_denominator, dispose_op, blend_op);
 
-            if (delay_denominator == 0)
+            if ((std::size_t)frame.width * frame.height > num_pixels)
             {
-                delay_denominator = 100;
+                throw std::runtime_error("frame larger than image");
             }
 
-            if (delay_numerator == 0)
-            {
-                frame.delay = 0;
-            }
-            else
-            {
-                frame.delay = (float)delay_numerator / (float)delay_denominator;
-            }
-
-            png_read_image(png_ptr, row_pointers);
-            frame.pixels.clear();
-
-            for (auto j = 0; j < frame.height; ++j)
-            {
-                for (auto i = 0; i < frame.width; ++i)
-                {
-                    switch (png_get_color_type(png_ptr, info_ptr))
-                    {
-                        case PNG_COLOR_TYPE_RGB:
-                        {
-                            auto pixel_byte_data = row_pointers[j] + 3 * i;
-                            Pixel pixel = { pixel_byte_data[0], pixel_byte_data[1], pixel_byte_data[2], 255 };
-                            frame.pixels.push_back(pixel);
-
-                            break;
-                        }
-
-                        case PNG_COLOR_TYPE_RGBA:
-                        {
-                            auto pixel_byte_data = row_pointers[j] + 4 * i;
-                            Pixel pixel = { pixel_byte_data[0], pixel_byte_data[1], pixel_byte_data[2], pixel_byte_data[3] };
-                            frame.pixels.push_back(pixel);
-
-                            break;
-                        }
-                    }
-                }
-            }
+            read_pixels(png_ptr, info_ptr, frame, pixels, rows);
 
             return true;
         }
@@ -247,6 +556,141 @@ bool devi::APNGImageReader::read(Frame& frame)
     return false;
 }
 
+void devi::APNGImageReader::decode_indexed(int index, Frame& frame, Pixel* pixels, std::size_t num_pixels, APNGRows& rows)
+{
+    auto& frame_info = frame_index[index];
+    frame.x = frame_info.x;
+    frame.y = frame_info.y;
+    frame.width = frame_info.width;
+    frame.height = frame_info.height;
+    frame.blend_op = frame_info.blend_op;
+    frame.dispose_op = frame_info.dispose_op;
+    frame.delay = frame_info.delay;
+
+    // The fcTL fields are 32-bit, so they're added in 64 bits to not wrap.
+    if ((std::uint64_t)frame.x + frame.width > (std::uint64_t)get_width() || (std::uint64_t)frame.y + frame.height > (std::uint64_t)get_height())
+    {
+        throw std::runtime_error("frame extends past image");
+    }
+
+    if ((std::size_t)frame.width * frame.height > num_pixels)
+    {
+        throw std::runtime_error("frame larger than image");
+    }
+
+    // The frame is decoded as a standalone PNG built from the index: the
+    // header chunks with the frame's size, then its data as IDAT chunks.
+    APNGFrameStream stream;
+    stream.file = &file;
+    stream.chunks = &frame_chunks[frame_info.first_chunk];
+    stream.num_chunks = frame_info.num_chunks;
+
+    stream.prefix.assign(header_chunks.begin(), header_chunks.end());
+    devi_apng_write_uint32(&stream.prefix[DEVI_APNG_IHDR_WIDTH_OFFSET], frame.width);
+    devi_apng_write_uint32(&stream.prefix[DEVI_APNG_IHDR_HEIGHT_OFFSET], frame.height);
+
+    auto frame_png_ptr = png_create_read_struct_2(
+        PNG_LIBPNG_VER_STRING,
+        nullptr, nullptr, nullptr,
+        nullptr, &devi_apng_malloc, &devi_apng_free);
+    auto frame_info_ptr = png_create_info_struct(frame_png_ptr);
+
+    if (setjmp(png_jmpbuf(frame_png_ptr)))
+    {
+        png_destroy_read_struct(&frame_png_ptr, &frame_info_ptr, nullptr);
+        throw std::runtime_error("error reading APNG frame");
+    }
+
+    // The chunks were rewritten, so their CRCs can't be checked.
+    png_set_crc_action(frame_png_ptr, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+    png_set_read_fn(frame_png_ptr, &stream, &devi_apng_read_frame_stream);
+
+    try
+    {
+        png_read_info(frame_png_ptr, frame_info_ptr);
+        devi_apng_set_transforms(frame_png_ptr);
+        read_pixels(frame_png_ptr, frame_info_ptr, frame, pixels, rows);
+    }
+    catch (...)
+    {
+        png_destroy_read_struct(&frame_png_ptr, &frame_info_ptr, nullptr);
+        throw;
+    }
+
+    png_destroy_read_struct(&frame_png_ptr, &frame_info_ptr, nullptr);
+}
+
+bool devi::APNGImageReader::read_indexed(Frame& frame, Pixel* pixels, std::size_t num_pixels)
+{
+    if (current_frame >= (int)frame_index.size())
+    {
+        return false;
+    }
+
+    decode_indexed(current_frame, frame, pixels, num_pixels, rows);
+
+    ++current_frame;
+    return true;
+}
+
+bool devi::APNGImageReader::can_decode_frames() const
+{
+    return file.is_buffered() && !frame_index.empty();
+}
+
+bool devi::APNGImageReader::decode_frame(int index, Frame& frame, Pixel* pixels, std::size_t num_pixels)
+{
+    if (!can_decode_frames())
+    {
+        throw std::runtime_error("frames can only be decoded on their own from buffered files");
+    }
+
+    if (index < 0 || index >= (int)frame_index.size())
+    {
+        return false;
+    }
+
+    // Nothing shared is written, so this can run on several threads.
+    APNGRows frame_rows;
+    decode_indexed(index, frame, pixels, num_pixels, frame_rows);
+
+    return true;
+}
+
+bool devi::APNGImageReader::seek(int frame)
+{
+    if (frame < 0 || frame >= (int)frame_index.size())
+    {
+        return false;
+    }
+
+    // libpng can only step forward through an APNG, so frames after a seek
+    // are decoded from the index until the next restart.
+    if (frame == 0)
+    {
+        open();
+    }
+    else
+    {
+        is_indexed = true;
+        current_frame = frame;
+    }
+
+    return true;
+}
+
+bool devi::APNGImageReader::get_frame_delay(int index, float& delay) const
+{
+    if (index < 0 || index >= (int)frame_index.size())
+    {
+        return false;
+    }
+
+    delay = frame_index[index].delay;
+
+    return true;
+}
+
 void devi::APNGImageReader::restart()
 {
     open();
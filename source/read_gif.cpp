@@ -1,11 +1,22 @@
+#include <algorithm>
 #include <cstdint>
 #include <utility>
 #include <stdexcept>
+#include "devi/gif_lzw.hpp"
+#include "devi/memory.hpp"
 #include "devi/read_gif.hpp"
 
-devi::GIFImageReader::GIFImageReader(LuaFile&& file) : file(std::move(file))
+static_assert(sizeof(GifColorType) == 3, "GIF colors must be packed RGB triples");
+
+static const int DEVI_GIF_INTERLACED_OFFSETS[] = { 0, 4, 2, 1 };
+static const int DEVI_GIF_INTERLACED_JUMPS[] = { 8, 8, 4, 2 };
+
+devi::GIFImageReader::GIFImageReader(LuaFile&& file, int decoder) :
+    file(std::move(file)),
+    decoder(decoder)
 {
     open();
+    build_index();
 }
 
 devi::GIFImageReader::~GIFImageReader()
@@ -37,50 +48,150 @@ void devi::GIFImageReader::open()
     }
 }
 
-void devi::GIFImageReader::release()
+static std::uint8_t devi_gif_read_byte(devi::LuaFile& file)
 {
-    current_frame = 0;
-
-    if (gif)
+    std::uint8_t value;
+    if (file.read(&value, 1) != 1)
     {
-        DGifCloseFile(gif, nullptr);
-        gif = nullptr;
+        throw std::runtime_error("unexpected end of GIF");
     }
+
+    return value;
 }
 
-void devi::GIFImageReader::render(Frame& frame, const GifPixelType* row, int y, int transparent_color)
+static std::uint16_t devi_gif_read_word(devi::LuaFile& file)
 {
-    ColorMapObject* color_map = gif->Image.ColorMap ? gif->Image.ColorMap : gif->SColorMap;
-    if (!color_map)
+    auto low = devi_gif_read_byte(file);
+    auto high = devi_gif_read_byte(file);
+
+    return (std::uint16_t)(low | (high << 8));
+}
+
+static void devi_gif_skip_sub_blocks(devi::LuaFile& file)
+{
+    while (auto size = devi_gif_read_byte(file))
     {
-        throw std::runtime_error("couldn't render GIF row; no color map found");
+        file.seek(file.tell() + size);
     }
+}
 
-    for (auto i = 0; i < frame.width; ++i)
-    {
-        auto color_index = row[i];
+void devi::GIFImageReader::build_index()
+{
+    // giflib has already read the header, logical screen descriptor, and
+    // global color map, so the first record starts here.
+    auto start = file.tell();
 
-        auto& pixel = frame.pixels.at(y * frame.width + i);
-        if (transparent_color >= 0 and color_index == transparent_color)
-        {
-            pixel.red = 0;
-            pixel.green = 0;
-            pixel.blue = 0;
-            pixel.alpha = 0;
-        }
-        else if (color_index < color_map->ColorCount)
-        {
-            auto color_map_entry = &color_map->Colors[color_index];
-            pixel.red = color_map_entry->Red;
-            pixel.green = color_map_entry->Green;
-            pixel.blue = color_map_entry->Blue;
-            pixel.alpha = 255;
-        }
-        else
+    GIFFrameIndex current;
+    current.offset = start;
+
+    try
+    {
+        bool is_done = false;
+        while (!is_done)
         {
-            throw std::runtime_error("color index invalid or out of bounds");
+            switch (devi_gif_read_byte(file))
+            {
+                case 0x21:
+                {
+                    auto label = devi_gif_read_byte(file);
+                    if (label != GRAPHICS_EXT_FUNC_CODE)
+                    {
+                        devi_gif_skip_sub_blocks(file);
+                        break;
+                    }
+
+                    auto size = devi_gif_read_byte(file);
+                    if (size == 4)
+                    {
+                        auto packed = devi_gif_read_byte(file);
+                        auto delay = devi_gif_read_word(file);
+                        auto transparent_color = devi_gif_read_byte(file);
+
+                        switch ((packed >> 2) & 0x07)
+                        {
+                            case DISPOSE_DO_NOT:
+                            default:
+                                current.dispose_op = DISPOSE_OP_NONE;
+                                break;
+                            case DISPOSE_BACKGROUND:
+                                current.dispose_op = DISPOSE_OP_BACKGROUND;
+                                break;
+                            case DISPOSE_PREVIOUS:
+                                current.dispose_op = DISPOSE_OP_PREVIOUS;
+                                break;
+                        }
+
+                        current.delay = delay / 100.0f;
+                        current.transparent_color = (packed & 0x01) ? transparent_color : -1;
+                    }
+                    else
+                    {
+                        file.seek(file.tell() + size);
+                    }
+
+                    devi_gif_skip_sub_blocks(file);
+                    break;
+                }
+
+                case 0x2c:
+                {
+                    current.left = devi_gif_read_word(file);
+                    current.top = devi_gif_read_word(file);
+                    current.width = devi_gif_read_word(file);
+                    current.height = devi_gif_read_word(file);
+
+                    auto packed = devi_gif_read_byte(file);
+                    current.is_interlaced = (packed & 0x40) != 0;
+
+                    if (packed & 0x80)
+                    {
+                        current.color_map_offset = file.tell();
+                        current.color_map_size = 1 << ((packed & 0x07) + 1);
+
+                        file.seek(file.tell() + current.color_map_size * 3);
+                    }
+
+                    // LZW minimum code size, then the image data.
+                    current.data_offset = file.tell();
+                    devi_gif_read_byte(file);
+                    devi_gif_skip_sub_blocks(file);
+                    current.data_size = file.tell() - current.data_offset;
+
+                    frame_index.push_back(current);
+
+                    current = GIFFrameIndex();
+                    current.offset = file.tell();
+                    break;
+                }
+
+                default:
+                    is_done = true;
+                    break;
+            }
         }
     }
+    catch (const std::runtime_error&)
+    {
+        // A truncated frame is left out; giflib fails on it anyway.
+    }
+
+    file.seek(start);
+}
+
+void devi::GIFImageReader::release()
+{
+    current_frame = 0;
+
+    if (gif)
+    {
+        DGifCloseFile(gif, nullptr);
+        gif = nullptr;
+    }
+}
+
+void devi::GIFImageReader::render(const Palette& palette, Frame& frame, Pixel* pixels, const GifPixelType* row, int y)
+{
+    expand_palette(palette, row, pixels + y * frame.width, frame.width);
 }
 
 int devi::GIFImageReader::get_width() const
@@ -108,22 +219,34 @@ int devi::GIFImageReader::get_current_frame() const
     return current_frame;
 }
 
+bool devi::GIFImageReader::is_buffered() const
+{
+    return file.is_buffered();
+}
+
 int devi::GIFImageReader::get_num_frames() const
 {
-    return 0;
+    return (int)frame_index.size();
 }
 
-bool devi::GIFImageReader::read(Frame& frame)
+const std::vector<devi::GIFFrameIndex>& devi::GIFImageReader::get_frame_index() const
 {
-    static const int interlaced_offsets[] = { 0, 4, 2, 1 };
-    static const int interlaced_jumps[] = { 8, 8, 4, 2 };
+    return frame_index;
+}
 
+bool devi::GIFImageReader::read_frame(GifFileType* source, Frame& frame, Pixel* pixels, std::size_t num_pixels, std::vector<GifPixelType>& row, Palette& palette)
+{
     GifRecordType type = UNDEFINED_RECORD_TYPE;
 
+    // Frames without a Graphics Control Extension don't inherit anything
+    // from the previous frame.
+    frame.delay = 0.0f;
+    frame.dispose_op = DISPOSE_OP_NONE;
+
     int transparent_color = -1;
     while (type != IMAGE_DESC_RECORD_TYPE)
     {
-        if (!DGifGetRecordType(gif, &type))
+        if (!DGifGetRecordType(source, &type))
         {
             throw std::runtime_error("could not read GIF");
         }
@@ -135,7 +258,7 @@ bool devi::GIFImageReader::read(Frame& frame)
                 GifByteType* gif_extension_buffer;
                 int gif_extension_code;
 
-                if (!DGifGetExtension(gif, &gif_extension_code, &gif_extension_buffer))
+                if (!DGifGetExtension(source, &gif_extension_code, &gif_extension_buffer))
                 {
                     throw std::runtime_error("could not read GIF extension block");
                 }
@@ -165,7 +288,7 @@ bool devi::GIFImageReader::read(Frame& frame)
 
                 while (gif_extension_buffer)
                 {
-                    if (!DGifGetExtensionNext(gif, &gif_extension_buffer))
+                    if (!DGifGetExtensionNext(source, &gif_extension_buffer))
                     {
                         throw std::runtime_error("could not read next GIF extension block");
                     }
@@ -185,63 +308,398 @@ bool devi::GIFImageReader::read(Frame& frame)
         }
     }
 
-    if (!DGifGetImageDesc(gif))
+    if (!DGifGetImageDesc(source))
     {
         throw std::runtime_error("error reading GIF frame");
     }
 
+    if ((std::size_t)get_width() * get_height() > num_pixels)
+    {
+        throw std::runtime_error("buffer too small for image");
+    }
+
+    // Some encoders write frames that hang off the edge of the logical
+    // screen. Only the visible part is kept, so a frame never needs more
+    // room than the whole image.
+    int image_width = source->Image.Width;
+    int image_height = source->Image.Height;
+    int left = std::min(source->Image.Left, get_width());
+    int top = std::min(source->Image.Top, get_height());
+
     frame.blend_op = BLEND_OP_OVER;
-    frame.x = gif->Image.Left;
-    frame.y = gif->Image.Top;
-    frame.width = gif->Image.Width;
-    frame.height = gif->Image.Height;
-    frame.pixels.resize(frame.width * frame.height);
+    frame.x = left;
+    frame.y = top;
+    frame.width = std::min(image_width, get_width() - left);
+    frame.height = std::min(image_height, get_height() - top);
 
-    std::vector<GifPixelType> gif_row;
-    gif_row.resize(frame.width, transparent_color >= 0 ? transparent_color : 0);
+    ColorMapObject* color_map = source->Image.ColorMap ? source->Image.ColorMap : source->SColorMap;
+    if (!color_map)
+    {
+        throw std::runtime_error("couldn't render GIF frame; no color map found");
+    }
 
-    if (gif->Image.Interlace)
+    build_palette(palette, (const std::uint8_t*)color_map->Colors, color_map->ColorCount, transparent_color);
+
+    resize_buffer(row, image_width);
+
+    if (source->Image.Interlace)
     {
         for (auto i = 0; i < 4; ++i)
         {
-            for (auto j = interlaced_offsets[i]; j < frame.height; j += interlaced_jumps[i])
+            for (auto j = DEVI_GIF_INTERLACED_OFFSETS[i]; j < image_height; j += DEVI_GIF_INTERLACED_JUMPS[i])
             {
-                if (!DGifGetLine(gif, &gif_row[0], frame.width))
+                if (!DGifGetLine(source, &row[0], image_width))
                 {
                     throw std::runtime_error("couldn't read interlaced GIF row");
                 }
 
-                render(frame, &gif_row[0], j, transparent_color);
+                if (j < frame.height)
+                {
+                    render(palette, frame, pixels, &row[0], j);
+                }
             }
         }
     }
     else
     {
-        for (auto j = 0; j < frame.height; ++j)
+        for (auto j = 0; j < image_height; ++j)
         {
-            if (!DGifGetLine(gif, &gif_row[0], frame.width))
+            if (!DGifGetLine(source, &row[0], image_width))
             {
                 throw std::runtime_error("couldn't read GIF row");
             }
 
-            render(frame, &gif_row[0], j, transparent_color);
+            if (j < frame.height)
+            {
+                render(palette, frame, pixels, &row[0], j);
+            }
         }
     }
 
+    return true;
+}
+
+struct GIFFrameCursor
+{
+    const devi::LuaFile* file;
+    std::size_t position;
+};
+
+static int devi_gif_read_at(GifFileType* gif, GifByteType* buffer, int size)
+{
+    auto cursor = (GIFFrameCursor*)gif->UserData;
+    auto num_bytes_read = cursor->file->read_at(cursor->position, buffer, size);
+    cursor->position += num_bytes_read;
+
+    return (int)num_bytes_read;
+}
+
+#if defined(DEVI_GIF_VERIFY)
+// Debug builds decode every frame with giflib as well and compare the
+// indices, to catch the native decoder going wrong.
+static void devi_gif_verify(const devi::LuaFile& file, const devi::GIFFrameIndex& entry, const std::uint8_t* indices)
+{
+    // Streamed files can't be read at a position without disturbing them.
+    if (!file.is_buffered())
+    {
+        return;
+    }
+
+    GIFFrameCursor cursor = { &file, 0 };
+    auto gif = DGifOpen(&cursor, &devi_gif_read_at, nullptr);
+    if (!gif)
+    {
+        throw std::runtime_error("could not open GIF");
+    }
+
+    cursor.position = entry.offset;
+
+    std::vector<GifPixelType> row(entry.width);
+    bool is_same = true;
+
+    GifRecordType type = UNDEFINED_RECORD_TYPE;
+    while (is_same && type != IMAGE_DESC_RECORD_TYPE)
+    {
+        is_same = DGifGetRecordType(gif, &type) != GIF_ERROR;
+        if (is_same && type == EXTENSION_RECORD_TYPE)
+        {
+            GifByteType* extension;
+            int code;
+
+            is_same = DGifGetExtension(gif, &code, &extension) != GIF_ERROR;
+            while (is_same && extension)
+            {
+                is_same = DGifGetExtensionNext(gif, &extension) != GIF_ERROR;
+            }
+        }
+        else if (is_same && type != IMAGE_DESC_RECORD_TYPE)
+        {
+            is_same = false;
+        }
+    }
+
+    is_same = is_same && DGifGetImageDesc(gif) != GIF_ERROR;
+    for (auto j = 0; is_same && j < entry.height; ++j)
+    {
+        is_same =
+            DGifGetLine(gif, row.data(), entry.width) != GIF_ERROR &&
+            std::equal(row.begin(), row.end(), indices + (std::size_t)j * entry.width);
+    }
+
+    DGifCloseFile(gif, nullptr);
+
+    if (!is_same)
+    {
+        throw std::runtime_error("native GIF decoder doesn't match giflib");
+    }
+}
+#endif
+
+const std::uint8_t* devi::GIFImageReader::read_bytes(std::size_t offset, std::size_t size, std::vector<std::uint8_t>& storage)
+{
+    // The index was built by reading through these bytes, so they exist.
+    if (file.is_buffered())
+    {
+        return file.get_data() + offset;
+    }
+
+    resize_buffer(storage, size);
+
+    file.seek(offset);
+    if (file.read(storage.data(), size) != size)
+    {
+        throw std::runtime_error("unexpected end of GIF");
+    }
+
+    return storage.data();
+}
+
+bool devi::GIFImageReader::read_native(const GIFFrameIndex& entry, Frame& frame, Pixel* pixels, std::size_t num_pixels, std::vector<std::uint8_t>& indices, std::vector<std::uint8_t>& data, Palette& palette)
+{
+    if ((std::size_t)get_width() * get_height() > num_pixels)
+    {
+        throw std::runtime_error("buffer too small for image");
+    }
+
+    // The whole frame is decoded before it's rendered, so a frame far off
+    // the edge of the logical screen would need an index buffer larger
+    // than the image itself.
+    auto num_indices = (std::size_t)entry.width * entry.height;
+    if (num_indices > num_pixels)
+    {
+        return false;
+    }
+
+    int left = std::min(entry.left, get_width());
+    int top = std::min(entry.top, get_height());
+
+    frame.delay = entry.delay;
+    frame.dispose_op = entry.dispose_op;
+    frame.blend_op = BLEND_OP_OVER;
+    frame.x = left;
+    frame.y = top;
+    frame.width = std::min(entry.width, get_width() - left);
+    frame.height = std::min(entry.height, get_height() - top);
+
+    if (entry.color_map_size > 0)
+    {
+        auto colors = read_bytes(entry.color_map_offset, entry.color_map_size * 3, data);
+        build_palette(palette, colors, entry.color_map_size, entry.transparent_color);
+    }
+    else if (gif->SColorMap)
+    {
+        build_palette(palette, (const std::uint8_t*)gif->SColorMap->Colors, gif->SColorMap->ColorCount, entry.transparent_color);
+    }
+    else
+    {
+        throw std::runtime_error("couldn't render GIF frame; no color map found");
+    }
+
+    resize_buffer(indices, num_indices + GIF_LZW_PADDING);
+    decode_gif_lzw(read_bytes(entry.data_offset, entry.data_size, data), entry.data_size, indices.data(), num_indices);
+
+#if defined(DEVI_GIF_VERIFY)
+    devi_gif_verify(file, entry, indices.data());
+#endif
+
+    // Rows are stored in the order they were sent; interlaced ones are put
+    // in place as they're rendered.
+    auto row = indices.data();
+    if (entry.is_interlaced)
+    {
+        for (auto i = 0; i < 4; ++i)
+        {
+            for (auto j = DEVI_GIF_INTERLACED_OFFSETS[i]; j < entry.height; j += DEVI_GIF_INTERLACED_JUMPS[i])
+            {
+                if (j < frame.height)
+                {
+                    render(palette, frame, pixels, row, j);
+                }
+
+                row += entry.width;
+            }
+        }
+    }
+    else
+    {
+        for (auto j = 0; j < frame.height; ++j)
+        {
+            render(palette, frame, pixels, row, j);
+            row += entry.width;
+        }
+    }
+
+    return true;
+}
+
+bool devi::GIFImageReader::read_into(Frame& frame, Pixel* pixels, std::size_t num_pixels)
+{
+    bool is_read = false;
+    if (decoder == GIF_DECODER_NATIVE)
+    {
+        // Frames past the index are truncated; giflib fails on them too.
+        if (current_frame >= (int)frame_index.size())
+        {
+            return false;
+        }
+
+        auto& entry = frame_index[current_frame];
+        is_read = read_native(entry, frame, pixels, num_pixels, gif_indices, gif_data, gif_palette);
+
+        // giflib picks up from wherever the file was left.
+        if (!is_read)
+        {
+            file.seek(entry.offset);
+        }
+    }
+
+    if (!is_read && !read_frame(gif, frame, pixels, num_pixels, gif_row, gif_palette))
+    {
+        return false;
+    }
+
     ++current_frame;
     return true;
 }
 
+bool devi::GIFImageReader::can_decode_frames() const
+{
+    return file.is_buffered() && !frame_index.empty();
+}
+
+bool devi::GIFImageReader::decode_frame(int index, Frame& frame, Pixel* pixels, std::size_t num_pixels)
+{
+    if (!can_decode_frames())
+    {
+        throw std::runtime_error("frames can only be decoded on their own from buffered files");
+    }
+
+    if (index < 0 || index >= (int)frame_index.size())
+    {
+        return false;
+    }
+
+    if (decoder == GIF_DECODER_NATIVE)
+    {
+        std::vector<std::uint8_t> indices;
+        std::vector<std::uint8_t> data;
+        Palette palette;
+
+        if (read_native(frame_index[index], frame, pixels, num_pixels, indices, data, palette))
+        {
+            return true;
+        }
+    }
+
+    // Each call gets its own decoder and position in the file, so this can
+    // run on several threads.
+    GIFFrameCursor cursor = { &file, 0 };
+    auto frame_gif = DGifOpen(&cursor, &devi_gif_read_at, nullptr);
+    if (!frame_gif)
+    {
+        throw std::runtime_error("could not open GIF");
+    }
+
+    cursor.position = frame_index[index].offset;
+
+    std::vector<GifPixelType> row;
+    Palette palette;
+    bool result;
+
+    try
+    {
+        result = read_frame(frame_gif, frame, pixels, num_pixels, row, palette);
+    }
+    catch (...)
+    {
+        DGifCloseFile(frame_gif, nullptr);
+        throw;
+    }
+
+    DGifCloseFile(frame_gif, nullptr);
+
+    return result;
+}
+
+bool devi::GIFImageReader::seek(int frame)
+{
+    if (frame < 0 || frame >= (int)frame_index.size())
+    {
+        return false;
+    }
+
+    if (!gif)
+    {
+        open();
+    }
+
+    // giflib keeps a record of every image descriptor it reads; drop them
+    // so looping forever doesn't grow it.
+    GifFreeSavedImages(gif);
+    gif->ImageCount = 0;
+
+    file.seek(frame_index[frame].offset);
+    current_frame = frame;
+
+    return true;
+}
+
+bool devi::GIFImageReader::get_frame_delay(int index, float& delay) const
+{
+    if (index < 0 || index >= (int)frame_index.size())
+    {
+        return false;
+    }
+
+    delay = frame_index[index].delay;
+
+    return true;
+}
+
 void devi::GIFImageReader::restart()
 {
-    open();
+    if (!seek(0))
+    {
+        open();
+    }
+}
+
+int devi::get_gif_decoder(lua_State* L, int index)
+{
+    // In the same order as GIF_DECODER_*.
+    static const char* const names[] = { "native", "giflib", nullptr };
+
+    return luaL_checkoption(L, index, "native", names);
 }
 
+// GIFImageReader(file, decoder): decoder is "native" (the default) or
+// "giflib".
 static int devi_gif_image_reader_new(lua_State* L)
 {
+    auto decoder = devi::get_gif_decoder(L, 2);
     devi::LuaFile file(L, 1);
 
-    devi::push_image_reader(L, new devi::GIFImageReader(std::move(file)));
+    devi::push_image_reader(L, new devi::GIFImageReader(std::move(file), decoder));
 
     return 1;
 }
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include "devi/region.hpp"
+
+static bool devi_is_empty(const devi::Rectangle& rectangle)
+{
+    return rectangle.width == 0 || rectangle.height == 0;
+}
+
+static std::size_t devi_get_area(const devi::Rectangle& rectangle)
+{
+    return (std::size_t)rectangle.width * rectangle.height;
+}
+
+static bool devi_intersects(const devi::Rectangle& a, const devi::Rectangle& b)
+{
+    return
+        a.x < b.x + b.width && b.x < a.x + a.width &&
+        a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+static devi::Rectangle devi_get_union(const devi::Rectangle& a, const devi::Rectangle& b)
+{
+    if (devi_is_empty(a))
+    {
+        return b;
+    }
+
+    if (devi_is_empty(b))
+    {
+        return a;
+    }
+
+    auto left = std::min(a.x, b.x);
+    auto top = std::min(a.y, b.y);
+    auto right = std::max(a.x + a.width, b.x + b.width);
+    auto bottom = std::max(a.y + a.height, b.y + b.height);
+
+    return { left, top, right - left, bottom - top };
+}
+
+int devi::Region::get_num_rectangles() const
+{
+    return num_rectangles;
+}
+
+const devi::Rectangle& devi::Region::get_rectangle(int index) const
+{
+    if (index < 0 || index >= num_rectangles)
+    {
+        throw std::out_of_range("region rectangle index out of bounds");
+    }
+
+    return rectangles[index];
+}
+
+devi::Rectangle devi::Region::get_bounds() const
+{
+    Rectangle result;
+    for (auto i = 0; i < num_rectangles; ++i)
+    {
+        result = devi_get_union(result, rectangles[i]);
+    }
+
+    return result;
+}
+
+bool devi::Region::is_empty() const
+{
+    return num_rectangles == 0;
+}
+
+std::size_t devi::Region::get_area() const
+{
+    std::size_t result = 0;
+    for (auto i = 0; i < num_rectangles; ++i)
+    {
+        result += devi_get_area(rectangles[i]);
+    }
+
+    return result;
+}
+
+void devi::Region::remove(int index)
+{
+    rectangles[index] = rectangles[num_rectangles - 1];
+    rectangles[num_rectangles - 1] = {};
+    --num_rectangles;
+}
+
+void devi::Region::add(const Rectangle& rectangle)
+{
+    if (devi_is_empty(rectangle))
+    {
+        return;
+    }
+
+    // Merging can make the result overlap rectangles it didn't before, so
+    // keep going until nothing overlaps.
+    auto merged = rectangle;
+    for (auto i = 0; i < num_rectangles;)
+    {
+        if (devi_intersects(rectangles[i], merged))
+        {
+            merged = devi_get_union(rectangles[i], merged);
+            remove(i);
+            i = 0;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    if (num_rectangles < MAX_RECTANGLES)
+    {
+        rectangles[num_rectangles++] = merged;
+        return;
+    }
+
+    auto best_index = 0;
+    auto best_growth = std::numeric_limits<std::size_t>::max();
+    for (auto i = 0; i < num_rectangles; ++i)
+    {
+        auto growth =
+            devi_get_area(devi_get_union(rectangles[i], merged)) -
+            devi_get_area(rectangles[i]) - devi_get_area(merged);
+
+        if (growth < best_growth)
+        {
+            best_index = i;
+            best_growth = growth;
+        }
+    }
+
+    merged = devi_get_union(rectangles[best_index], merged);
+    remove(best_index);
+    add(merged);
+}
+
+void devi::Region::add(const Region& other)
+{
+    for (auto i = 0; i < other.num_rectangles; ++i)
+    {
+        add(other.rectangles[i]);
+    }
+}
+
+void devi::Region::set_rectangle(int index, const Rectangle& rectangle)
+{
+    if (index < 0 || index >= num_rectangles)
+    {
+        throw std::out_of_range("region rectangle index out of bounds");
+    }
+
+    if (devi_is_empty(rectangle))
+    {
+        remove(index);
+    }
+    else
+    {
+        rectangles[index] = rectangle;
+    }
+}
+
+void devi::Region::clear()
+{
+    for (auto i = 0; i < num_rectangles; ++i)
+    {
+        rectangles[i] = {};
+    }
+
+    num_rectangles = 0;
+}
@@ -0,0 +1,232 @@
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include "devi/lua_file.hpp"
+#include "devi/shared_cache.hpp"
+
+static std::mutex devi_shared_cache_mutex;
+// Several caches can share a key if they were made with different limits.
+static std::unordered_multimap<std::string, std::weak_ptr<devi::FrameCache>> devi_shared_caches;
+
+// SHA-256 (FIPS 180-4). A collision can't happen by accident, so matching
+// digests are as good as comparing the files.
+static const std::uint32_t DEVI_SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static std::uint32_t devi_sha256_rotate(std::uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static void devi_sha256_block(std::uint32_t* state, const std::uint8_t* block)
+{
+    std::uint32_t w[64];
+    for (auto i = 0; i < 16; ++i)
+    {
+        w[i] = ((std::uint32_t)block[i * 4] << 24) | ((std::uint32_t)block[i * 4 + 1] << 16) |
+            ((std::uint32_t)block[i * 4 + 2] << 8) | (std::uint32_t)block[i * 4 + 3];
+    }
+
+    for (auto i = 16; i < 64; ++i)
+    {
+        auto s0 = devi_sha256_rotate(w[i - 15], 7) ^ devi_sha256_rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        auto s1 = devi_sha256_rotate(w[i - 2], 17) ^ devi_sha256_rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    auto a = state[0], b = state[1], c = state[2], d = state[3];
+    auto e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (auto i = 0; i < 64; ++i)
+    {
+        auto s1 = devi_sha256_rotate(e, 6) ^ devi_sha256_rotate(e, 11) ^ devi_sha256_rotate(e, 25);
+        auto choice = (e & f) ^ (~e & g);
+        auto t1 = h + s1 + choice + DEVI_SHA256_K[i] + w[i];
+        auto s0 = devi_sha256_rotate(a, 2) ^ devi_sha256_rotate(a, 13) ^ devi_sha256_rotate(a, 22);
+        auto majority = (a & b) ^ (a & c) ^ (b & c);
+        auto t2 = s0 + majority;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void devi::sha256(const std::uint8_t* data, std::size_t size, std::uint8_t* digest)
+{
+    std::uint32_t state[8];
+    static const std::uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    std::memcpy(state, initial_state, sizeof(initial_state));
+
+    std::size_t i = 0;
+    for (; i + 64 <= size; i += 64)
+    {
+        devi_sha256_block(state, data + i);
+    }
+
+    // The rest, a one bit, zeroes, then the length in bits; one or two blocks.
+    std::uint8_t tail[128] = {};
+    auto remaining = size - i;
+    std::memcpy(tail, data + i, remaining);
+    tail[remaining] = 0x80;
+
+    auto tail_size = remaining + 9 <= 64 ? 64 : 128;
+    auto num_bits = (std::uint64_t)size * 8;
+    for (auto j = 0; j < 8; ++j)
+    {
+        tail[tail_size - 1 - j] = (std::uint8_t)(num_bits >> (j * 8));
+    }
+
+    for (auto j = 0; j < tail_size; j += 64)
+    {
+        devi_sha256_block(state, tail + j);
+    }
+
+    for (auto j = 0; j < 8; ++j)
+    {
+        digest[j * 4] = (std::uint8_t)(state[j] >> 24);
+        digest[j * 4 + 1] = (std::uint8_t)(state[j] >> 16);
+        digest[j * 4 + 2] = (std::uint8_t)(state[j] >> 8);
+        digest[j * 4 + 3] = (std::uint8_t)state[j];
+    }
+}
+
+std::string devi::get_shared_cache_key(const std::uint8_t* data, std::size_t size)
+{
+    std::uint8_t digest[SHA256_SIZE];
+    sha256(data, size, digest);
+
+    char key[96];
+    auto length = 0;
+    for (auto byte : digest)
+    {
+        length += std::snprintf(key + length, sizeof(key) - length, "%02x", (unsigned)byte);
+    }
+    std::snprintf(key + length, sizeof(key) - length, ":%llu", (unsigned long long)size);
+
+    return key;
+}
+
+std::shared_ptr<devi::FrameCache> devi::find_shared_cache(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(devi_shared_cache_mutex);
+
+    // Any complete cache will do for playback, whatever it was limited to.
+    std::shared_ptr<FrameCache> result;
+    auto range = devi_shared_caches.equal_range(key);
+    for (auto iter = range.first; iter != range.second; ++iter)
+    {
+        auto cache = iter->second.lock();
+        if (cache && (!result || cache->is_complete()))
+        {
+            result = cache;
+        }
+    }
+
+    return result;
+}
+
+std::shared_ptr<devi::FrameCache> devi::get_shared_cache(const std::string& key, std::size_t limit, int width, int height, bool is_compressed)
+{
+    std::lock_guard<std::mutex> lock(devi_shared_cache_mutex);
+
+    // Images only share a cache made with the same settings, so each one
+    // gets the limit it asked for rather than the first image's.
+    auto range = devi_shared_caches.equal_range(key);
+    for (auto iter = range.first; iter != range.second; ++iter)
+    {
+        auto cache = iter->second.lock();
+        if (!cache || cache->get_limit() != limit || cache->is_compressed() != is_compressed)
+        {
+            continue;
+        }
+
+        if (cache->get_width() != width || cache->get_height() != height)
+        {
+            throw std::runtime_error("shared cache does not match image size");
+        }
+
+        return cache;
+    }
+
+    // Drop entries of caches that no longer exist while we're here.
+    for (auto iter = devi_shared_caches.begin(); iter != devi_shared_caches.end();)
+    {
+        if (iter->second.expired())
+        {
+            iter = devi_shared_caches.erase(iter);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+
+    auto cache = std::make_shared<FrameCache>(limit, width, height, is_compressed);
+    devi_shared_caches.emplace(key, cache);
+
+    return cache;
+}
+
+static int devi_shared_cache_hash(lua_State* L)
+{
+    const std::uint8_t* data;
+    std::size_t size;
+
+    if (!devi::get_lua_buffer(L, 1, data, size))
+    {
+        return luaL_argerror(L, 1, "expected string, Data, or mapped file");
+    }
+
+    lua_pushstring(L, devi::get_shared_cache_key(data, size).c_str());
+
+    return 1;
+}
+
+static int devi_shared_cache_is_complete(lua_State* L)
+{
+    auto cache = devi::find_shared_cache(luaL_checkstring(L, 1));
+    lua_pushboolean(L, cache && cache->is_complete());
+
+    return 1;
+}
+
+static luaL_Reg DEVI_SHARED_CACHE_FUNCTIONS[] = {
+    { "hash", &devi_shared_cache_hash },
+    { "isComplete", &devi_shared_cache_is_complete },
+    { nullptr, nullptr }
+};
+
+extern "C"
+DEVI_EXPORT int luaopen_devi_SharedCache(lua_State* L)
+{
+    devi::luax_register(L, DEVI_SHARED_CACHE_FUNCTIONS);
+
+    return 1;
+}
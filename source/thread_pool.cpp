@@ -0,0 +1,70 @@
+#include <algorithm>
+#include "devi/thread_pool.hpp"
+
+devi::ThreadPool::ThreadPool(std::size_t num_threads)
+{
+    num_threads = std::max<std::size_t>(num_threads, 1);
+    for (std::size_t i = 0; i < num_threads; ++i)
+    {
+        threads.emplace_back(&ThreadPool::run, this);
+    }
+}
+
+devi::ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_stopping = true;
+    }
+
+    condition.notify_all();
+
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+}
+
+void devi::ThreadPool::run()
+{
+    while (true)
+    {
+        std::function<void()> task;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return is_stopping || !tasks.empty(); });
+
+            if (tasks.empty())
+            {
+                return;
+            }
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        task();
+    }
+}
+
+std::size_t devi::ThreadPool::get_num_threads() const
+{
+    return threads.size();
+}
+
+void devi::ThreadPool::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+
+    condition.notify_one();
+}
+
+devi::ThreadPool& devi::get_thread_pool()
+{
+    static ThreadPool thread_pool(std::thread::hardware_concurrency());
+    return thread_pool;
+}